@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * asynchronous engine
+ * one worker thread per adapter; any thread can queue requests on the
+ * adapter's submission ring (a bounded lock-free MPMC queue) without
+ * blocking; the worker runs them through the normal synchronous paths and
+ * either calls the request's callback or posts a completion to the
+ * completion ring and signals an eventfd the application can poll/epoll
+ * consecutive set/clear-bit requests for the same port are folded into a
+ * single port update
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define ASYNC_DEFAULT_DEPTH 256
+#define ASYNC_BURST 64
+
+typedef struct {
+	Mcp23017_t *dev_p;
+	Mcp23017AsyncReq_t req;
+} SubEntry_t;
+
+/*
+ * bounded MPMC queue (D. Vyukov): every cell carries a sequence number
+ * which tells producers and consumers whose turn it is, so both sides
+ * only ever CAS their own position counter
+ */
+typedef struct {
+	atomic_size_t seq;
+	union {
+		SubEntry_t sub;
+		Mcp23017Completion_t comp;
+	} u;
+} Cell_t;
+
+typedef struct {
+	Cell_t *cells_p;
+	size_t mask;
+	_Alignas(64) atomic_size_t enqPos;
+	_Alignas(64) atomic_size_t deqPos;
+} Ring_t;
+
+typedef struct {
+	Ring_t sq;
+	Ring_t cq;
+	unsigned depth;
+	atomic_uint outstanding;        // submitted, not yet completed/reaped
+	atomic_bool idle;               // worker is (about to be) asleep
+	atomic_bool stop;
+	int wakeFd;
+	int compFd;
+	pthread_t thread;
+	unsigned refCnt;
+} Engine_t;
+
+// start/stop (not the engines themselves)
+static pthread_mutex_t engineLock_G = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+ring_init (Ring_t *ring_p, size_t size)
+{
+	size_t i;
+
+	ring_p->cells_p = calloc(size, sizeof(*ring_p->cells_p));
+	if (ring_p->cells_p == NULL)
+		return false;
+	for (i = 0; i < size; ++i)
+		atomic_init(&ring_p->cells_p[i].seq, i);
+	ring_p->mask = size - 1;
+	atomic_init(&ring_p->enqPos, 0);
+	atomic_init(&ring_p->deqPos, 0);
+	return true;
+}
+
+static Cell_t *
+ring_enq_claim (Ring_t *ring_p, size_t *pos_p)
+{
+	Cell_t *cell_p;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = atomic_load_explicit(&ring_p->enqPos, memory_order_relaxed);
+	for (;;) {
+		cell_p = &ring_p->cells_p[pos & ring_p->mask];
+		seq = atomic_load_explicit(&cell_p->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring_p->enqPos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&ring_p->enqPos, memory_order_relaxed);
+	}
+
+	*pos_p = pos;
+	return cell_p;
+}
+
+static void
+ring_enq_publish (Cell_t *cell_p, size_t pos)
+{
+	atomic_store_explicit(&cell_p->seq, pos + 1, memory_order_release);
+}
+
+static Cell_t *
+ring_deq_claim (Ring_t *ring_p, size_t *pos_p)
+{
+	Cell_t *cell_p;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = atomic_load_explicit(&ring_p->deqPos, memory_order_relaxed);
+	for (;;) {
+		cell_p = &ring_p->cells_p[pos & ring_p->mask];
+		seq = atomic_load_explicit(&cell_p->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring_p->deqPos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&ring_p->deqPos, memory_order_relaxed);
+	}
+
+	*pos_p = pos;
+	return cell_p;
+}
+
+static void
+ring_deq_release (Ring_t *ring_p, Cell_t *cell_p, size_t pos)
+{
+	atomic_store_explicit(&cell_p->seq, pos + ring_p->mask + 1, memory_order_release);
+}
+
+static bool
+ring_empty (Ring_t *ring_p)
+{
+	Cell_t *cell_p;
+	size_t pos, seq;
+
+	pos = atomic_load_explicit(&ring_p->deqPos, memory_order_relaxed);
+	cell_p = &ring_p->cells_p[pos & ring_p->mask];
+	seq = atomic_load_explicit(&cell_p->seq, memory_order_acquire);
+	return (intptr_t)seq - (intptr_t)(pos + 1) < 0;
+}
+
+static unsigned
+sq_drain (Engine_t *eng_p, SubEntry_t *sub_p, unsigned max)
+{
+	Cell_t *cell_p;
+	size_t pos;
+	unsigned n;
+
+	for (n = 0; n < max; ++n) {
+		cell_p = ring_deq_claim(&eng_p->sq, &pos);
+		if (cell_p == NULL)
+			break;
+		sub_p[n] = cell_p->u.sub;
+		ring_deq_release(&eng_p->sq, cell_p, pos);
+	}
+	return n;
+}
+
+static void
+complete (Engine_t *eng_p, SubEntry_t *sub_p, bool ok, uint16_t val)
+{
+	Mcp23017Completion_t comp;
+	Mcp23017Error_t err;
+	Cell_t *cell_p;
+	size_t pos;
+
+	comp.dev_p = sub_p->dev_p;
+	comp.op = sub_p->req.op;
+	comp.tag = sub_p->req.tag;
+	comp.result = 0;
+	// the record was cleared before the op, so this is its own failure
+	if (!ok)
+		comp.result = mcp23017__last_error(&err)? -err.err : -EIO;
+	comp.val = val;
+
+	if (sub_p->req.cb != NULL) {
+		sub_p->req.cb(&comp, sub_p->req.cbArg_p);
+		atomic_fetch_sub_explicit(&eng_p->outstanding, 1, memory_order_release);
+		return;
+	}
+
+	// can't be full: 'outstanding' never exceeds the ring's size
+	cell_p = ring_enq_claim(&eng_p->cq, &pos);
+	cell_p->u.comp = comp;
+	ring_enq_publish(cell_p, pos);
+}
+
+/*
+ * sub_p[0] is a set/clear-bit request; fold it and any immediately
+ * following set/clear-bit requests for the same port into one update
+ * returns the number of requests consumed
+ */
+static unsigned
+run_bits (Engine_t *eng_p, SubEntry_t *sub_p, unsigned cnt, bool *posted_p)
+{
+	Mcp23017_t *dev_p = sub_p[0].dev_p;
+	Mcp23017Port_e port = (sub_p[0].req.bit < GPB0)? PORTA : PORTB;
+	uint8_t a = 0xff, x = 0x00, mask, iodir;
+	unsigned i, n;
+	bool ok;
+
+	for (n = 0; n < cnt; ++n) {
+		if ((sub_p[n].dev_p != dev_p) ||
+				((sub_p[n].req.op != MCP23017_ASYNC_SET_BIT) && (sub_p[n].req.op != MCP23017_ASYNC_CLEAR_BIT)))
+			break;
+		if ((sub_p[n].req.bit <= INVALID) || (sub_p[n].req.bit >= END))
+			break;
+		if (((sub_p[n].req.bit < GPB0)? PORTA : PORTB) != port)
+			break;
+
+		mask = (uint8_t)(1 << ((sub_p[n].req.bit - GPA0) % 8));
+		a &= (uint8_t)~mask;
+		x &= (uint8_t)~mask;
+		if (sub_p[n].req.op == MCP23017_ASYNC_SET_BIT)
+			x |= mask;
+	}
+
+	// anything odd (invalid bit, an input pin): one at a time, so the
+	// synchronous calls can report it
+	if ((n == 0) ||
+			!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, port), &iodir) ||
+			((iodir & (uint8_t)~a) != 0)) {
+		n = (n == 0)? 1 : n;
+		for (i = 0; i < n; ++i) {
+			mcp23017_priv__clear_error();
+			ok = (sub_p[i].req.op == MCP23017_ASYNC_SET_BIT)?
+				mcp23017__dev_set_bit(dev_p, sub_p[i].req.bit) :
+				mcp23017__dev_clear_bit(dev_p, sub_p[i].req.bit);
+			if (sub_p[i].req.cb == NULL)
+				*posted_p = true;
+			complete(eng_p, &sub_p[i], ok, 0);
+		}
+		return n;
+	}
+
+	mcp23017_priv__clear_error();
+	ok = mcp23017_priv__port_update(dev_p, port, a, x);
+	for (i = 0; i < n; ++i) {
+		if (sub_p[i].req.cb == NULL)
+			*posted_p = true;
+		complete(eng_p, &sub_p[i], ok, 0);
+	}
+	return n;
+}
+
+static void
+run (Engine_t *eng_p, SubEntry_t *sub_p, bool *posted_p)
+{
+	Mcp23017_t *dev_p = sub_p->dev_p;
+	uint8_t val8 = 0;
+	uint16_t val16 = 0;
+	bool ok = false;
+
+	mcp23017_priv__clear_error();
+	switch (sub_p->req.op) {
+		case MCP23017_ASYNC_READ_REG:
+			ok = mcp23017__dev_get_reg(dev_p, sub_p->req.reg, &val8);
+			val16 = val8;
+			break;
+		case MCP23017_ASYNC_WRITE_REG:
+			// as for a batch write
+			if (!mcp23017_priv__is_reg_valid(dev_p, sub_p->req.reg))
+				break;
+			ok = mcp23017_priv__write_reg(dev_p, sub_p->req.reg,
+					mcp23017_priv__keep_bank(dev_p, sub_p->req.reg, (uint8_t)sub_p->req.val));
+			break;
+		case MCP23017_ASYNC_READ_PORT16:
+			ok = mcp23017__dev_read_port16(dev_p, &val16);
+			break;
+		case MCP23017_ASYNC_WRITE_PORT16:
+			ok = mcp23017__dev_write_port16(dev_p, sub_p->req.val);
+			break;
+		default:
+			mcp23017_priv__set_error(dev_p, EINVAL, -1, -1);
+			break;
+	}
+
+	if (sub_p->req.cb == NULL)
+		*posted_p = true;
+	complete(eng_p, sub_p, ok, val16);
+}
+
+static void *
+worker (void *arg_p)
+{
+	Engine_t *eng_p = arg_p;
+	SubEntry_t sub[ASYNC_BURST];
+	unsigned i, n;
+	uint64_t v;
+	bool posted;
+
+	mcp23017_priv__rt_thread_init("async worker");
+	for (;;) {
+		n = sq_drain(eng_p, sub, ASYNC_BURST);
+		if (n == 0) {
+			if (atomic_load(&eng_p->stop))
+				break;
+
+			// announce we're going to sleep, then look once more so
+			// a submit racing with us can't be missed
+			atomic_store(&eng_p->idle, true);
+			atomic_thread_fence(memory_order_seq_cst);
+			n = sq_drain(eng_p, sub, ASYNC_BURST);
+			if ((n == 0) && !atomic_load(&eng_p->stop)) {
+				if (read(eng_p->wakeFd, &v, sizeof(v)) < 0)
+					mcp23017_priv__log_errno("read(async wake)");
+			}
+			atomic_store(&eng_p->idle, false);
+			if (n == 0)
+				continue;
+		}
+
+		posted = false;
+		for (i = 0; i < n; ) {
+			if ((sub[i].req.op == MCP23017_ASYNC_SET_BIT) || (sub[i].req.op == MCP23017_ASYNC_CLEAR_BIT))
+				i += run_bits(eng_p, &sub[i], n - i, &posted);
+			else
+				run(eng_p, &sub[i++], &posted);
+		}
+
+		if (posted) {
+			v = 1;
+			if (write(eng_p->compFd, &v, sizeof(v)) < 0)
+				mcp23017_priv__log_errno("write(async completion)");
+		}
+	}
+
+	return NULL;
+}
+
+static void
+engine_free (Engine_t *eng_p)
+{
+	if (eng_p->wakeFd >= 0)
+		close(eng_p->wakeFd);
+	if (eng_p->compFd >= 0)
+		close(eng_p->compFd);
+	free(eng_p->sq.cells_p);
+	free(eng_p->cq.cells_p);
+	free(eng_p);
+}
+
+/**
+ * start (or take another reference to) the asynchronous engine of the
+ * adapter 'dev_p' sits on; 'depth' (rounded up to a power of two, 0 for
+ * the default) bounds the number of requests in flight
+ */
+bool
+mcp23017__async_start (Mcp23017_t *dev_p, unsigned depth)
+{
+	Engine_t *eng_p;
+	size_t size;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	pthread_mutex_lock(&engineLock_G);
+	eng_p = dev_p->bus_p->async_p;
+	if (eng_p != NULL) {
+		++eng_p->refCnt;
+		pthread_mutex_unlock(&engineLock_G);
+		return true;
+	}
+
+	if (depth == 0)
+		depth = ASYNC_DEFAULT_DEPTH;
+	for (size = 2; size < depth; size <<= 1)
+		;
+
+	eng_p = calloc(1, sizeof(*eng_p));
+	if (eng_p == NULL) {
+		mcp23017_priv__log_errno("calloc(async)");
+		goto err1;
+	}
+	eng_p->wakeFd = -1;
+	eng_p->compFd = -1;
+	eng_p->depth = (unsigned)size;
+	atomic_init(&eng_p->outstanding, 0);
+	atomic_init(&eng_p->idle, false);
+	atomic_init(&eng_p->stop, false);
+	if (!ring_init(&eng_p->sq, size) || !ring_init(&eng_p->cq, size)) {
+		mcp23017_priv__log_errno("calloc(async ring)");
+		goto err2;
+	}
+	eng_p->wakeFd = eventfd(0, EFD_CLOEXEC);
+	eng_p->compFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((eng_p->wakeFd < 0) || (eng_p->compFd < 0)) {
+		mcp23017_priv__log_errno("eventfd(async)");
+		goto err2;
+	}
+	if (pthread_create(&eng_p->thread, NULL, worker, eng_p) != 0) {
+		mcp23017_priv__log("can't create async worker");
+		goto err2;
+	}
+
+	eng_p->refCnt = 1;
+	dev_p->bus_p->async_p = eng_p;
+	pthread_mutex_unlock(&engineLock_G);
+	return true;
+
+err2:
+	engine_free(eng_p);
+err1:
+	pthread_mutex_unlock(&engineLock_G);
+	return false;
+}
+
+/**
+ * drop a reference; the last one runs what is still queued, then stops the
+ * worker; uncollected completions are discarded
+ * don't call this from a completion callback
+ */
+void
+mcp23017__async_stop (Mcp23017_t *dev_p)
+{
+	Engine_t *eng_p;
+	uint64_t v = 1;
+
+	// preconds
+	if (dev_p == NULL)
+		return;
+
+	pthread_mutex_lock(&engineLock_G);
+	eng_p = dev_p->bus_p->async_p;
+	if ((eng_p == NULL) || (--eng_p->refCnt > 0)) {
+		pthread_mutex_unlock(&engineLock_G);
+		return;
+	}
+	dev_p->bus_p->async_p = NULL;
+	pthread_mutex_unlock(&engineLock_G);
+
+	atomic_store(&eng_p->stop, true);
+	if (write(eng_p->wakeFd, &v, sizeof(v)) < 0)
+		mcp23017_priv__log_errno("write(async wake)");
+	pthread_join(eng_p->thread, NULL);
+	engine_free(eng_p);
+}
+
+/*
+ * pin the worker of 'dev_p's adapter to 'cpu'
+ */
+bool
+mcp23017_priv__async_pin (Mcp23017_t *dev_p, int cpu)
+{
+	Engine_t *eng_p;
+	cpu_set_t set;
+	int ret = -1;
+
+	if ((cpu < 0) || (cpu >= CPU_SETSIZE))
+		return false;
+	CPU_ZERO(&set);
+	CPU_SET((unsigned)cpu, &set);
+
+	pthread_mutex_lock(&engineLock_G);
+	eng_p = dev_p->bus_p->async_p;
+	if (eng_p != NULL) {
+		ret = pthread_setaffinity_np(eng_p->thread, sizeof(set), &set);
+		if (ret != 0)
+			mcp23017_priv__log("can't pin async worker to cpu %d", cpu);
+	}
+	pthread_mutex_unlock(&engineLock_G);
+	return ret == 0;
+}
+
+/**
+ * queue 'req_p' for 'dev_p' without waiting for the bus
+ * returns false with errno set to EAGAIN if 'depth' requests are already
+ * in flight (completions not yet reaped count as in flight)
+ */
+bool
+mcp23017__async_submit (Mcp23017_t *dev_p, const Mcp23017AsyncReq_t *req_p)
+{
+	Engine_t *eng_p;
+	Cell_t *cell_p;
+	size_t pos;
+	uint64_t v = 1;
+
+	// preconds
+	if ((dev_p == NULL) || (req_p == NULL)) {
+		errno = EINVAL;
+		return false;
+	}
+	eng_p = dev_p->bus_p->async_p;
+	if (eng_p == NULL) {
+		errno = ENODEV;
+		return false;
+	}
+
+	if (atomic_fetch_add_explicit(&eng_p->outstanding, 1, memory_order_acquire) >= eng_p->depth) {
+		atomic_fetch_sub_explicit(&eng_p->outstanding, 1, memory_order_relaxed);
+		errno = EAGAIN;
+		return false;
+	}
+
+	cell_p = ring_enq_claim(&eng_p->sq, &pos);
+	cell_p->u.sub.dev_p = dev_p;
+	cell_p->u.sub.req = *req_p;
+	ring_enq_publish(cell_p, pos);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange(&eng_p->idle, false)) {
+		if (write(eng_p->wakeFd, &v, sizeof(v)) < 0)
+			mcp23017_priv__log_errno("write(async wake)");
+	}
+	return true;
+}
+
+/**
+ * an eventfd that is readable when completions are waiting to be reaped
+ * (requests with a callback don't signal it); suitable for poll/epoll
+ */
+int
+mcp23017__async_fd (Mcp23017_t *dev_p)
+{
+	Engine_t *eng_p;
+
+	// preconds
+	if (dev_p == NULL)
+		return -1;
+	eng_p = dev_p->bus_p->async_p;
+	if (eng_p == NULL)
+		return -1;
+
+	return eng_p->compFd;
+}
+
+/**
+ * collect up to 'max' completions (of any chip on 'dev_p's adapter),
+ * without blocking; returns the number collected, or -1
+ */
+int
+mcp23017__async_reap (Mcp23017_t *dev_p, Mcp23017Completion_t *comp_p, unsigned max)
+{
+	Engine_t *eng_p;
+	Cell_t *cell_p;
+	size_t pos;
+	unsigned n;
+	uint64_t v;
+
+	// preconds
+	if ((dev_p == NULL) || (comp_p == NULL))
+		return -1;
+	eng_p = dev_p->bus_p->async_p;
+	if (eng_p == NULL)
+		return -1;
+
+	// clear the eventfd first: anything posted after this re-arms it
+	if ((read(eng_p->compFd, &v, sizeof(v)) < 0) && (errno != EAGAIN))
+		mcp23017_priv__log_errno("read(async completion)");
+
+	for (n = 0; n < max; ++n) {
+		cell_p = ring_deq_claim(&eng_p->cq, &pos);
+		if (cell_p == NULL)
+			break;
+		comp_p[n] = cell_p->u.comp;
+		ring_deq_release(&eng_p->cq, cell_p, pos);
+		atomic_fetch_sub_explicit(&eng_p->outstanding, 1, memory_order_release);
+	}
+
+	// more than 'max' were waiting: keep the fd readable
+	if ((n == max) && !ring_empty(&eng_p->cq)) {
+		v = 1;
+		if (write(eng_p->compFd, &v, sizeof(v)) < 0)
+			mcp23017_priv__log_errno("write(async completion)");
+	}
+	return (int)n;
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * batches of register reads/writes, possibly spanning several chips and
+ * several adapters; each adapter's share of the batch is handed to the bus
+ * layer in one go so it can be packed into as few I2C_RDWR ioctls as the
+ * kernel allows
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define IOCON_BANK 0x80
+
+typedef struct {
+	Mcp23017_t *dev_p;
+	uint8_t val;
+	bool raw;               // caller's buffer, no layout checks or caching
+	Mcp23017Xfer_t xfer;
+} BatchOp_t;
+
+struct Mcp23017Batch_s {
+	BatchOp_t *ops_p;
+	unsigned cnt;
+	unsigned max;
+	Mcp23017Xfer_t *xfers_p;        // per-bus staging used by submit
+	unsigned *idx_p;
+};
+
+Mcp23017Batch_t *
+mcp23017__batch_new (void)
+{
+	Mcp23017Batch_t *batch_p;
+
+	batch_p = calloc(1, sizeof(*batch_p));
+	if (batch_p == NULL)
+		mcp23017_priv__log_errno("calloc(batch)");
+	return batch_p;
+}
+
+void
+mcp23017__batch_free (Mcp23017Batch_t *batch_p)
+{
+	// preconds
+	if (batch_p == NULL)
+		return;
+
+	free(batch_p->ops_p);
+	free(batch_p->xfers_p);
+	free(batch_p->idx_p);
+	free(batch_p);
+}
+
+/**
+ * forget all queued ops; storage is kept for the next round
+ */
+void
+mcp23017__batch_reset (Mcp23017Batch_t *batch_p)
+{
+	// preconds
+	if (batch_p == NULL)
+		return;
+
+	batch_p->cnt = 0;
+}
+
+unsigned
+mcp23017__batch_count (const Mcp23017Batch_t *batch_p)
+{
+	// preconds
+	if (batch_p == NULL)
+		return 0;
+
+	return batch_p->cnt;
+}
+
+static bool
+batch_grow (Mcp23017Batch_t *batch_p)
+{
+	unsigned max;
+	BatchOp_t *ops_p;
+	Mcp23017Xfer_t *xfers_p;
+	unsigned *idx_p;
+
+	if (batch_p->cnt < batch_p->max)
+		return true;
+
+	max = (batch_p->max == 0)? 16 : batch_p->max * 2;
+	ops_p = realloc(batch_p->ops_p, max * sizeof(*ops_p));
+	if (ops_p == NULL)
+		return false;
+	batch_p->ops_p = ops_p;
+	xfers_p = realloc(batch_p->xfers_p, max * sizeof(*xfers_p));
+	if (xfers_p == NULL)
+		return false;
+	batch_p->xfers_p = xfers_p;
+	idx_p = realloc(batch_p->idx_p, max * sizeof(*idx_p));
+	if (idx_p == NULL)
+		return false;
+	batch_p->idx_p = idx_p;
+
+	batch_p->max = max;
+	return true;
+}
+
+static int
+batch_add (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, bool read, uint8_t val, uint8_t *val_p)
+{
+	BatchOp_t *op_p;
+
+	// preconds
+	if ((batch_p == NULL) || (dev_p == NULL))
+		return -1;
+	if (!mcp23017_priv__is_reg_valid(dev_p, reg))
+		return -1;
+	if (read && (val_p == NULL))
+		return -1;
+
+	// as with mcp23017__dev_restore(), IOCON.BANK stays as the handle was
+	// opened
+	if (!read)
+		val = mcp23017_priv__keep_bank(dev_p, reg, val);
+
+	if (!batch_grow(batch_p)) {
+		mcp23017_priv__log_errno("batch_add()");
+		return -1;
+	}
+
+	op_p = &batch_p->ops_p[batch_p->cnt];
+	op_p->dev_p = dev_p;
+	op_p->val = val;
+	op_p->raw = false;
+	op_p->xfer.addr = dev_p->addr;
+	op_p->xfer.reg = reg;
+	op_p->xfer.read = read;
+	op_p->xfer.fixedReg = false;
+	op_p->xfer.noRetry = false;
+	op_p->xfer.len = 1;
+	op_p->xfer.buf_p = read? val_p : NULL;
+	op_p->xfer.result = -EINPROGRESS;
+
+	return (int)batch_p->cnt++;
+}
+
+/**
+ * queue a write of 'val' to register 'reg' of 'dev_p'
+ * 'reg' has to be implemented in the handle's layout; an IOCON write keeps
+ * the handle's BANK setting
+ * returns the op's index (for mcp23017__batch_result()) or -1
+ */
+int
+mcp23017__batch_add_write (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	return batch_add(batch_p, dev_p, reg, false, val, NULL);
+}
+
+/**
+ * queue a read of register 'reg' (implemented in the handle's layout) of
+ * 'dev_p' into '*val_p'; '*val_p' is only valid after a submit for which
+ * this op's result is 0
+ * returns the op's index (for mcp23017__batch_result()) or -1
+ */
+int
+mcp23017__batch_add_read (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p)
+{
+	return batch_add(batch_p, dev_p, reg, true, 0, val_p);
+}
+
+/**
+ * queue one run of 'len' bytes between 'buf_p' and 'dev_p', starting at
+ * register 'reg' and, unless 'fixedReg', stepping through the registers as
+ * the chip's address pointer does; the bytes go out exactly as given (e.g.
+ * to reproduce a trace): the register isn't checked against the handle's
+ * layout, IOCON isn't protected, and after a write the chip's cache is
+ * dropped; a write that changes IOCON.BANK moves the handle to the new
+ * layout
+ * 'buf_p' has to stay valid until the submit is done
+ * returns the op's index (for mcp23017__batch_result()) or -1
+ */
+int
+mcp23017__batch_add_raw (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, bool read, bool fixedReg, uint8_t *buf_p, uint16_t len)
+{
+	BatchOp_t *op_p;
+
+	// preconds
+	if ((batch_p == NULL) || (dev_p == NULL) || (buf_p == NULL))
+		return -1;
+	if (len == 0)
+		return -1;
+
+	if (!batch_grow(batch_p)) {
+		mcp23017_priv__log_errno("batch_add_raw()");
+		return -1;
+	}
+
+	op_p = &batch_p->ops_p[batch_p->cnt];
+	op_p->dev_p = dev_p;
+	op_p->val = 0;
+	op_p->raw = true;
+	op_p->xfer.addr = dev_p->addr;
+	op_p->xfer.reg = reg;
+	op_p->xfer.read = read;
+	op_p->xfer.fixedReg = fixedReg;
+	op_p->xfer.noRetry = true;
+	op_p->xfer.len = len;
+	op_p->xfer.buf_p = buf_p;
+	op_p->xfer.result = -EINPROGRESS;
+
+	return (int)batch_p->cnt++;
+}
+
+/*
+ * follow a raw write through the registers it covered, the way the chip's
+ * address pointer moves, and keep the handle's layout in step with any
+ * IOCON.BANK it wrote
+ */
+static void
+raw_track_bank (BatchOp_t *op_p)
+{
+	Mcp23017_t *dev_p = op_p->dev_p;
+	uint8_t reg = op_p->xfer.reg;
+	unsigned i;
+
+	for (i = 0; i < op_p->xfer.len; ++i) {
+		if ((reg == mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA))
+				|| (reg == mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTB)))
+			dev_p->bank1 = ((op_p->xfer.buf_p[i] & IOCON_BANK) != 0);
+		if (op_p->xfer.fixedReg) {
+			if (!dev_p->bank1)
+				reg ^= 0x01;
+		}
+		else if (dev_p->bank1) {
+			++reg;
+			if ((reg & 0x0f) > 0x0a)
+				reg = (reg & 0x10)? 0x00 : 0x10;
+		}
+		else
+			reg = (reg >= 0x15)? 0x00 : (uint8_t)(reg + 1);
+	}
+}
+
+/**
+ * run every queued op, in order within each adapter
+ * returns true if all ops succeeded, otherwise check each op with
+ * mcp23017__batch_result()
+ * the batch stays queued, so it can be submitted again
+ */
+bool
+mcp23017__batch_submit (Mcp23017Batch_t *batch_p)
+{
+	unsigned i, j, cnt;
+	Mcp23017Bus_t *bus_p;
+	BatchOp_t *op_p;
+	bool ok = true;
+#ifdef ENABLE_STATS
+	unsigned k;
+	uint64_t start, ns;
+#endif
+
+	// preconds
+	if (batch_p == NULL)
+		return false;
+
+	for (i = 0; i < batch_p->cnt; ++i)
+		batch_p->ops_p[i].xfer.result = -EINPROGRESS;
+
+	// one bus_xfer() per adapter, in order of first appearance
+	for (i = 0; i < batch_p->cnt; ++i) {
+		if (batch_p->ops_p[i].xfer.result != -EINPROGRESS)
+			continue;
+		bus_p = batch_p->ops_p[i].dev_p->bus_p;
+
+		cnt = 0;
+		for (j = i; j < batch_p->cnt; ++j) {
+			op_p = &batch_p->ops_p[j];
+			if (op_p->dev_p->bus_p != bus_p)
+				continue;
+			if (!op_p->xfer.read && !op_p->raw)
+				op_p->xfer.buf_p = &op_p->val;
+			batch_p->xfers_p[cnt] = op_p->xfer;
+			batch_p->idx_p[cnt++] = j;
+		}
+
+		// held until the caches are updated
+		mcp23017_priv__bus_lock(bus_p);
+#ifdef ENABLE_STATS
+		start = mcp23017_priv__stats_now();
+#endif
+		if (!mcp23017_priv__bus_xfer(bus_p, batch_p->xfers_p, cnt)) {
+			ok = false;
+			for (j = 0; batch_p->xfers_p[j].result == 0; ++j)
+				;
+			mcp23017_priv__set_error(batch_p->ops_p[batch_p->idx_p[j]].dev_p,
+					-batch_p->xfers_p[j].result, batch_p->xfers_p[j].reg, (int)batch_p->idx_p[j]);
+		}
+#ifdef ENABLE_STATS
+		ns = mcp23017_priv__stats_now() - start;
+#endif
+
+		for (j = 0; j < cnt; ++j) {
+			op_p = &batch_p->ops_p[batch_p->idx_p[j]];
+			op_p->xfer.result = batch_p->xfers_p[j].result;
+#ifdef ENABLE_STATS
+			// each chip sees the whole transfer's latency, once
+			mcp23017_priv__stats_count(op_p->dev_p, &batch_p->xfers_p[j], 1);
+			for (k = 0; k < j; ++k)
+				if (batch_p->ops_p[batch_p->idx_p[k]].dev_p == op_p->dev_p)
+					break;
+			if (k == j)
+				mcp23017_priv__stats_latency(op_p->dev_p, ns);
+#endif
+			// whether or not it made it, a raw write may have changed anything
+			if (op_p->raw) {
+				if (!op_p->xfer.read) {
+					op_p->dev_p->regCacheValid = 0;
+					if (op_p->xfer.result == 0)
+						raw_track_bank(op_p);
+				}
+				continue;
+			}
+			if (op_p->xfer.result != 0)
+				continue;
+			if (op_p->xfer.read)
+				mcp23017_priv__cache_store(op_p->dev_p, op_p->xfer.reg, *op_p->xfer.buf_p);
+			else
+				mcp23017_priv__cache_written(op_p->dev_p, op_p->xfer.reg, op_p->val);
+		}
+		mcp23017_priv__bus_unlock(bus_p);
+	}
+
+	return ok;
+}
+
+/**
+ * outcome of op 'idx' from the last submit: 0 on success, otherwise a
+ * negative errno (-EINPROGRESS if it hasn't been submitted)
+ * ops that shared a failed I2C_RDWR ioctl all report that failure
+ */
+int
+mcp23017__batch_result (const Mcp23017Batch_t *batch_p, unsigned idx)
+{
+	// preconds
+	if (batch_p == NULL)
+		return -EINVAL;
+	if (idx >= batch_p->cnt)
+		return -EINVAL;
+
+	return batch_p->ops_p[idx].xfer.result;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * burst output: play a buffer of port values as a few long write runs
+ * instead of one register write per value
+ * in byte mode (IOCON.SEQOP=1) the chip's register pointer doesn't advance:
+ * with BANK=1 it stays on the register, so a single-port burst is one run
+ * to GPIOA/GPIOB; with BANK=0 it toggles within the A/B pair, so a run to
+ * GPIOA alternates A, B, A, B...
+ * IOCON is switched to the layout the burst needs and restored afterwards,
+ * in the same bus transfers as the data
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define IOCON_BANK 0x80
+#define IOCON_SEQOP 0x20
+
+// bytes per run, and runs per bus transfer; keeps each run within one
+// spidev message and each transfer within one I2C_RDWR ioctl
+#define BURST_RUN_MAX 4000
+#define BURST_RUNS 8
+
+static void
+xfer_write (Mcp23017Xfer_t *xfer_p, uint8_t addr, uint8_t reg, bool fixedReg, bool noRetry, uint8_t *buf_p, size_t len)
+{
+	xfer_p->addr = addr;
+	xfer_p->reg = reg;
+	xfer_p->read = false;
+	xfer_p->fixedReg = fixedReg;
+	xfer_p->noRetry = noRetry;
+	xfer_p->len = (uint16_t)len;
+	xfer_p->buf_p = buf_p;
+}
+
+/**
+ * write 'buf_p' to the port(s) selected by 'mode', one value after another,
+ * at close to the full bus rate
+ * MCP23017_BURST_PORTAB takes pairs: port A value, port B value, ...
+ * the adapter is held for the whole burst
+ */
+bool
+mcp23017__dev_burst_write (Mcp23017_t *dev_p, Mcp23017Burst_e mode, const uint8_t *buf_p, size_t len)
+{
+	Mcp23017Xfer_t xfer[BURST_RUNS + 2];
+	uint8_t iocon, ioconBurst, ioconRestore, gpio;
+	bool bank1Burst;
+	size_t off, run;
+	unsigned cnt;
+	bool last, switched = false;
+	bool ok = false;
+
+	// preconds
+	if ((dev_p == NULL) || (buf_p == NULL))
+		return false;
+	if (mode > MCP23017_BURST_PORTAB)
+		return false;
+	if ((mode == MCP23017_BURST_PORTAB) && ((len % 2) != 0))
+		return false;
+	if (len == 0)
+		return true;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon))
+		goto done;
+
+	bank1Burst = (mode != MCP23017_BURST_PORTAB);
+	ioconBurst = (uint8_t)((iocon & ~IOCON_BANK) | IOCON_SEQOP | (bank1Burst? IOCON_BANK : 0));
+	ioconRestore = iocon;
+	if (bank1Burst)
+		gpio = (uint8_t)(((mode == MCP23017_BURST_PORTB)? 0x10 : 0x00) | MCP23017_GPIO);
+	else
+		gpio = (uint8_t)(MCP23017_GPIO << 1);
+
+	// switch layout/mode (IOCON at its current address)...
+	cnt = 0;
+	xfer_write(&xfer[cnt++], dev_p->addr, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA),
+			false, false, &ioconBurst, 1);
+
+	for (off = 0; off < len; off += run) {
+		run = len - off;
+		if (run > BURST_RUN_MAX)
+			run = BURST_RUN_MAX;
+		// a redone run would play its values twice
+		xfer_write(&xfer[cnt++], dev_p->addr, gpio, true, true, (uint8_t *)(uintptr_t)(buf_p + off), run);
+
+		// ...and back again (IOCON at its burst-layout address)
+		last = (off + run == len);
+		if (last)
+			xfer_write(&xfer[cnt++], dev_p->addr, bank1Burst? 0x05 : 0x0a, false, false, &ioconRestore, 1);
+
+		if ((cnt >= BURST_RUNS) || last) {
+			ok = mcp23017_priv__dev_xfer(dev_p, xfer, cnt);
+			if (off == 0)
+				switched = (xfer[0].result == 0);
+			if (last && (xfer[cnt - 1].result == 0))
+				switched = false;
+			if (!ok)
+				goto err;
+			cnt = 0;
+		}
+	}
+
+	if (mode != MCP23017_BURST_PORTB)
+		mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTA),
+				buf_p[(mode == MCP23017_BURST_PORTAB)? len - 2 : len - 1]);
+	if (mode != MCP23017_BURST_PORTA)
+		mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTB),
+				buf_p[len - 1]);
+	goto done;
+
+err:
+	// the chip is still in the burst layout if the restore didn't happen
+	if (switched && !mcp23017_priv__dev_write_byte(dev_p, bank1Burst? 0x05 : 0x0a, ioconRestore))
+		mcp23017_priv__log("burst write: can't restore IOCON");
+	// some values may have made it out
+	dev_p->regCacheValid &= ~((1u << mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTA)) |
+			(1u << mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTB)));
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * adapter (bus) management
+ * one Mcp23017Bus_t per adapter, shared by all the chips on it; the
+ * transport behind it (i2c-dev, spidev, simulator) is picked from the
+ * device path
+ * the list of open adapters has its own lock; each adapter has a lock of
+ * its own so threads using different adapters never wait for each other
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+// transient failures (NAK, lost arbitration, timeout) are retried, from
+// the first failed run on, with the wait doubling up to RETRY_BACKOFF_MAX_US
+#define RETRY_DEFAULT 2
+#define RETRY_BACKOFF_DEFAULT_US 100
+#define RETRY_BACKOFF_MAX_US 10000
+
+static Mcp23017Bus_t *busList_pG = NULL;
+static pthread_mutex_t busListLock_G = PTHREAD_MUTEX_INITIALIZER;
+static unsigned busId_G = 0;
+
+static bool
+bus_locks_init (Mcp23017Bus_t *bus_p)
+{
+	pthread_mutexattr_t attr;
+
+	// recursive: a read-modify-write holds the lock across the transfers
+	// that also take it
+	if (pthread_mutexattr_init(&attr) != 0)
+		return false;
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&bus_p->lock, &attr) != 0)
+		goto err1;
+	if (pthread_mutex_init(&bus_p->combLock, NULL) != 0)
+		goto err2;
+	if (pthread_cond_init(&bus_p->combCv, NULL) != 0)
+		goto err3;
+	pthread_mutexattr_destroy(&attr);
+	return true;
+
+err3:
+	pthread_mutex_destroy(&bus_p->combLock);
+err2:
+	pthread_mutex_destroy(&bus_p->lock);
+err1:
+	pthread_mutexattr_destroy(&attr);
+	return false;
+}
+
+static void
+bus_locks_destroy (Mcp23017Bus_t *bus_p)
+{
+	pthread_cond_destroy(&bus_p->combCv);
+	pthread_mutex_destroy(&bus_p->combLock);
+	pthread_mutex_destroy(&bus_p->lock);
+}
+
+/**
+ * find the bus for 'devFile_p', opening it if this is its first user
+ */
+Mcp23017Bus_t *
+mcp23017_priv__bus_get (const char *devFile_p)
+{
+	Mcp23017Bus_t *bus_p;
+
+	// preconds
+	if (devFile_p == NULL)
+		return NULL;
+	if (strlen(devFile_p) >= sizeof(bus_p->devFile)) {
+		mcp23017_priv__log("device path too long: %s", devFile_p);
+		mcp23017_priv__set_error(NULL, ENAMETOOLONG, -1, -1);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&busListLock_G);
+	for (bus_p = busList_pG; bus_p != NULL; bus_p = bus_p->next_p) {
+		if (strcmp(bus_p->devFile, devFile_p) == 0) {
+			++bus_p->refCnt;
+			goto done;
+		}
+	}
+
+	bus_p = calloc(1, sizeof(*bus_p));
+	if (bus_p == NULL) {
+		mcp23017_priv__log_errno("calloc(bus)");
+		goto done;
+	}
+	strcpy(bus_p->devFile, devFile_p);
+	if (!bus_locks_init(bus_p)) {
+		mcp23017_priv__log("can't create bus locks");
+		goto err1;
+	}
+	bus_p->fd = -1;
+	bus_p->retries = RETRY_DEFAULT;
+	bus_p->backoffUs = RETRY_BACKOFF_DEFAULT_US;
+	bus_p->ops_p = &mcp23017_priv__i2cOps;
+	if (strncmp(devFile_p, MCP23017_SIM_PREFIX, strlen(MCP23017_SIM_PREFIX)) == 0)
+		bus_p->ops_p = &mcp23017_priv__simOps;
+	else if ((strncmp(devFile_p, MCP23017_SPI_SIM_PREFIX, strlen(MCP23017_SPI_SIM_PREFIX)) == 0) ||
+			(strncmp(devFile_p, "/dev/spidev", strlen("/dev/spidev")) == 0))
+		bus_p->ops_p = &mcp23017_priv__spiOps;
+	if (!bus_p->ops_p->open(bus_p))
+		goto err2;
+
+	bus_p->refCnt = 1;
+	bus_p->id = busId_G++;
+	bus_p->next_p = busList_pG;
+	busList_pG = bus_p;
+done:
+	pthread_mutex_unlock(&busListLock_G);
+	return bus_p;
+
+err2:
+	bus_locks_destroy(bus_p);
+err1:
+	free(bus_p);
+	pthread_mutex_unlock(&busListLock_G);
+	return NULL;
+}
+
+/**
+ * drop a reference; the adapter is closed when its last chip goes away
+ */
+void
+mcp23017_priv__bus_put (Mcp23017Bus_t *bus_p)
+{
+	Mcp23017Bus_t **pp;
+
+	// preconds
+	if (bus_p == NULL)
+		return;
+
+	pthread_mutex_lock(&busListLock_G);
+	if (--bus_p->refCnt > 0) {
+		pthread_mutex_unlock(&busListLock_G);
+		return;
+	}
+
+	for (pp = &busList_pG; *pp != NULL; pp = &(*pp)->next_p) {
+		if (*pp == bus_p) {
+			*pp = bus_p->next_p;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&busListLock_G);
+
+	bus_p->ops_p->close(bus_p);
+	bus_locks_destroy(bus_p);
+	free(bus_p);
+}
+
+/**
+ * hold the adapter across several transfers (e.g. a read-modify-write);
+ * may be nested
+ */
+void
+mcp23017_priv__bus_lock (Mcp23017Bus_t *bus_p)
+{
+	pthread_mutex_lock(&bus_p->lock);
+}
+
+void
+mcp23017_priv__bus_unlock (Mcp23017Bus_t *bus_p)
+{
+	pthread_mutex_unlock(&bus_p->lock);
+}
+
+// failures worth another try: the chip (or the bus) was briefly busy
+static bool
+is_transient (int result)
+{
+	switch (-result) {
+		case EREMOTEIO:
+		case EAGAIN:
+		case ETIMEDOUT:
+		case EIO:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void
+backoff (unsigned us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(us / 1000000u);
+	ts.tv_nsec = (long)(us % 1000000u) * 1000;
+	while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR))
+		;
+}
+
+/**
+ * perform 'cnt' register runs using as few bus transactions as the
+ * adapter allows
+ * every run is attempted; each run's outcome is left in its 'result' and
+ * the return value is true only if all of them succeeded
+ * transient failures are retried as set by mcp23017__dev_set_retry(), each
+ * run's 'retries' says how often it was redone; nothing is retried if a
+ * run that would be redone is marked 'noRetry'
+ * an absent chip (ENXIO) fails right away
+ */
+bool
+mcp23017_priv__bus_xfer (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	unsigned i, first, attempt, backoffUs;
+	uint64_t start = 0;
+	bool ok, trace;
+
+	// preconds
+	if ((bus_p == NULL) || (xfer_p == NULL))
+		return false;
+	if (cnt == 0)
+		return true;
+
+	for (i = 0; i < cnt; ++i)
+		xfer_p[i].retries = 0;
+	pthread_mutex_lock(&bus_p->lock);
+	trace = atomic_load_explicit(&mcp23017_priv__traceOn, memory_order_relaxed);
+	if (trace)
+		start = mcp23017_priv__trace_now();
+	ok = bus_p->ops_p->xfer(bus_p, xfer_p, cnt);
+	backoffUs = bus_p->backoffUs;
+	for (attempt = 0; !ok && (attempt < bus_p->retries); ++attempt) {
+		for (first = 0; (first < cnt) && (xfer_p[first].result == 0); ++first)
+			;
+		if ((first == cnt) || !is_transient(xfer_p[first].result))
+			break;
+		// the adapter doesn't say which runs made it out before the
+		// failure, and later runs were attempted too, so any of them
+		// may be sent twice
+		for (i = first; (i < cnt) && !xfer_p[i].noRetry; ++i)
+			;
+		if (i < cnt)
+			break;
+
+		// everything from the failure on is redone, in order, so runs
+		// that depend on an earlier one (e.g. an IOCON switch) still
+		// see it first
+		backoff(backoffUs);
+		if (backoffUs < RETRY_BACKOFF_MAX_US / 2)
+			backoffUs *= 2;
+		for (i = first; i < cnt; ++i)
+			++xfer_p[i].retries;
+		ok = bus_p->ops_p->xfer(bus_p, &xfer_p[first], cnt - first);
+	}
+	if (trace)
+		mcp23017_priv__trace(bus_p, xfer_p, cnt, start, mcp23017_priv__trace_now());
+	pthread_mutex_unlock(&bus_p->lock);
+	return ok;
+}
+
+/**
+ * retry transient bus errors on the adapter 'dev_p' is on up to 'retries'
+ * times per transfer, waiting 'backoffUs' before the first retry and
+ * twice as long before each further one (0 retries turns this off)
+ * burst writes, sampler reads and raw batch runs aren't retried, since
+ * the part that already went out would be repeated
+ */
+bool
+mcp23017__dev_set_retry (Mcp23017_t *dev_p, unsigned retries, unsigned backoffUs)
+{
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	dev_p->bus_p->retries = retries;
+	dev_p->bus_p->backoffUs = backoffUs;
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * bus_xfer() on behalf of one chip; every runtime register access of a
+ * handle goes through here (or through a batch), so this is where its
+ * statistics are gathered
+ */
+bool
+mcp23017_priv__dev_xfer (Mcp23017_t *dev_p, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+#ifdef ENABLE_STATS
+	uint64_t start;
+	bool ok;
+
+	start = mcp23017_priv__stats_now();
+	ok = mcp23017_priv__bus_xfer(dev_p->bus_p, xfer_p, cnt);
+	mcp23017_priv__stats_latency(dev_p, mcp23017_priv__stats_now() - start);
+	mcp23017_priv__stats_count(dev_p, xfer_p, cnt);
+#else
+	bool ok;
+
+	ok = mcp23017_priv__bus_xfer(dev_p->bus_p, xfer_p, cnt);
+#endif
+	if (!ok)
+		mcp23017_priv__set_xfer_error(dev_p, xfer_p, cnt);
+	return ok;
+}
+
+bool
+mcp23017_priv__dev_read_byte (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p)
+{
+	Mcp23017Xfer_t xfer;
+
+	xfer.addr = dev_p->addr;
+	xfer.reg = reg;
+	xfer.read = true;
+	xfer.fixedReg = false;
+	xfer.noRetry = false;
+	xfer.len = 1;
+	xfer.buf_p = val_p;
+	return mcp23017_priv__dev_xfer(dev_p, &xfer, 1);
+}
+
+bool
+mcp23017_priv__dev_write_byte (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	Mcp23017Xfer_t xfer;
+
+	xfer.addr = dev_p->addr;
+	xfer.reg = reg;
+	xfer.read = false;
+	xfer.fixedReg = false;
+	xfer.noRetry = false;
+	xfer.len = 1;
+	xfer.buf_p = &val;
+	return mcp23017_priv__dev_xfer(dev_p, &xfer, 1);
+}
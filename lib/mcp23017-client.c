@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * client side of the daemon protocol (see mcp23017-proto.h)
+ * sends and receives are independent, so a client can keep several
+ * requests in flight and collect the replies as they come
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "mcp23017-proto.h"
+#include "mcp23017-private.h"
+#include "config.h"
+
+static bool
+read_full (int fd, void *buf_p, size_t len)
+{
+	uint8_t *p = buf_p;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (ret == 0) {
+			errno = ECONNRESET;
+			return false;
+		}
+		p += ret;
+		len -= (size_t)ret;
+	}
+	return true;
+}
+
+/**
+ * connect to the daemon listening on 'path_p' (NULL: MCP23017_PROTO_SOCKET)
+ * returns the connection's fd, or -1
+ */
+int
+mcp23017__client_connect (const char *path_p)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (path_p == NULL)
+		path_p = MCP23017_PROTO_SOCKET;
+	if (strlen(path_p) >= sizeof(sun.sun_path)) {
+		mcp23017_priv__set_error(NULL, ENAMETOOLONG, -1, -1);
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path_p);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		mcp23017_priv__set_error(NULL, errno, -1, -1);
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		mcp23017_priv__set_error(NULL, errno, -1, -1);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * send one request of 'cnt' ops (at most MCP23017_PROTO_OPS_MAX), tagged
+ * 'seq'; doesn't wait for the reply
+ * fails with EPIPE, rather than raising SIGPIPE, if the daemon has gone
+ */
+bool
+mcp23017__client_send (int fd, uint32_t seq, const Mcp23017ProtoOp_t *ops_p, unsigned cnt)
+{
+	Mcp23017ProtoHdr_t hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t ret;
+	size_t left;
+	int i = 0;
+
+	// preconds
+	if ((fd < 0) || (ops_p == NULL) || (cnt == 0) || (cnt > MCP23017_PROTO_OPS_MAX)) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		return false;
+	}
+
+	hdr.magic = MCP23017_PROTO_MAGIC;
+	hdr.version = MCP23017_PROTO_VERSION;
+	hdr.cnt = (uint8_t)cnt;
+	hdr.seq = seq;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)ops_p;
+	iov[1].iov_len = cnt * sizeof(*ops_p);
+	left = iov[0].iov_len + iov[1].iov_len;
+
+	// a daemon that has gone away must not take the client down with
+	// SIGPIPE
+	while (left > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[i];
+		msg.msg_iovlen = (size_t)(2 - i);
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			mcp23017_priv__set_error(NULL, errno, -1, -1);
+			return false;
+		}
+		left -= (size_t)ret;
+		while ((i < 2) && ((size_t)ret >= iov[i].iov_len)) {
+			ret -= (ssize_t)iov[i].iov_len;
+			++i;
+		}
+		if (i < 2) {
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + ret;
+			iov[i].iov_len -= (size_t)ret;
+		}
+	}
+	return true;
+}
+
+/**
+ * wait for the next reply; its results (at most 'max' of them, any others
+ * are dropped) go to 'res_p' and its tag to 'seq_p'
+ * returns the number of results in the reply, or -1
+ */
+int
+mcp23017__client_recv (int fd, uint32_t *seq_p, Mcp23017ProtoResult_t *res_p, unsigned max)
+{
+	Mcp23017ProtoHdr_t hdr;
+	Mcp23017ProtoResult_t drop;
+	unsigned i;
+
+	// preconds
+	if ((fd < 0) || ((res_p == NULL) && (max > 0))) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		return -1;
+	}
+
+	if (!read_full(fd, &hdr, sizeof(hdr)))
+		goto err;
+	if ((hdr.magic != MCP23017_PROTO_MAGIC) || (hdr.version != MCP23017_PROTO_VERSION)) {
+		errno = EPROTO;
+		goto err;
+	}
+	for (i = 0; i < hdr.cnt; ++i)
+		if (!read_full(fd, (i < max)? &res_p[i] : &drop, sizeof(drop)))
+			goto err;
+
+	if (seq_p != NULL)
+		*seq_p = hdr.seq;
+	return hdr.cnt;
+
+err:
+	mcp23017_priv__set_error(NULL, errno, -1, -1);
+	return -1;
+}
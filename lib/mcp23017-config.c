@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * declarative pin configuration
+ * the wanted state of every pin is turned into register values, compared
+ * with what the chip holds (from the cache, or one read of those
+ * registers), and only the registers that differ are written: coalesced
+ * into contiguous runs, output latches first, all in one bus transfer
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define IOCON_SEQOP 0x20
+
+// the registers a configuration covers
+static const Mcp23017Reg_e cfgRegs_G[] = {
+	MCP23017_IODIR,
+	MCP23017_IPOL,
+	MCP23017_GPINTEN,
+	MCP23017_DEFVAL,
+	MCP23017_INTCON,
+	MCP23017_GPPU,
+	MCP23017_OLAT,
+};
+#define CFG_REG_CNT (sizeof(cfgRegs_G) / sizeof(cfgRegs_G[0]))
+
+static unsigned coalesce (Mcp23017_t *dev_p, const bool *dirty, const bool *fill, uint8_t *val, bool byteMode, Mcp23017Xfer_t *xfer_p);
+
+static void
+config_to_regs (const Mcp23017Config_t *cfg_p, uint8_t regs[MCP23017_REG_CNT][2])
+{
+	const Mcp23017PinConfig_t *pin_p;
+	unsigned i;
+	uint8_t bit;
+	Mcp23017Port_e port;
+
+	memset(regs, 0, MCP23017_REG_CNT * 2);
+	for (i = 0; i < 16; ++i) {
+		pin_p = &cfg_p->pins[i];
+		port = (i < 8)? PORTA : PORTB;
+		bit = (uint8_t)(1u << (i % 8));
+
+		if (!pin_p->output)
+			regs[MCP23017_IODIR][port] |= bit;
+		if (pin_p->invert)
+			regs[MCP23017_IPOL][port] |= bit;
+		if (pin_p->pullUp)
+			regs[MCP23017_GPPU][port] |= bit;
+		if (pin_p->irq != MCP23017_IRQ_NONE)
+			regs[MCP23017_GPINTEN][port] |= bit;
+		if (pin_p->irq == MCP23017_IRQ_COMPARE)
+			regs[MCP23017_INTCON][port] |= bit;
+		if (pin_p->defval)
+			regs[MCP23017_DEFVAL][port] |= bit;
+		if (pin_p->level)
+			regs[MCP23017_OLAT][port] |= bit;
+	}
+}
+
+/*
+ * fill 'snap_p' with the configuration registers (and IOCON): from the
+ * cache if it holds all of them, otherwise read from the chip in one bus
+ * transfer; GPIO and INTCAP aren't read, as that would clear a pending
+ * interrupt
+ * called with the adapter locked
+ */
+static bool
+config_state (Mcp23017_t *dev_p, Mcp23017Snapshot_t *snap_p)
+{
+	uint8_t buf[0x20], iocon;
+	bool need[0x20], fill[0x20];
+	Mcp23017Xfer_t xfer[0x20];
+	unsigned i, cnt;
+	uint8_t addr;
+	Mcp23017Reg_e reg;
+	Mcp23017Port_e port;
+	bool ok = true;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	for (port = PORTA; ok && (port <= PORTB); ++port) {
+		for (i = 0; ok && (i < CFG_REG_CNT); ++i)
+			ok = mcp23017_priv__cache_lookup(dev_p, mcp23017_priv__reg_addr(dev_p, cfgRegs_G[i], port),
+					&snap_p->regs[cfgRegs_G[i]][port]);
+		if (ok)
+			ok = mcp23017_priv__cache_lookup(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, port),
+					&snap_p->regs[MCP23017_IOCON][port]);
+	}
+	if (ok)
+		goto done;
+
+	// IOCON says whether the rest can be read as runs
+	ok = mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon);
+	if (!ok)
+		goto done;
+	memset(need, 0, sizeof(need));
+	memset(fill, 0, sizeof(fill));
+	for (port = PORTA; port <= PORTB; ++port) {
+		for (i = 0; i < CFG_REG_CNT; ++i)
+			need[mcp23017_priv__reg_addr(dev_p, cfgRegs_G[i], port)] = true;
+		need[mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, port)] = true;
+	}
+	cnt = coalesce(dev_p, need, fill, buf, (iocon & IOCON_SEQOP) != 0, xfer);
+	for (i = 0; i < cnt; ++i)
+		xfer[i].read = true;
+	ok = mcp23017_priv__dev_xfer(dev_p, xfer, cnt);
+	if (!ok)
+		goto done;
+
+	for (port = PORTA; port <= PORTB; ++port) {
+		for (i = 0; i <= CFG_REG_CNT; ++i) {
+			reg = (i < CFG_REG_CNT)? cfgRegs_G[i] : MCP23017_IOCON;
+			addr = mcp23017_priv__reg_addr(dev_p, reg, port);
+			snap_p->regs[reg][port] = buf[addr];
+			mcp23017_priv__cache_store(dev_p, addr, buf[addr]);
+		}
+	}
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
+
+/**
+ * the chip's current configuration (from the cache where possible)
+ */
+bool
+mcp23017__dev_config_get (Mcp23017_t *dev_p, Mcp23017Config_t *cfg_p)
+{
+	Mcp23017Snapshot_t snap;
+	unsigned i;
+	uint8_t bit;
+	Mcp23017Port_e port;
+	Mcp23017PinConfig_t *pin_p;
+
+	// preconds
+	if ((dev_p == NULL) || (cfg_p == NULL))
+		return false;
+
+	if (!config_state(dev_p, &snap))
+		return false;
+
+	for (i = 0; i < 16; ++i) {
+		pin_p = &cfg_p->pins[i];
+		port = (i < 8)? PORTA : PORTB;
+		bit = (uint8_t)(1u << (i % 8));
+
+		pin_p->output = (snap.regs[MCP23017_IODIR][port] & bit) == 0;
+		pin_p->invert = (snap.regs[MCP23017_IPOL][port] & bit) != 0;
+		pin_p->pullUp = (snap.regs[MCP23017_GPPU][port] & bit) != 0;
+		if ((snap.regs[MCP23017_GPINTEN][port] & bit) == 0)
+			pin_p->irq = MCP23017_IRQ_NONE;
+		else if (snap.regs[MCP23017_INTCON][port] & bit)
+			pin_p->irq = MCP23017_IRQ_COMPARE;
+		else
+			pin_p->irq = MCP23017_IRQ_CHANGE;
+		pin_p->defval = (snap.regs[MCP23017_DEFVAL][port] & bit) != 0;
+		pin_p->level = (snap.regs[MCP23017_OLAT][port] & bit) != 0;
+	}
+	return true;
+}
+
+/*
+ * add the runs covering 'dirty' (indexed by register address, values in
+ * 'val') to 'xfer_p'; a single clean register between two dirty ones is
+ * rewritten with its current value if 'fill' allows, rather than starting
+ * a new run
+ */
+static unsigned
+coalesce (Mcp23017_t *dev_p, const bool *dirty, const bool *fill, uint8_t *val, bool byteMode, Mcp23017Xfer_t *xfer_p)
+{
+	unsigned addr, cnt = 0;
+	Mcp23017Xfer_t *run_p = NULL;
+
+	for (addr = 0; addr < 0x20; ++addr) {
+		if (!dirty[addr]) {
+			// bridge a one-register gap
+			if ((run_p != NULL) && !byteMode && fill[addr] && (addr + 1 < 0x20) && dirty[addr + 1]) {
+				++run_p->len;
+				continue;
+			}
+			run_p = NULL;
+			continue;
+		}
+
+		if ((run_p != NULL) && !byteMode) {
+			++run_p->len;
+			continue;
+		}
+
+		run_p = &xfer_p[cnt++];
+		run_p->addr = dev_p->addr;
+		run_p->reg = (uint8_t)addr;
+		run_p->read = false;
+		run_p->fixedReg = false;
+		run_p->noRetry = false;
+		run_p->len = 1;
+		run_p->buf_p = &val[addr];
+	}
+	return cnt;
+}
+
+/**
+ * make the chip's pins match 'cfg_p', writing only the registers that
+ * differ from their current values
+ * output latches are written before anything else, so pins becoming
+ * outputs start at their configured level
+ */
+bool
+mcp23017__dev_config_apply (Mcp23017_t *dev_p, const Mcp23017Config_t *cfg_p)
+{
+	Mcp23017Snapshot_t cur;
+	uint8_t want[MCP23017_REG_CNT][2];
+	uint8_t val[0x20];
+	bool dirty[0x20], dirtyOlat[0x20], fill[0x20];
+	Mcp23017Xfer_t xfer[0x20];
+	uint8_t addr;
+	unsigned i, cnt;
+	Mcp23017Port_e port;
+	Mcp23017Reg_e reg;
+	bool byteMode;
+	bool ok = false;
+
+	// preconds
+	if ((dev_p == NULL) || (cfg_p == NULL))
+		return false;
+
+	config_to_regs(cfg_p, want);
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!config_state(dev_p, &cur))
+		goto done;
+	byteMode = (cur.regs[MCP23017_IOCON][PORTA] & IOCON_SEQOP) != 0;
+
+	memset(dirty, 0, sizeof(dirty));
+	memset(dirtyOlat, 0, sizeof(dirtyOlat));
+	memset(fill, 0, sizeof(fill));
+	for (port = PORTA; port <= PORTB; ++port) {
+		for (i = 0; i < CFG_REG_CNT; ++i) {
+			reg = cfgRegs_G[i];
+			addr = mcp23017_priv__reg_addr(dev_p, reg, port);
+			val[addr] = want[reg][port];
+			fill[addr] = (reg != MCP23017_OLAT);
+			if (want[reg][port] == cur.regs[reg][port])
+				continue;
+			if (reg == MCP23017_OLAT)
+				dirtyOlat[addr] = true;
+			else
+				dirty[addr] = true;
+		}
+	}
+
+	cnt = coalesce(dev_p, dirtyOlat, fill, val, byteMode, xfer);
+	cnt += coalesce(dev_p, dirty, fill, val, byteMode, &xfer[cnt]);
+	if (cnt == 0) {
+		ok = true;
+		goto done;
+	}
+
+	if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt)) {
+		// no telling which registers made it
+		dev_p->regCacheValid = 0;
+		if (dev_p->cacheEnable)
+			mcp23017__dev_cache_resync(dev_p);
+		goto done;
+	}
+
+	for (port = PORTA; port <= PORTB; ++port)
+		for (i = 0; i < CFG_REG_CNT; ++i)
+			mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, cfgRegs_G[i], port),
+					want[cfgRegs_G[i]][port]);
+	ok = true;
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * error reporting
+ * a failing call leaves the details (errno value, chip, register, which
+ * run of the transfer) in a per-thread record, the way errno works; any
+ * message goes to the log callback, which by default prints to stderr
+ * messages are formatted on the stack, stdio is only touched by the
+ * default callback, which real-time mode silences
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define LOG_MSG_MAX 256
+
+static _Thread_local Mcp23017Error_t lastErr_G = { 0, NULL, -1, -1 };
+
+static void
+log_stderr (const char *msg_p, void *arg_p)
+{
+	(void)arg_p;
+	fprintf(stderr, "%s\n", msg_p);
+}
+
+static Mcp23017LogCb_t logCb_pG = log_stderr;
+static void *logArg_pG = NULL;
+
+/**
+ * send the library's messages to 'cb' instead of stderr; NULL silences
+ * them
+ * meant to be called once, before the library is in use
+ */
+void
+mcp23017__set_log (Mcp23017LogCb_t cb, void *arg_p)
+{
+	logCb_pG = cb;
+	logArg_pG = arg_p;
+}
+
+/**
+ * details of this thread's last failure
+ * returns false if nothing has failed yet
+ */
+bool
+mcp23017__last_error (Mcp23017Error_t *err_p)
+{
+	// preconds
+	if (err_p == NULL)
+		return false;
+
+	*err_p = lastErr_G;
+	return lastErr_G.err != 0;
+}
+
+void
+mcp23017_priv__log (const char *fmt_p, ...)
+{
+	char msg[LOG_MSG_MAX];
+	va_list ap;
+	int saved = errno;
+
+	if (logCb_pG == NULL)
+		return;
+	if ((logCb_pG == log_stderr) && atomic_load_explicit(&mcp23017_priv__rtOn, memory_order_relaxed))
+		return;
+
+	va_start(ap, fmt_p);
+	vsnprintf(msg, sizeof(msg), fmt_p, ap);
+	va_end(ap);
+	logCb_pG(msg, logArg_pG);
+	errno = saved;
+}
+
+/**
+ * perror() through the log callback
+ */
+void
+mcp23017_priv__log_errno (const char *what_p)
+{
+	mcp23017_priv__log("%s: %s", what_p, strerror(errno));
+}
+
+/**
+ * record a failure ('err' is an errno value) for mcp23017__last_error(),
+ * and leave it in errno too; 'reg' and 'xfer' are -1 if they don't apply
+ */
+void
+mcp23017_priv__set_error (Mcp23017_t *dev_p, int err, int reg, int xfer)
+{
+	lastErr_G.err = err;
+	lastErr_G.dev_p = dev_p;
+	lastErr_G.reg = reg;
+	lastErr_G.xfer = xfer;
+	errno = err;
+}
+
+/**
+ * forget this thread's last failure, so the next one reported is the
+ * caller's own
+ */
+void
+mcp23017_priv__clear_error (void)
+{
+	lastErr_G.err = 0;
+	lastErr_G.dev_p = NULL;
+	lastErr_G.reg = -1;
+	lastErr_G.xfer = -1;
+}
+
+/**
+ * record the first failed run of a transfer of 'cnt' runs, if there is one
+ */
+void
+mcp23017_priv__set_xfer_error (Mcp23017_t *dev_p, const Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	unsigned i;
+
+	for (i = 0; i < cnt; ++i) {
+		if (xfer_p[i].result != 0) {
+			mcp23017_priv__set_error(dev_p, -xfer_p[i].result, xfer_p[i].reg, (int)i);
+			return;
+		}
+	}
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * bus groups: chips spread over several adapters, driven in parallel
+ * every adapter in the group gets the asynchronous engine's worker thread
+ * (see mcp23017-async.c), pinned to a CPU of its own where there are
+ * enough; a fan-out submits the same request for every chip and waits
+ * until all of them have completed, so each adapter works through its own
+ * chips while the others do the same
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+// fan-outs over groups up to this size keep their completions on the
+// stack rather than allocating them
+#define GROUP_STACK_COMP 32
+
+struct Mcp23017Group_s {
+	Mcp23017_t **dev_pp;
+	unsigned devCnt;
+	Mcp23017Bus_t **bus_pp;
+	unsigned busCnt;
+	int *cpus_p;
+	unsigned cpuCnt;
+};
+
+// one fan-out in flight
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	unsigned left;
+	Mcp23017Completion_t *comp_p;
+} FanOut_t;
+
+/**
+ * a new, empty, group whose adapter workers are pinned to 'cpus_p' in turn
+ * ('cpuCnt' entries); with NULL, to the CPUs this process may run on
+ */
+Mcp23017Group_t *
+mcp23017__group_new (const int *cpus_p, unsigned cpuCnt)
+{
+	Mcp23017Group_t *grp_p;
+	cpu_set_t set;
+	unsigned cpu;
+
+	grp_p = calloc(1, sizeof(*grp_p));
+	if (grp_p == NULL) {
+		mcp23017_priv__log_errno("calloc(group)");
+		return NULL;
+	}
+
+	if (cpus_p != NULL) {
+		if (cpuCnt == 0)
+			goto err;
+		grp_p->cpus_p = malloc(cpuCnt * sizeof(*grp_p->cpus_p));
+		if (grp_p->cpus_p == NULL)
+			goto err;
+		memcpy(grp_p->cpus_p, cpus_p, cpuCnt * sizeof(*cpus_p));
+		grp_p->cpuCnt = cpuCnt;
+		return grp_p;
+	}
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return grp_p;
+	grp_p->cpus_p = malloc((size_t)CPU_COUNT(&set) * sizeof(*grp_p->cpus_p));
+	if (grp_p->cpus_p == NULL)
+		goto err;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &set))
+			grp_p->cpus_p[grp_p->cpuCnt++] = (int)cpu;
+	return grp_p;
+
+err:
+	mcp23017_priv__log_errno("group_new()");
+	free(grp_p->cpus_p);
+	free(grp_p);
+	return NULL;
+}
+
+/**
+ * stops the group's workers (unless something else still uses them);
+ * the chips themselves stay open
+ */
+void
+mcp23017__group_free (Mcp23017Group_t *grp_p)
+{
+	unsigned i;
+
+	// preconds
+	if (grp_p == NULL)
+		return;
+
+	for (i = 0; i < grp_p->devCnt; ++i)
+		mcp23017__async_stop(grp_p->dev_pp[i]);
+	free(grp_p->dev_pp);
+	free(grp_p->bus_pp);
+	free(grp_p->cpus_p);
+	free(grp_p);
+}
+
+/**
+ * add 'dev_p' to the group, starting (and pinning) a worker for its adapter
+ * if the group doesn't have one yet
+ * returns the chip's index, which is also its slot in fan-out results, or -1
+ */
+int
+mcp23017__group_add (Mcp23017Group_t *grp_p, Mcp23017_t *dev_p)
+{
+	Mcp23017_t **dev_pp;
+	Mcp23017Bus_t **bus_pp;
+	unsigned i;
+
+	// preconds
+	if ((grp_p == NULL) || (dev_p == NULL))
+		return -1;
+
+	for (i = 0; i < grp_p->devCnt; ++i)
+		if (grp_p->dev_pp[i] == dev_p)
+			return -1;
+
+	dev_pp = realloc(grp_p->dev_pp, (grp_p->devCnt + 1) * sizeof(*dev_pp));
+	if (dev_pp == NULL) {
+		mcp23017_priv__log_errno("realloc(group)");
+		return -1;
+	}
+	grp_p->dev_pp = dev_pp;
+
+	if (!mcp23017__async_start(dev_p, 0))
+		return -1;
+
+	for (i = 0; i < grp_p->busCnt; ++i)
+		if (grp_p->bus_pp[i] == dev_p->bus_p)
+			break;
+	if (i == grp_p->busCnt) {
+		bus_pp = realloc(grp_p->bus_pp, (grp_p->busCnt + 1) * sizeof(*bus_pp));
+		if (bus_pp == NULL) {
+			mcp23017_priv__log_errno("realloc(group)");
+			mcp23017__async_stop(dev_p);
+			return -1;
+		}
+		grp_p->bus_pp = bus_pp;
+		grp_p->bus_pp[grp_p->busCnt++] = dev_p->bus_p;
+		// not being pinned costs speed, not correctness
+		if (grp_p->cpuCnt > 0)
+			mcp23017_priv__async_pin(dev_p, grp_p->cpus_p[i % grp_p->cpuCnt]);
+	}
+
+	grp_p->dev_pp[grp_p->devCnt] = dev_p;
+	return (int)grp_p->devCnt++;
+}
+
+unsigned
+mcp23017__group_count (const Mcp23017Group_t *grp_p)
+{
+	// preconds
+	if (grp_p == NULL)
+		return 0;
+
+	return grp_p->devCnt;
+}
+
+static void
+fan_done (const Mcp23017Completion_t *comp_p, void *arg_p)
+{
+	FanOut_t *fan_p = arg_p;
+
+	pthread_mutex_lock(&fan_p->lock);
+	fan_p->comp_p[comp_p->tag] = *comp_p;
+	--fan_p->left;
+	pthread_cond_signal(&fan_p->cv);
+	pthread_mutex_unlock(&fan_p->lock);
+}
+
+/**
+ * run 'req_p' on every chip of the group (its 'cb' and 'cbArg_p' are
+ * ignored) and wait until all have finished; chips on different adapters
+ * are handled in parallel
+ * 'comp_p' (may be NULL) receives one completion per chip, by index
+ * returns true if every chip succeeded
+ */
+bool
+mcp23017__group_submit (Mcp23017Group_t *grp_p, const Mcp23017AsyncReq_t *req_p, Mcp23017Completion_t *comp_p)
+{
+	FanOut_t fan;
+	Mcp23017Completion_t local[GROUP_STACK_COMP];
+	Mcp23017AsyncReq_t req;
+	unsigned i, left;
+	bool ok = true;
+
+	// preconds
+	if ((grp_p == NULL) || (req_p == NULL))
+		return false;
+	if (grp_p->devCnt == 0)
+		return true;
+
+	pthread_mutex_init(&fan.lock, NULL);
+	pthread_cond_init(&fan.cv, NULL);
+	fan.left = grp_p->devCnt;
+	fan.comp_p = comp_p;
+	if ((fan.comp_p == NULL) && (grp_p->devCnt <= GROUP_STACK_COMP))
+		fan.comp_p = local;
+	if (fan.comp_p == NULL) {
+		fan.comp_p = malloc(grp_p->devCnt * sizeof(*fan.comp_p));
+		if (fan.comp_p == NULL) {
+			mcp23017_priv__log_errno("malloc(group_submit)");
+			ok = false;
+			goto done;
+		}
+	}
+
+	req = *req_p;
+	req.cb = fan_done;
+	req.cbArg_p = &fan;
+	for (i = 0; i < grp_p->devCnt; ) {
+		req.tag = i;
+		if (mcp23017__async_submit(grp_p->dev_pp[i], &req)) {
+			++i;
+			continue;
+		}
+
+		if (errno != EAGAIN) {
+			// never submitted: complete it here
+			fan.comp_p[i].dev_p = grp_p->dev_pp[i];
+			fan.comp_p[i].op = req.op;
+			fan.comp_p[i].tag = i;
+			fan.comp_p[i].result = -errno;
+			fan.comp_p[i].val = 0;
+			pthread_mutex_lock(&fan.lock);
+			--fan.left;
+			pthread_mutex_unlock(&fan.lock);
+			++i;
+			continue;
+		}
+
+		// the adapter's ring is full: wait for one of ours to finish, or
+		// (if it's full of somebody else's) just give it a moment
+		pthread_mutex_lock(&fan.lock);
+		left = fan.left;
+		if (i > grp_p->devCnt - left) {
+			while (fan.left == left)
+				pthread_cond_wait(&fan.cv, &fan.lock);
+			pthread_mutex_unlock(&fan.lock);
+		}
+		else {
+			pthread_mutex_unlock(&fan.lock);
+			usleep(100);
+		}
+	}
+
+	pthread_mutex_lock(&fan.lock);
+	while (fan.left > 0)
+		pthread_cond_wait(&fan.cv, &fan.lock);
+	pthread_mutex_unlock(&fan.lock);
+
+	for (i = 0; i < grp_p->devCnt; ++i) {
+		fan.comp_p[i].tag = req_p->tag;
+		if (fan.comp_p[i].result != 0)
+			ok = false;
+	}
+	if ((comp_p == NULL) && (fan.comp_p != local))
+		free(fan.comp_p);
+
+done:
+	pthread_cond_destroy(&fan.cv);
+	pthread_mutex_destroy(&fan.lock);
+	return ok;
+}
+
+/**
+ * write 'val' to both ports of every chip in the group, see
+ * mcp23017__dev_write_port16()
+ */
+bool
+mcp23017__group_write_port16 (Mcp23017Group_t *grp_p, uint16_t val)
+{
+	Mcp23017AsyncReq_t req;
+
+	memset(&req, 0, sizeof(req));
+	req.op = MCP23017_ASYNC_WRITE_PORT16;
+	req.val = val;
+	return mcp23017__group_submit(grp_p, &req, NULL);
+}
+
+/**
+ * read both ports of every chip in the group into 'vals_p' (by index);
+ * entries of chips that failed are 0
+ */
+bool
+mcp23017__group_read_port16 (Mcp23017Group_t *grp_p, uint16_t *vals_p)
+{
+	Mcp23017AsyncReq_t req;
+	Mcp23017Completion_t local[GROUP_STACK_COMP];
+	Mcp23017Completion_t *comp_p = local;
+	unsigned i;
+	bool ok;
+
+	// preconds
+	if ((grp_p == NULL) || (vals_p == NULL))
+		return false;
+	if (grp_p->devCnt == 0)
+		return true;
+
+	if (grp_p->devCnt > GROUP_STACK_COMP) {
+		comp_p = malloc(grp_p->devCnt * sizeof(*comp_p));
+		if (comp_p == NULL) {
+			mcp23017_priv__log_errno("malloc(group_read_port16)");
+			return false;
+		}
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.op = MCP23017_ASYNC_READ_PORT16;
+	ok = mcp23017__group_submit(grp_p, &req, comp_p);
+	for (i = 0; i < grp_p->devCnt; ++i)
+		vals_p[i] = (comp_p[i].result == 0)? comp_p[i].val : 0;
+	if (comp_p != local)
+		free(comp_p);
+	return ok;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * i2c-dev transport
+ * every chip on a given /dev/i2c-N shares one file descriptor; the I2C_SLAVE
+ * address is only re-issued when the target chip changes
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <i2c/smbus.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+// enough for the write messages of ordinary transfers, so only bursts
+// ever grow it
+#define I2C_SCRATCH_PREALLOC 256
+
+static bool scratch_reserve (Mcp23017Bus_t *bus_p, size_t len);
+
+static bool
+i2c_open (Mcp23017Bus_t *bus_p)
+{
+	int ret;
+
+	bus_p->fd = open(bus_p->devFile, O_RDWR);
+	if (bus_p->fd < 0) {
+		mcp23017_priv__log_errno("open(i2c device)");
+		return false;
+	}
+
+	// check/verify i2c functionality on device
+	ret = ioctl(bus_p->fd, I2C_FUNCS, &bus_p->funcs);
+	if (ret < 0) {
+		mcp23017_priv__log_errno("can't get i2c functionality");
+		goto err1;
+	}
+	if (!(bus_p->funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+		mcp23017_priv__log("I2C_FUNC_SMBUS_WRITE_BYTE_DATA not available");
+		goto err1;
+	}
+	if (!(bus_p->funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+		mcp23017_priv__log("I2C_FUNC_SMBUS_READ_BYTE_DATA not available");
+		goto err1;
+	}
+
+	bus_p->curAddr = -1;
+	// not having it now only means allocating it later
+	scratch_reserve(bus_p, I2C_SCRATCH_PREALLOC);
+	return true;
+err1:
+	close(bus_p->fd);
+	bus_p->fd = -1;
+	return false;
+}
+
+static void
+i2c_close (Mcp23017Bus_t *bus_p)
+{
+	if (bus_p->fd >= 0)
+		close(bus_p->fd);
+	bus_p->fd = -1;
+	free(bus_p->scratch_p);
+	bus_p->scratch_p = NULL;
+	bus_p->scratchLen = 0;
+}
+
+static bool
+bus_select (Mcp23017Bus_t *bus_p, uint8_t addr)
+{
+	if (bus_p->curAddr == (int)addr)
+		return true;
+
+	if (ioctl(bus_p->fd, I2C_SLAVE, addr) < 0) {
+		mcp23017_priv__log_errno("can't set i2c slave address");
+		bus_p->curAddr = -1;
+		return false;
+	}
+	bus_p->curAddr = addr;
+	return true;
+}
+
+static bool
+scratch_reserve (Mcp23017Bus_t *bus_p, size_t len)
+{
+	uint8_t *p;
+
+	if (bus_p->scratchLen >= len)
+		return true;
+
+	p = realloc(bus_p->scratch_p, len);
+	if (p == NULL)
+		return false;
+	bus_p->scratch_p = p;
+	bus_p->scratchLen = len;
+	return true;
+}
+
+static bool
+rdwr_flush (Mcp23017Bus_t *bus_p, struct i2c_msg *msgs_p, unsigned nmsgs, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	struct i2c_rdwr_ioctl_data rdwr;
+	unsigned i;
+	int result = 0;
+
+	rdwr.msgs = msgs_p;
+	rdwr.nmsgs = nmsgs;
+	if (ioctl(bus_p->fd, I2C_RDWR, &rdwr) < 0)
+		result = -errno;
+
+	// the adapter doesn't say which message failed
+	for (i = 0; i < cnt; ++i)
+		xfer_p[i].result = result;
+	return result == 0;
+}
+
+/**
+ * all runs go out as one I2C_RDWR (repeated starts between messages), split
+ * only when the kernel's per-ioctl message limit is reached
+ */
+static bool
+xfer_i2c_rdwr (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	unsigned i, first, nmsgs;
+	size_t off, need;
+	uint8_t *reg_p;
+	bool ok = true;
+
+	// every write needs its data prefixed with the register address
+	need = 0;
+	for (i = 0; i < cnt; ++i)
+		need += xfer_p[i].read? 1u : (size_t)xfer_p[i].len + 1u;
+	if (!scratch_reserve(bus_p, need)) {
+		for (i = 0; i < cnt; ++i)
+			xfer_p[i].result = -ENOMEM;
+		return false;
+	}
+
+	nmsgs = 0;
+	first = 0;
+	off = 0;
+	for (i = 0; i < cnt; ++i) {
+		if (nmsgs + 2 > I2C_RDWR_IOCTL_MAX_MSGS) {
+			ok &= rdwr_flush(bus_p, msgs, nmsgs, &xfer_p[first], i - first);
+			nmsgs = 0;
+			first = i;
+		}
+
+		reg_p = bus_p->scratch_p + off;
+		*reg_p = xfer_p[i].reg;
+		msgs[nmsgs].addr = xfer_p[i].addr;
+		msgs[nmsgs].flags = 0;
+		msgs[nmsgs].buf = reg_p;
+		if (xfer_p[i].read) {
+			msgs[nmsgs++].len = 1;
+			msgs[nmsgs].addr = xfer_p[i].addr;
+			msgs[nmsgs].flags = I2C_M_RD;
+			msgs[nmsgs].len = xfer_p[i].len;
+			msgs[nmsgs++].buf = xfer_p[i].buf_p;
+			off += 1;
+		}
+		else {
+			memcpy(reg_p + 1, xfer_p[i].buf_p, xfer_p[i].len);
+			msgs[nmsgs++].len = (uint16_t)(xfer_p[i].len + 1);
+			off += (size_t)xfer_p[i].len + 1;
+		}
+	}
+
+	ok &= rdwr_flush(bus_p, msgs, nmsgs, &xfer_p[first], cnt - first);
+	return ok;
+}
+
+/**
+ * adapters without plain-i2c support: one SMBus transaction per run, runs
+ * longer than an SMBus block are split
+ */
+static int
+xfer_smbus (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p)
+{
+	int32_t ret;
+	uint16_t off;
+	uint8_t len, reg;
+
+	if (!bus_select(bus_p, xfer_p->addr))
+		return -EIO;
+
+	if (xfer_p->len == 1) {
+		if (xfer_p->read) {
+			ret = i2c_smbus_read_byte_data(bus_p->fd, xfer_p->reg);
+			if (ret < 0)
+				return ret;
+			xfer_p->buf_p[0] = (uint8_t)ret;
+			return 0;
+		}
+		return i2c_smbus_write_byte_data(bus_p->fd, xfer_p->reg, xfer_p->buf_p[0]);
+	}
+
+	if ((xfer_p->len == 2) && xfer_p->read && (bus_p->funcs & I2C_FUNC_SMBUS_READ_WORD_DATA)) {
+		ret = i2c_smbus_read_word_data(bus_p->fd, xfer_p->reg);
+		if (ret < 0)
+			return ret;
+		xfer_p->buf_p[0] = (uint8_t)(ret & 0xff);
+		xfer_p->buf_p[1] = (uint8_t)((ret >> 8) & 0xff);
+		return 0;
+	}
+	if ((xfer_p->len == 2) && !xfer_p->read && (bus_p->funcs & I2C_FUNC_SMBUS_WRITE_WORD_DATA))
+		return i2c_smbus_write_word_data(bus_p->fd, xfer_p->reg,
+				(uint16_t)(xfer_p->buf_p[0] | (xfer_p->buf_p[1] << 8)));
+
+	for (off = 0; off < xfer_p->len; off = (uint16_t)(off + len)) {
+		len = (uint8_t)((xfer_p->len - off) > I2C_SMBUS_BLOCK_MAX? I2C_SMBUS_BLOCK_MAX : (xfer_p->len - off));
+		reg = xfer_p->fixedReg? xfer_p->reg : (uint8_t)(xfer_p->reg + off);
+		if (xfer_p->read) {
+			if (!(bus_p->funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK))
+				goto bytewise;
+			ret = i2c_smbus_read_i2c_block_data(bus_p->fd, reg, len, xfer_p->buf_p + off);
+			if (ret < 0)
+				return ret;
+			if (ret != (int32_t)len)
+				return -EIO;
+		}
+		else {
+			if (!(bus_p->funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK))
+				goto bytewise;
+			ret = i2c_smbus_write_i2c_block_data(bus_p->fd, reg, len, xfer_p->buf_p + off);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+
+bytewise:
+	for (; off < xfer_p->len; ++off) {
+		reg = xfer_p->fixedReg? xfer_p->reg : (uint8_t)(xfer_p->reg + off);
+		if (xfer_p->read) {
+			ret = i2c_smbus_read_byte_data(bus_p->fd, reg);
+			if (ret < 0)
+				return ret;
+			xfer_p->buf_p[off] = (uint8_t)ret;
+		}
+		else {
+			ret = i2c_smbus_write_byte_data(bus_p->fd, reg, xfer_p->buf_p[off]);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * perform 'cnt' register runs using as few bus transactions as the
+ * adapter allows
+ */
+static bool
+i2c_xfer (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	unsigned i;
+	bool ok = true;
+
+	// a lone byte is cheapest as plain SMBus
+	if ((bus_p->funcs & I2C_FUNC_I2C) && !((cnt == 1) && (xfer_p->len == 1)))
+		return xfer_i2c_rdwr(bus_p, xfer_p, cnt);
+
+	for (i = 0; i < cnt; ++i) {
+		xfer_p[i].result = xfer_smbus(bus_p, &xfer_p[i]);
+		if (xfer_p[i].result != 0)
+			ok = false;
+	}
+	return ok;
+}
+
+const Mcp23017BusOps_t mcp23017_priv__i2cOps = {
+	.open = i2c_open,
+	.close = i2c_close,
+	.xfer = i2c_xfer,
+};
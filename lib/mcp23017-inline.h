@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * header-only fast path for tight loops (e.g. bit-banging), C11
+ * the register layout is fixed when compiling: define MCP23017_INLINE_BANK
+ * to 1 before including this for IOCON.BANK=1 (the chip has to be in that
+ * layout already, e.g. opened once with altRegAddr), the default is 0
+ * register addresses are constants and registers/ports/bits given to the
+ * macros are checked by the compiler; at run time each access is a single
+ * I2C_RDWR ioctl and nothing else: no library state, no locking, no cache,
+ * no checks; don't mix with library handles on the same chip while a loop
+ * is running
+ * the fd is opened close-on-exec when O_CLOEXEC is visible, which under
+ * plain -std=c11 needs _POSIX_C_SOURCE >= 200809L (or _GNU_SOURCE) defined
+ * before the first #include
+ */
+
+#ifndef LIB_MCP23017_INLINE__H
+#define LIB_MCP23017_INLINE__H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "mcp23017.h"
+
+#ifndef MCP23017_INLINE_BANK
+#define MCP23017_INLINE_BANK 0
+#endif
+_Static_assert((MCP23017_INLINE_BANK == 0) || (MCP23017_INLINE_BANK == 1),
+		"MCP23017_INLINE_BANK must be 0 or 1");
+
+// a C11 static assertion usable inside an expression (evaluates to 0)
+#define MCP23017_INLINE_CHECK(cond, msg) \
+	(0 * sizeof(struct { _Static_assert(cond, msg); int dummy; }))
+
+// address of register 'reg' (Mcp23017Reg_e) of port 'port' (Mcp23017Port_e)
+#if MCP23017_INLINE_BANK
+#define MCP23017_INLINE_ADDR_RAW(reg, port) (((port) << 4) | (reg))
+#else
+#define MCP23017_INLINE_ADDR_RAW(reg, port) (((reg) << 1) | (port))
+#endif
+#define MCP23017_INLINE_ADDR(reg, port) \
+	((uint8_t)(MCP23017_INLINE_ADDR_RAW(reg, port) + \
+		MCP23017_INLINE_CHECK(((reg) >= MCP23017_IODIR) && ((reg) < MCP23017_REG_CNT), "bad register") + \
+		MCP23017_INLINE_CHECK(((port) == PORTA) || ((port) == PORTB), "bad port")))
+
+// port and mask of pin 'bit' (Mcp23017Bit_e)
+#define MCP23017_INLINE_BIT_CHECK(bit) \
+	MCP23017_INLINE_CHECK(((bit) >= GPA0) && ((bit) <= GPB7), "bad bit")
+#define MCP23017_INLINE_PORT(bit) \
+	((Mcp23017Port_e)((((bit) >= GPB0)? PORTB : PORTA) + MCP23017_INLINE_BIT_CHECK(bit)))
+#define MCP23017_INLINE_MASK(bit) \
+	((uint8_t)((1u << (((bit) - GPA0) % 8)) + MCP23017_INLINE_BIT_CHECK(bit)))
+
+#ifdef O_CLOEXEC
+#define MCP23017_INLINE_OPEN_FLAGS (O_RDWR | O_CLOEXEC)
+#else
+#define MCP23017_INLINE_OPEN_FLAGS O_RDWR
+#endif
+
+typedef struct {
+	int fd;
+	uint16_t addr;
+} Mcp23017Inline_t;
+
+/**
+ * open 'devFile_p' (/dev/i2c-N) for the chip at 'i2cAddr'
+ */
+static inline bool
+mcp23017_inline__open (Mcp23017Inline_t *chip_p, const char *devFile_p, uint8_t i2cAddr)
+{
+	chip_p->fd = open(devFile_p, MCP23017_INLINE_OPEN_FLAGS);
+	chip_p->addr = i2cAddr;
+	return chip_p->fd >= 0;
+}
+
+static inline void
+mcp23017_inline__close (Mcp23017Inline_t *chip_p)
+{
+	close(chip_p->fd);
+	chip_p->fd = -1;
+}
+
+static inline bool
+mcp23017_inline__read_reg (const Mcp23017Inline_t *chip_p, uint8_t reg, uint8_t *val_p)
+{
+	struct i2c_msg msgs[2] = {
+		{ .addr = chip_p->addr, .flags = 0, .len = 1, .buf = &reg },
+		{ .addr = chip_p->addr, .flags = I2C_M_RD, .len = 1, .buf = val_p },
+	};
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = msgs, .nmsgs = 2 };
+
+	return ioctl(chip_p->fd, I2C_RDWR, &rdwr) >= 0;
+}
+
+static inline bool
+mcp23017_inline__write_reg (const Mcp23017Inline_t *chip_p, uint8_t reg, uint8_t val)
+{
+	uint8_t buf[2] = { reg, val };
+	struct i2c_msg msg = { .addr = chip_p->addr, .flags = 0, .len = 2, .buf = buf };
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = &msg, .nmsgs = 1 };
+
+	return ioctl(chip_p->fd, I2C_RDWR, &rdwr) >= 0;
+}
+
+/**
+ * both ports in one ioctl, port A in the low byte
+ */
+static inline bool
+mcp23017_inline__read_port16 (const Mcp23017Inline_t *chip_p, uint16_t *val_p)
+{
+	uint8_t buf[2];
+#if MCP23017_INLINE_BANK
+	uint8_t regA = MCP23017_INLINE_ADDR(MCP23017_GPIO, PORTA);
+	uint8_t regB = MCP23017_INLINE_ADDR(MCP23017_GPIO, PORTB);
+	struct i2c_msg msgs[4] = {
+		{ .addr = chip_p->addr, .flags = 0, .len = 1, .buf = &regA },
+		{ .addr = chip_p->addr, .flags = I2C_M_RD, .len = 1, .buf = &buf[0] },
+		{ .addr = chip_p->addr, .flags = 0, .len = 1, .buf = &regB },
+		{ .addr = chip_p->addr, .flags = I2C_M_RD, .len = 1, .buf = &buf[1] },
+	};
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = msgs, .nmsgs = 4 };
+#else
+	uint8_t reg = MCP23017_INLINE_ADDR(MCP23017_GPIO, PORTA);
+	struct i2c_msg msgs[2] = {
+		{ .addr = chip_p->addr, .flags = 0, .len = 1, .buf = &reg },
+		{ .addr = chip_p->addr, .flags = I2C_M_RD, .len = 2, .buf = buf },
+	};
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = msgs, .nmsgs = 2 };
+#endif
+
+	if (ioctl(chip_p->fd, I2C_RDWR, &rdwr) < 0)
+		return false;
+	*val_p = (uint16_t)(buf[0] | (buf[1] << 8));
+	return true;
+}
+
+static inline bool
+mcp23017_inline__write_port16 (const Mcp23017Inline_t *chip_p, uint16_t val)
+{
+#if MCP23017_INLINE_BANK
+	uint8_t bufA[2] = { MCP23017_INLINE_ADDR(MCP23017_GPIO, PORTA), (uint8_t)(val & 0xff) };
+	uint8_t bufB[2] = { MCP23017_INLINE_ADDR(MCP23017_GPIO, PORTB), (uint8_t)(val >> 8) };
+	struct i2c_msg msgs[2] = {
+		{ .addr = chip_p->addr, .flags = 0, .len = 2, .buf = bufA },
+		{ .addr = chip_p->addr, .flags = 0, .len = 2, .buf = bufB },
+	};
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = msgs, .nmsgs = 2 };
+#else
+	uint8_t buf[3] = { MCP23017_INLINE_ADDR(MCP23017_GPIO, PORTA), (uint8_t)(val & 0xff), (uint8_t)(val >> 8) };
+	struct i2c_msg msg = { .addr = chip_p->addr, .flags = 0, .len = 3, .buf = buf };
+	struct i2c_rdwr_ioctl_data rdwr = { .msgs = &msg, .nmsgs = 1 };
+#endif
+
+	return ioctl(chip_p->fd, I2C_RDWR, &rdwr) >= 0;
+}
+
+/*
+ * register/port/bit arguments must be constants; they are checked when
+ * compiling
+ */
+#define MCP23017_INLINE_READ(chip_p, reg, port, val_p) \
+	mcp23017_inline__read_reg(chip_p, MCP23017_INLINE_ADDR(reg, port), val_p)
+#define MCP23017_INLINE_WRITE(chip_p, reg, port, val) \
+	mcp23017_inline__write_reg(chip_p, MCP23017_INLINE_ADDR(reg, port), val)
+
+// drive a whole port (writes OLAT through GPIO)
+#define MCP23017_INLINE_WRITE_PORT(chip_p, port, val) \
+	MCP23017_INLINE_WRITE(chip_p, MCP23017_GPIO, port, val)
+#define MCP23017_INLINE_READ_PORT(chip_p, port, val_p) \
+	MCP23017_INLINE_READ(chip_p, MCP23017_GPIO, port, val_p)
+
+/*
+ * single pins: the caller keeps the port's output state in 'olat' (a
+ * uint8_t lvalue) so no read is needed
+ */
+#define MCP23017_INLINE_SET_BIT(chip_p, olat, bit) \
+	MCP23017_INLINE_WRITE_PORT(chip_p, MCP23017_INLINE_PORT(bit), \
+		(olat) = (uint8_t)((olat) | MCP23017_INLINE_MASK(bit)))
+#define MCP23017_INLINE_CLEAR_BIT(chip_p, olat, bit) \
+	MCP23017_INLINE_WRITE_PORT(chip_p, MCP23017_INLINE_PORT(bit), \
+		(olat) = (uint8_t)((olat) & (uint8_t)~MCP23017_INLINE_MASK(bit)))
+
+#endif
@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * interrupt-on-change support
+ * the chip flags input changes in INTF and latches the port in INTCAP,
+ * asserting its INT pin; the host sees that as an edge on one of its own
+ * GPIO lines (via the GPIO character device) or on any pollable fd the
+ * application provides
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define IOCON_MIRROR 0x40
+#define IOCON_SEQOP 0x20
+#define IOCON_ODR 0x04
+#define IOCON_INTPOL 0x02
+
+/**
+ * configure 'pins' (port A in the low byte, port B in the high byte) to
+ * interrupt on any change, or on differing from the matching bit of
+ * 'defval'; MCP23017_IRQ_NONE stops them interrupting
+ * pins not in 'pins' are left alone
+ */
+bool
+mcp23017__irq_config_pins (Mcp23017_t *dev_p, uint16_t pins, Mcp23017IrqMode_e mode, uint16_t defval)
+{
+	// GPINTEN, DEFVAL, INTCON per port
+	uint8_t regs[MCP23017_INTCON - MCP23017_GPINTEN + 1][2];
+	uint8_t buf[6];
+	uint8_t mask, val, iocon;
+	Mcp23017Port_e port;
+	Mcp23017Reg_e reg;
+	Mcp23017Xfer_t xfer[6];
+	unsigned i, cnt;
+	bool ok = false;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+	if (mode > MCP23017_IRQ_COMPARE)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon))
+		goto done;
+	for (port = PORTA; port <= PORTB; ++port) {
+		mask = (uint8_t)(pins >> (8 * port));
+		for (reg = MCP23017_GPINTEN; reg <= MCP23017_INTCON; ++reg) {
+			if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, reg, port), &val))
+				goto done;
+			regs[reg - MCP23017_GPINTEN][port] = val;
+		}
+
+		if (mode == MCP23017_IRQ_NONE)
+			regs[0][port] &= (uint8_t)~mask;
+		else
+			regs[0][port] |= mask;
+		if (mode == MCP23017_IRQ_COMPARE) {
+			regs[1][port] = (uint8_t)((regs[1][port] & ~mask) | ((defval >> (8 * port)) & mask));
+			regs[2][port] |= mask;
+		}
+		else if (mode == MCP23017_IRQ_CHANGE)
+			regs[2][port] &= (uint8_t)~mask;
+	}
+
+	// the three registers are adjacent in both layouts: interleaved A/B
+	// pairs with BANK=0, one run per port with BANK=1; in byte mode
+	// (IOCON.SEQOP=1) the address pointer doesn't advance, so each register
+	// is a run of its own
+	cnt = 0;
+	if (iocon & IOCON_SEQOP) {
+		for (port = PORTA; port <= PORTB; ++port) {
+			for (i = 0; i < 3; ++i) {
+				buf[cnt] = regs[i][port];
+				xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, (Mcp23017Reg_e)(MCP23017_GPINTEN + i), port);
+				xfer[cnt].len = 1;
+				xfer[cnt].buf_p = &buf[cnt];
+				++cnt;
+			}
+		}
+	}
+	else if (!dev_p->bank1) {
+		for (i = 0; i < 3; ++i) {
+			buf[2 * i] = regs[i][PORTA];
+			buf[2 * i + 1] = regs[i][PORTB];
+		}
+		xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_GPINTEN, PORTA);
+		xfer[cnt].len = 6;
+		xfer[cnt].buf_p = buf;
+		++cnt;
+	}
+	else {
+		for (port = PORTA; port <= PORTB; ++port) {
+			for (i = 0; i < 3; ++i)
+				buf[3 * port + i] = regs[i][port];
+			xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_GPINTEN, port);
+			xfer[cnt].len = 3;
+			xfer[cnt].buf_p = &buf[3 * port];
+			++cnt;
+		}
+	}
+	for (i = 0; i < cnt; ++i) {
+		xfer[i].addr = dev_p->addr;
+		xfer[i].read = false;
+		xfer[i].fixedReg = false;
+		xfer[i].noRetry = false;
+	}
+	if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt))
+		goto done;
+
+	for (port = PORTA; port <= PORTB; ++port)
+		for (reg = MCP23017_GPINTEN; reg <= MCP23017_INTCON; ++reg)
+			mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, reg, port),
+					regs[reg - MCP23017_GPINTEN][port]);
+	ok = true;
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
+
+/**
+ * configure the INT pin(s)
+ * mirror: INTA and INTB are OR'ed together so one host line covers both ports
+ * openDrain: several chips can share one (pulled-up) host line
+ * activeHigh: INT polarity (ignored with openDrain, which is always active-low)
+ */
+bool
+mcp23017__irq_config_output (Mcp23017_t *dev_p, bool mirror, bool openDrain, bool activeHigh)
+{
+	uint8_t reg, val;
+	bool ok;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	reg = mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA);
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	ok = mcp23017_priv__read_reg(dev_p, reg, &val);
+	if (ok) {
+		val &= (uint8_t)~(IOCON_MIRROR | IOCON_ODR | IOCON_INTPOL);
+		if (mirror)
+			val |= IOCON_MIRROR;
+		if (openDrain)
+			val |= IOCON_ODR;
+		else if (activeHigh)
+			val |= IOCON_INTPOL;
+		ok = mcp23017_priv__write_reg(dev_p, reg, val);
+	}
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
+
+static void
+irq_detach (Mcp23017_t *dev_p)
+{
+	if (dev_p->irqFdOwned && (dev_p->irqFd >= 0))
+		close(dev_p->irqFd);
+	dev_p->irqFd = -1;
+	dev_p->irqFdOwned = false;
+	dev_p->irqFdGpio = false;
+}
+
+void
+mcp23017_priv__irq_release (Mcp23017_t *dev_p)
+{
+	irq_detach(dev_p);
+}
+
+/**
+ * read (and so clear) INTF and INTCAP for both ports in one transaction
+ * with BANK=0 they are the four adjacent registers INTFA..INTCAPB, with
+ * BANK=1 they are two INTF/INTCAP pairs sent as one combined transfer;
+ * in byte mode (IOCON.SEQOP=1) each register is a run of its own
+ * intf_p/intcap_p: port A in the low byte, port B in the high byte
+ */
+static bool
+read_intf_intcap (Mcp23017_t *dev_p, uint16_t *intf_p, uint16_t *intcap_p)
+{
+	uint8_t buf[4];
+	uint8_t iocon;
+	Mcp23017Xfer_t xfer[4];
+	Mcp23017Port_e port;
+	unsigned i, cnt = 0;
+
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon))
+		return false;
+
+	// 'buf' is in the layout's order either way
+	if (iocon & IOCON_SEQOP) {
+		for (port = PORTA; port <= PORTB; ++port) {
+			for (i = 0; i < 2; ++i) {
+				xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, (Mcp23017Reg_e)(MCP23017_INTF + i), port);
+				xfer[cnt].len = 1;
+				xfer[cnt].buf_p = dev_p->bank1? &buf[2 * port + i] : &buf[2 * i + port];
+				++cnt;
+			}
+		}
+	}
+	else if (!dev_p->bank1) {
+		xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_INTF, PORTA);
+		xfer[cnt].len = 4;
+		xfer[cnt].buf_p = buf;
+		++cnt;
+	}
+	else {
+		for (port = PORTA; port <= PORTB; ++port) {
+			xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_INTF, port);
+			xfer[cnt].len = 2;
+			xfer[cnt].buf_p = &buf[2 * port];
+			++cnt;
+		}
+	}
+	for (i = 0; i < cnt; ++i) {
+		xfer[i].addr = dev_p->addr;
+		xfer[i].read = true;
+		xfer[i].fixedReg = false;
+		xfer[i].noRetry = false;
+	}
+	if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt))
+		return false;
+
+	if (!dev_p->bank1) {
+		*intf_p = (uint16_t)(buf[0] | (buf[1] << 8));
+		*intcap_p = (uint16_t)(buf[2] | (buf[3] << 8));
+	}
+	else {
+		*intf_p = (uint16_t)(buf[0] | (buf[2] << 8));
+		*intcap_p = (uint16_t)(buf[1] | (buf[3] << 8));
+	}
+	return true;
+}
+
+/**
+ * watch the host GPIO line 'line' of 'chip_p' (e.g. "/dev/gpiochip0")
+ * which is wired to the chip's INT pin (INTA, or either with mirroring)
+ * the edge watched follows IOCON.INTPOL/ODR, so configure the output first
+ */
+bool
+mcp23017__irq_attach_gpio (Mcp23017_t *dev_p, const char *chip_p, unsigned line)
+{
+	int chipFd;
+	uint8_t iocon;
+	uint16_t intf, intcap;
+	struct gpioevent_request req;
+
+	// preconds
+	if ((dev_p == NULL) || (chip_p == NULL))
+		return false;
+
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon))
+		return false;
+
+	chipFd = open(chip_p, O_RDONLY | O_CLOEXEC);
+	if (chipFd < 0) {
+		mcp23017_priv__log_errno("open(gpio chip)");
+		return false;
+	}
+
+	// the v1 line-event ABI is used since it is available on every kernel
+	// which has the GPIO character device
+	memset(&req, 0, sizeof(req));
+	req.lineoffset = line;
+	req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	if ((iocon & IOCON_INTPOL) && !(iocon & IOCON_ODR))
+		req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+	else
+		req.eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+	strncpy(req.consumer_label, PACKAGE, sizeof(req.consumer_label) - 1);
+	if (ioctl(chipFd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+		mcp23017_priv__log_errno("GPIO_GET_LINEEVENT_IOCTL");
+		close(chipFd);
+		return false;
+	}
+	close(chipFd);
+	if (fcntl(req.fd, F_SETFL, O_NONBLOCK) < 0) {
+		mcp23017_priv__log_errno("fcntl(O_NONBLOCK)");
+		close(req.fd);
+		return false;
+	}
+
+	irq_detach(dev_p);
+	dev_p->irqFd = req.fd;
+	dev_p->irqFdOwned = true;
+	dev_p->irqFdGpio = true;
+
+	// release an interrupt that may have been pending since before we
+	// were watching; otherwise INT never toggles and no edge is seen
+	return read_intf_intcap(dev_p, &intf, &intcap);
+}
+
+/**
+ * use a caller-provided fd to learn about interrupts instead (an eventfd,
+ * pipe, sysfs gpio "value" file, ...); it becomes readable (or raises
+ * POLLPRI) whenever INT asserts
+ * the library drains it but does not close it
+ */
+bool
+mcp23017__irq_attach_fd (Mcp23017_t *dev_p, int fd)
+{
+	uint16_t intf, intcap;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+	if (fd < 0)
+		return false;
+
+	irq_detach(dev_p);
+	dev_p->irqFd = fd;
+	return read_intf_intcap(dev_p, &intf, &intcap);
+}
+
+/**
+ * the fd to add to the application's own poll/epoll set; when it is ready
+ * call mcp23017__irq_read_events()
+ */
+int
+mcp23017__irq_fd (Mcp23017_t *dev_p)
+{
+	// preconds
+	if (dev_p == NULL)
+		return -1;
+
+	return dev_p->irqFd;
+}
+
+static uint64_t
+ts_ns (const struct timespec *ts_p)
+{
+	return (uint64_t)ts_p->tv_sec * 1000000000ull + (uint64_t)ts_p->tv_nsec;
+}
+
+/**
+ * consume whatever made the fd ready; returns the CLOCK_MONOTONIC time of
+ * the edge
+ */
+static void
+irq_drain (Mcp23017_t *dev_p, short revents, struct timespec *ts_p)
+{
+	struct gpioevent_data ev;
+	struct timespec rt;
+	uint8_t buf[64];
+	uint64_t mono, real, stamp = 0;
+	ssize_t ret;
+
+	clock_gettime(CLOCK_MONOTONIC, ts_p);
+
+	// several queued edges are one interrupt as far as INTF/INTCAP are
+	// concerned; report the most recent
+	if (dev_p->irqFdGpio) {
+		while (read(dev_p->irqFd, &ev, sizeof(ev)) == (ssize_t)sizeof(ev))
+			stamp = ev.timestamp;
+		if (stamp == 0)
+			return;
+
+		// kernels before 5.7 stamp line events with CLOCK_REALTIME; the
+		// edge is recent, so whichever clock it is closer to is its own
+		clock_gettime(CLOCK_REALTIME, &rt);
+		mono = ts_ns(ts_p);
+		real = ts_ns(&rt);
+		if (((stamp > mono)? stamp - mono : mono - stamp) > ((stamp > real)? stamp - real : real - stamp))
+			stamp = (stamp > real - mono)? stamp - (real - mono) : 0;
+		if ((stamp != 0) && (stamp <= mono)) {
+			ts_p->tv_sec = (time_t)(stamp / 1000000000ull);
+			ts_p->tv_nsec = (long)(stamp % 1000000000ull);
+		}
+		return;
+	}
+
+	// sysfs-style: re-read from the start to re-arm
+	if (revents & POLLPRI) {
+		lseek(dev_p->irqFd, 0, SEEK_SET);
+		ret = read(dev_p->irqFd, buf, sizeof(buf));
+		(void)ret;
+	}
+	else if (revents & POLLIN) {
+		ret = read(dev_p->irqFd, buf, sizeof(buf));
+		(void)ret;
+	}
+}
+
+/**
+ * service a pending interrupt without waiting; decodes INTF/INTCAP into
+ * (pin, level, timestamp) events
+ * returns the number of events stored, or -1 on error
+ */
+static int
+irq_service (Mcp23017_t *dev_p, const struct timespec *ts_p, Mcp23017Event_t *events_p)
+{
+	uint16_t intf, intcap;
+	unsigned bit;
+	int cnt = 0;
+
+	if (!read_intf_intcap(dev_p, &intf, &intcap))
+		return -1;
+
+	for (bit = 0; bit < 16; ++bit) {
+		if (!(intf & (1u << bit)))
+			continue;
+		events_p[cnt].pin = (Mcp23017Bit_e)(GPA0 + bit);
+		events_p[cnt].level = (intcap & (1u << bit)) != 0;
+		events_p[cnt].ts = *ts_p;
+		++cnt;
+	}
+
+	return cnt;
+}
+
+/**
+ * call when mcp23017__irq_fd() is ready
+ * 'events_p' has to have room for MCP23017_IRQ_EVENTS_MAX events: reading
+ * them clears the interrupt, so none can be left for later
+ * returns the number of events stored in 'events_p', or -1 on error
+ */
+int
+mcp23017__irq_read_events (Mcp23017_t *dev_p, Mcp23017Event_t *events_p, unsigned max)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+
+	// preconds
+	if (dev_p == NULL)
+		return -1;
+	if ((events_p == NULL) || (max < MCP23017_IRQ_EVENTS_MAX)) {
+		mcp23017_priv__set_error(dev_p, EINVAL, -1, -1);
+		return -1;
+	}
+
+	pfd.revents = 0;
+	if (dev_p->irqFd >= 0) {
+		pfd.fd = dev_p->irqFd;
+		pfd.events = POLLIN | POLLPRI;
+		if (poll(&pfd, 1, 0) < 0)
+			pfd.revents = 0;
+	}
+	irq_drain(dev_p, pfd.revents, &ts);
+	return irq_service(dev_p, &ts, events_p);
+}
+
+/**
+ * block until the chip interrupts (or 'timeoutMs' passes; -1 waits forever)
+ * 'events_p' has to have room for MCP23017_IRQ_EVENTS_MAX events
+ * returns the number of events stored in 'events_p', 0 on timeout, or -1
+ * on error
+ */
+int
+mcp23017__irq_wait (Mcp23017_t *dev_p, int timeoutMs, Mcp23017Event_t *events_p, unsigned max)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	int ret;
+
+	// preconds
+	if (dev_p == NULL)
+		return -1;
+	if (dev_p->irqFd < 0)
+		return -1;
+	if ((events_p == NULL) || (max < MCP23017_IRQ_EVENTS_MAX)) {
+		mcp23017_priv__set_error(dev_p, EINVAL, -1, -1);
+		return -1;
+	}
+
+	pfd.fd = dev_p->irqFd;
+	pfd.events = POLLIN | POLLPRI;
+	do {
+		ret = poll(&pfd, 1, timeoutMs);
+	} while ((ret < 0) && (errno == EINTR));
+	if (ret < 0)
+		return -1;
+	if (ret == 0)
+		return 0;
+
+	irq_drain(dev_p, pfd.revents, &ts);
+	return irq_service(dev_p, &ts, events_p);
+}
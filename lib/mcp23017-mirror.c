@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * shared-memory mirror of input state
+ * one process (the publisher) polls the chips, or services their
+ * interrupts, and stores what it sees in a memory-mapped file; any number
+ * of processes map the file and read it without making a syscall or
+ * touching the bus
+ * each chip has a slot protected by a seqlock: the publisher makes the
+ * sequence odd, updates the slot and makes it even again; a reader retries
+ * if the sequence was odd or changed while it copied the slot
+ * everything in a slot is a 32-bit atomic so this works across processes
+ * (and on 32-bit targets) without locks
+ * readers judge freshness by the timestamps; a publisher that goes away
+ * simply stops updating them
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define MIRROR_MAGIC 0x4d32334du        // "M23M"
+#define MIRROR_VERSION 1
+#define MIRROR_READ_TRIES 100000
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chipCnt;
+	uint32_t slotSize;
+} MirrorHdr_t;
+
+// one chip, a cache line of its own
+typedef struct {
+	atomic_uint_least32_t seq;
+	atomic_uint_least32_t levels;   // gpio | intcap << 16
+	atomic_uint_least32_t intf;
+	atomic_uint_least32_t gpioTs[2];        // low, high
+	atomic_uint_least32_t intcapTs[2];
+} __attribute__((aligned(64))) MirrorSlot_t;
+
+struct Mcp23017Mirror_s {
+	void *map_p;
+	size_t len;
+	bool publisher;
+	unsigned chipCnt;
+	MirrorSlot_t *slots_p;
+	pthread_mutex_t lock;           // publishers within this process
+};
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t
+mirror_len (unsigned chipCnt)
+{
+	return sizeof(MirrorSlot_t) + chipCnt * sizeof(MirrorSlot_t);
+}
+
+static Mcp23017Mirror_t *
+mirror_map (int fd, size_t len, bool publisher)
+{
+	Mcp23017Mirror_t *mirror_p;
+
+	mirror_p = calloc(1, sizeof(*mirror_p));
+	if (mirror_p == NULL)
+		return NULL;
+	mirror_p->map_p = mmap(NULL, len, publisher? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	if (mirror_p->map_p == MAP_FAILED) {
+		free(mirror_p);
+		return NULL;
+	}
+	mirror_p->len = len;
+	mirror_p->publisher = publisher;
+	// the header gets the first slot's worth of space, so slots stay aligned
+	mirror_p->slots_p = (MirrorSlot_t *)mirror_p->map_p + 1;
+	pthread_mutex_init(&mirror_p->lock, NULL);
+	return mirror_p;
+}
+
+/**
+ * create the mirror file 'path_p' with room for 'chipCnt' chips, and
+ * become its publisher
+ * the file is built aside and renamed into place, so readers of a previous
+ * file are never disturbed: they just see its timestamps stop
+ */
+Mcp23017Mirror_t *
+mcp23017__mirror_create (const char *path_p, unsigned chipCnt)
+{
+	Mcp23017Mirror_t *mirror_p = NULL;
+	MirrorHdr_t *hdr_p;
+	char *tmp_p;
+	size_t len;
+	int fd;
+
+	// preconds
+	if ((path_p == NULL) || (chipCnt == 0))
+		return NULL;
+
+	len = strlen(path_p) + 16;
+	tmp_p = malloc(len);
+	if (tmp_p == NULL) {
+		mcp23017_priv__log_errno("malloc(mirror)");
+		return NULL;
+	}
+	snprintf(tmp_p, len, "%s.%d", path_p, (int)getpid());
+
+	fd = open(tmp_p, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		mcp23017_priv__log_errno(tmp_p);
+		free(tmp_p);
+		return NULL;
+	}
+	len = mirror_len(chipCnt);
+	if (ftruncate(fd, (off_t)len) != 0) {
+		mcp23017_priv__log_errno("ftruncate(mirror)");
+		goto err;
+	}
+	mirror_p = mirror_map(fd, len, true);
+	if (mirror_p == NULL) {
+		mcp23017_priv__log_errno("mmap(mirror)");
+		goto err;
+	}
+	mirror_p->chipCnt = chipCnt;
+
+	hdr_p = mirror_p->map_p;
+	hdr_p->magic = MIRROR_MAGIC;
+	hdr_p->version = MIRROR_VERSION;
+	hdr_p->chipCnt = chipCnt;
+	hdr_p->slotSize = (uint32_t)sizeof(MirrorSlot_t);
+
+	if (rename(tmp_p, path_p) != 0) {
+		mcp23017_priv__log_errno("rename(mirror)");
+		mcp23017__mirror_close(mirror_p);
+		mirror_p = NULL;
+		goto err;
+	}
+	close(fd);
+	free(tmp_p);
+	return mirror_p;
+
+err:
+	close(fd);
+	unlink(tmp_p);
+	free(tmp_p);
+	return NULL;
+}
+
+/**
+ * map an existing mirror file for reading
+ */
+Mcp23017Mirror_t *
+mcp23017__mirror_open (const char *path_p)
+{
+	Mcp23017Mirror_t *mirror_p;
+	MirrorHdr_t hdr;
+	struct stat st;
+	int fd;
+
+	// preconds
+	if (path_p == NULL)
+		return NULL;
+
+	fd = open(path_p, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		mcp23017_priv__set_error(NULL, errno, -1, -1);
+		return NULL;
+	}
+	if ((fstat(fd, &st) != 0) || (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		close(fd);
+		return NULL;
+	}
+	if ((hdr.magic != MIRROR_MAGIC) || (hdr.version != MIRROR_VERSION)
+			|| (hdr.slotSize != sizeof(MirrorSlot_t)) || (hdr.chipCnt == 0)
+			|| ((size_t)st.st_size < mirror_len(hdr.chipCnt))) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		close(fd);
+		return NULL;
+	}
+
+	mirror_p = mirror_map(fd, mirror_len(hdr.chipCnt), false);
+	if (mirror_p == NULL)
+		mcp23017_priv__set_error(NULL, errno, -1, -1);
+	else
+		mirror_p->chipCnt = hdr.chipCnt;
+	close(fd);
+	return mirror_p;
+}
+
+/**
+ * unmap the mirror; the file stays, a publisher's last values in it
+ */
+void
+mcp23017__mirror_close (Mcp23017Mirror_t *mirror_p)
+{
+	// preconds
+	if (mirror_p == NULL)
+		return;
+
+	munmap(mirror_p->map_p, mirror_p->len);
+	pthread_mutex_destroy(&mirror_p->lock);
+	free(mirror_p);
+}
+
+unsigned
+mcp23017__mirror_count (const Mcp23017Mirror_t *mirror_p)
+{
+	// preconds
+	if (mirror_p == NULL)
+		return 0;
+
+	return mirror_p->chipCnt;
+}
+
+static void
+store_ts (atomic_uint_least32_t *ts_p, uint64_t ts)
+{
+	atomic_store_explicit(&ts_p[0], (uint32_t)ts, memory_order_relaxed);
+	atomic_store_explicit(&ts_p[1], (uint32_t)(ts >> 32), memory_order_relaxed);
+}
+
+static uint64_t
+load_ts (const atomic_uint_least32_t *ts_p)
+{
+	return (uint64_t)atomic_load_explicit(&ts_p[0], memory_order_relaxed)
+		| ((uint64_t)atomic_load_explicit(&ts_p[1], memory_order_relaxed) << 32);
+}
+
+// open slot 'idx' for writing; returns NULL (unlocked) if it can't be
+static MirrorSlot_t *
+write_begin (Mcp23017Mirror_t *mirror_p, unsigned idx)
+{
+	MirrorSlot_t *slot_p;
+	uint32_t seq;
+
+	if ((mirror_p == NULL) || !mirror_p->publisher || (idx >= mirror_p->chipCnt))
+		return NULL;
+
+	pthread_mutex_lock(&mirror_p->lock);
+	slot_p = &mirror_p->slots_p[idx];
+	seq = (uint32_t)atomic_load_explicit(&slot_p->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot_p->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	return slot_p;
+}
+
+static void
+write_end (Mcp23017Mirror_t *mirror_p, MirrorSlot_t *slot_p)
+{
+	uint32_t seq;
+
+	seq = (uint32_t)atomic_load_explicit(&slot_p->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot_p->seq, seq + 1, memory_order_release);
+	pthread_mutex_unlock(&mirror_p->lock);
+}
+
+/**
+ * publish a reading of both ports (port A in the low byte) of chip 'idx',
+ * taken now
+ */
+bool
+mcp23017__mirror_publish (Mcp23017Mirror_t *mirror_p, unsigned idx, uint16_t gpio)
+{
+	MirrorSlot_t *slot_p;
+	uint32_t levels;
+	uint64_t ts = now_ns();
+
+	slot_p = write_begin(mirror_p, idx);
+	if (slot_p == NULL)
+		return false;
+
+	levels = (uint32_t)atomic_load_explicit(&slot_p->levels, memory_order_relaxed);
+	levels = (levels & 0xffff0000u) | gpio;
+	atomic_store_explicit(&slot_p->levels, levels, memory_order_relaxed);
+	store_ts(slot_p->gpioTs, ts);
+
+	write_end(mirror_p, slot_p);
+	return true;
+}
+
+/**
+ * publish the interrupt events of chip 'idx' (as returned by
+ * mcp23017__irq_read_events() or mcp23017__irq_wait()): their pins become
+ * 'intf', their levels are merged into 'intcap' and the time of the last
+ * event becomes 'intcapTs'
+ */
+bool
+mcp23017__mirror_publish_events (Mcp23017Mirror_t *mirror_p, unsigned idx, const Mcp23017Event_t *events_p, unsigned cnt)
+{
+	MirrorSlot_t *slot_p;
+	uint32_t levels, intf = 0, bit;
+	uint64_t ts = 0;
+	unsigned i;
+
+	// preconds
+	if ((events_p == NULL) || (cnt == 0))
+		return false;
+	for (i = 0; i < cnt; ++i)
+		if ((events_p[i].pin < GPA0) || (events_p[i].pin > GPB7))
+			return false;
+
+	slot_p = write_begin(mirror_p, idx);
+	if (slot_p == NULL)
+		return false;
+
+	levels = (uint32_t)atomic_load_explicit(&slot_p->levels, memory_order_relaxed);
+	for (i = 0; i < cnt; ++i) {
+		bit = 1u << (16 + (events_p[i].pin - GPA0));
+		levels = events_p[i].level? (levels | bit) : (levels & ~bit);
+		intf |= bit >> 16;
+		ts = (uint64_t)events_p[i].ts.tv_sec * 1000000000ull + (uint64_t)events_p[i].ts.tv_nsec;
+	}
+	atomic_store_explicit(&slot_p->levels, levels, memory_order_relaxed);
+	atomic_store_explicit(&slot_p->intf, intf, memory_order_relaxed);
+	store_ts(slot_p->intcapTs, ts);
+
+	write_end(mirror_p, slot_p);
+	return true;
+}
+
+/**
+ * read both ports of 'dev_p' and publish them as chip 'idx'; on failure
+ * nothing is published, so readers see the entry age
+ */
+bool
+mcp23017__mirror_poll (Mcp23017Mirror_t *mirror_p, unsigned idx, Mcp23017_t *dev_p)
+{
+	uint16_t gpio;
+
+	if (!mcp23017__dev_read_port16(dev_p, &gpio))
+		return false;
+	return mcp23017__mirror_publish(mirror_p, idx, gpio);
+}
+
+/**
+ * the latest state of chip 'idx'; no syscalls, no bus traffic
+ * fails (errno EAGAIN) only if the publisher is seen in the middle of an
+ * update many times in a row, i.e. it died there
+ */
+bool
+mcp23017__mirror_read (const Mcp23017Mirror_t *mirror_p, unsigned idx, Mcp23017MirrorState_t *state_p)
+{
+	const MirrorSlot_t *slot_p;
+	uint32_t seq1, seq2, levels;
+	unsigned tries;
+
+	// preconds
+	if ((mirror_p == NULL) || (state_p == NULL) || (idx >= mirror_p->chipCnt))
+		return false;
+
+	slot_p = &mirror_p->slots_p[idx];
+	for (tries = 0; tries < MIRROR_READ_TRIES; ++tries) {
+		seq1 = (uint32_t)atomic_load_explicit(&slot_p->seq, memory_order_acquire);
+		if (seq1 & 1)
+			continue;
+
+		levels = (uint32_t)atomic_load_explicit(&slot_p->levels, memory_order_relaxed);
+		state_p->intf = (uint16_t)atomic_load_explicit(&slot_p->intf, memory_order_relaxed);
+		state_p->gpioTs = load_ts(slot_p->gpioTs);
+		state_p->intcapTs = load_ts(slot_p->intcapTs);
+
+		atomic_thread_fence(memory_order_acquire);
+		seq2 = (uint32_t)atomic_load_explicit(&slot_p->seq, memory_order_relaxed);
+		if (seq1 == seq2) {
+			state_p->gpio = (uint16_t)levels;
+			state_p->intcap = (uint16_t)(levels >> 16);
+			return true;
+		}
+	}
+
+	mcp23017_priv__set_error(NULL, EAGAIN, -1, -1);
+	return false;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * library-internal definitions shared between the lib/ translation units;
+ * this header is not installed
+ */
+
+#ifndef LIB_MCP23017_PRIVATE__H
+#define LIB_MCP23017_PRIVATE__H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <linux/spi/spidev.h>
+
+#include "mcp23017.h"
+
+// one contiguous run of registers on one chip
+typedef struct {
+	uint8_t addr;
+	uint8_t reg;
+	bool read;
+	bool fixedReg;          // chip is in byte mode (IOCON.SEQOP=1)
+	bool noRetry;           // not safe to repeat (e.g. a burst of output values)
+	uint16_t len;
+	uint8_t *buf_p;
+	int result;             // set by the transfer: 0 or -errno
+	unsigned retries;       // set by the transfer: attempts beyond the first
+} Mcp23017Xfer_t;
+
+// longest device path an adapter can be opened by
+#define MCP23017_DEVFILE_MAX 128
+
+typedef struct Mcp23017Bus_s Mcp23017Bus_t;
+
+// transport backend
+typedef struct {
+	bool (*open) (Mcp23017Bus_t *bus_p);
+	void (*close) (Mcp23017Bus_t *bus_p);
+	// perform 'cnt' register runs using as few bus transactions as
+	// possible; every run is attempted and gets its own 'result'
+	bool (*xfer) (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt);
+} Mcp23017BusOps_t;
+
+extern const Mcp23017BusOps_t mcp23017_priv__i2cOps;
+extern const Mcp23017BusOps_t mcp23017_priv__simOps;
+extern const Mcp23017BusOps_t mcp23017_priv__spiOps;
+
+// one per adapter (i.e. /dev/i2c-N), shared by every chip on that bus
+// 'lock' (recursive) serializes everything that touches the adapter, and
+// every chip's cache; 'combLock' only guards the port-update queues and is
+// never held across bus traffic
+struct Mcp23017Bus_s {
+	pthread_mutex_t lock;
+	pthread_mutex_t combLock;
+	pthread_cond_t combCv;
+	char devFile[MCP23017_DEVFILE_MAX];
+	const Mcp23017BusOps_t *ops_p;
+	void *priv_p;           // transport-specific state
+	void *sim_p;            // simulated chips behind this bus, if any
+	void *async_p;          // asynchronous engine, if started
+	int fd;
+	unsigned long funcs;
+	int curAddr;            // last address given to I2C_SLAVE, -1 if none
+	uint8_t *scratch_p;     // staging for I2C_RDWR write messages
+	size_t scratchLen;
+	unsigned retries;       // transient failures retried per transfer
+	unsigned backoffUs;     // wait before the first retry, doubled each time
+	unsigned refCnt;
+	unsigned id;            // order of opening, identifies the adapter in traces
+	Mcp23017Bus_t *next_p;
+};
+
+// a pending read-modify-write of one port's output latch:
+// new = (old & andMask) ^ xorMask
+typedef struct Mcp23017PortReq_s {
+	uint8_t andMask;
+	uint8_t xorMask;
+	bool done;
+	bool ok;
+	Mcp23017Error_t err;    // the combiner's, if !ok
+	struct Mcp23017PortReq_s *next_p;
+} Mcp23017PortReq_t;
+
+// per-chip counters (see Mcp23017Stats_t), bumped without locking
+typedef struct {
+	atomic_uint_fast64_t reads;
+	atomic_uint_fast64_t writes;
+	atomic_uint_fast64_t bytes;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t retries;
+	atomic_uint_fast64_t latency[MCP23017_STATS_BUCKETS];
+} Mcp23017DevStats_t;
+
+struct Mcp23017_s {
+	Mcp23017Bus_t *bus_p;
+	uint8_t addr;
+	bool bank1;
+
+	// write-through shadow copy of the chip's non-volatile registers,
+	// indexed by register address; GPIO, INTF and INTCAP change
+	// underneath us so they are never cached
+	bool cacheEnable;
+	uint8_t regCache[0x20];
+	uint32_t regCacheValid;
+
+	// interrupt notification
+	int irqFd;
+	bool irqFdOwned;
+	bool irqFdGpio;         // GPIO character device line-event fd
+
+	// port updates waiting for a combiner (under bus_p->combLock)
+	Mcp23017PortReq_t *portReq_p[2];
+	Mcp23017PortReq_t *portReqTail_p[2];
+	bool portBusy[2];
+
+	Mcp23017DevStats_t stats;
+};
+
+/*
+ * register addresses
+ * BANK=0: A/B pairs are interleaved, 0x00-0x15
+ * BANK=1: port A at 0x00-0x0a, port B at 0x10-0x1a
+ */
+static inline uint8_t
+mcp23017_priv__reg_addr (const Mcp23017_t *dev_p, Mcp23017Reg_e reg, Mcp23017Port_e port)
+{
+	if (dev_p->bank1)
+		return (uint8_t)(((unsigned)port << 4) | (unsigned)reg);
+	return (uint8_t)(((unsigned)reg << 1) | (unsigned)port);
+}
+
+// bus
+Mcp23017Bus_t *mcp23017_priv__bus_get (const char *devFile_p);
+void mcp23017_priv__bus_put (Mcp23017Bus_t *bus_p);
+void mcp23017_priv__bus_lock (Mcp23017Bus_t *bus_p);
+void mcp23017_priv__bus_unlock (Mcp23017Bus_t *bus_p);
+bool mcp23017_priv__bus_xfer (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt);
+
+// one chip's transfers; these are the ones that are counted
+bool mcp23017_priv__dev_xfer (Mcp23017_t *dev_p, Mcp23017Xfer_t *xfer_p, unsigned cnt);
+bool mcp23017_priv__dev_read_byte (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p);
+bool mcp23017_priv__dev_write_byte (Mcp23017_t *dev_p, uint8_t reg, uint8_t val);
+
+// register access through the cache
+bool mcp23017_priv__is_reg_valid (Mcp23017_t *dev_p, uint8_t reg);
+uint8_t mcp23017_priv__keep_bank (Mcp23017_t *dev_p, uint8_t reg, uint8_t val);
+void mcp23017_priv__cache_store (Mcp23017_t *dev_p, uint8_t reg, uint8_t val);
+bool mcp23017_priv__cache_lookup (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p);
+bool mcp23017_priv__read_reg (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p);
+bool mcp23017_priv__write_reg (Mcp23017_t *dev_p, uint8_t reg, uint8_t val);
+void mcp23017_priv__cache_written (Mcp23017_t *dev_p, uint8_t reg, uint8_t val);
+unsigned mcp23017_priv__port16_xfer (Mcp23017_t *dev_p, Mcp23017Reg_e reg, bool read, uint8_t *buf_p, Mcp23017Xfer_t *xfer_p);
+bool mcp23017_priv__port_update (Mcp23017_t *dev_p, Mcp23017Port_e port, uint8_t andMask, uint8_t xorMask);
+
+// simulator
+void *mcp23017_priv__sim_new (uint32_t txnNs, uint32_t byteNs);
+void mcp23017_priv__sim_free (void *sim_p);
+bool mcp23017_priv__sim_spi_message (void *sim_p, struct spi_ioc_transfer *xfer_p, unsigned cnt);
+
+// interrupts
+void mcp23017_priv__irq_release (Mcp23017_t *dev_p);
+
+// errors and messages
+void mcp23017_priv__log (const char *fmt_p, ...) __attribute__((format(printf, 1, 2)));
+void mcp23017_priv__log_errno (const char *what_p);
+void mcp23017_priv__set_error (Mcp23017_t *dev_p, int err, int reg, int xfer);
+void mcp23017_priv__clear_error (void);
+void mcp23017_priv__set_xfer_error (Mcp23017_t *dev_p, const Mcp23017Xfer_t *xfer_p, unsigned cnt);
+
+// asynchronous engine
+bool mcp23017_priv__async_pin (Mcp23017_t *dev_p, int cpu);
+
+// transaction tracing
+extern atomic_bool mcp23017_priv__traceOn;
+uint64_t mcp23017_priv__trace_now (void);
+void mcp23017_priv__trace (const Mcp23017Bus_t *bus_p, const Mcp23017Xfer_t *xfer_p, unsigned cnt, uint64_t start, uint64_t end);
+
+// real-time mode
+extern atomic_bool mcp23017_priv__rtOn;
+void mcp23017_priv__rt_thread_init (const char *what_p);
+
+// statistics (only called when built with ENABLE_STATS)
+uint64_t mcp23017_priv__stats_now (void);
+void mcp23017_priv__stats_count (Mcp23017_t *dev_p, const Mcp23017Xfer_t *xfer_p, unsigned cnt);
+void mcp23017_priv__stats_latency (Mcp23017_t *dev_p, uint64_t ns);
+
+#endif
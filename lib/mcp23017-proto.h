@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * wire protocol of the mcp23017d daemon (samples/mcp23017d.c), which owns
+ * the buses and chips so that clients don't open them themselves
+ * a client sends requests over a Unix stream socket: a header followed by
+ * 'cnt' ops, which are run in order; every request gets one reply, in the
+ * order the requests were sent, carrying the request's 'seq' and one result
+ * per op, so any number of requests can be in flight at once
+ * both ends are on the same machine: everything is in host byte order
+ */
+
+#ifndef LIB_MCP23017_PROTO__H
+#define LIB_MCP23017_PROTO__H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mcp23017.h"
+
+#define MCP23017_PROTO_SOCKET "/run/mcp23017.sock"
+#define MCP23017_PROTO_MAGIC 0x4d43
+#define MCP23017_PROTO_VERSION 1
+#define MCP23017_PROTO_OPS_MAX 64
+
+typedef enum {
+	MCP23017_PROTO_READ_REG,        // reg, port -> val
+	MCP23017_PROTO_WRITE_REG,       // reg, port, val (low byte)
+	MCP23017_PROTO_READ_PORT16,     // -> val
+	MCP23017_PROTO_WRITE_PORT16,    // val
+	MCP23017_PROTO_MODIFY,          // val: bits to set, mask: bits to clear
+	MCP23017_PROTO_TOGGLE,          // mask
+	MCP23017_PROTO_WRITE_MASKED,    // mask, val
+} Mcp23017ProtoOp_e;
+
+// requests and replies both start with this
+typedef struct {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t cnt;            // ops (results) that follow
+	uint32_t seq;           // chosen by the client, echoed in the reply
+} Mcp23017ProtoHdr_t;
+
+typedef struct {
+	uint8_t chip;           // index, in the order the daemon was given them
+	uint8_t op;             // Mcp23017ProtoOp_e
+	uint8_t reg;            // Mcp23017Reg_e, the daemon knows the layout
+	uint8_t port;           // Mcp23017Port_e
+	uint16_t val;
+	uint16_t mask;
+} Mcp23017ProtoOp_t;
+
+typedef struct {
+	int16_t result;         // 0 or -errno
+	uint16_t val;           // value read, port A in the low byte
+} Mcp23017ProtoResult_t;
+
+int mcp23017__client_connect (const char *path_p);
+bool mcp23017__client_send (int fd, uint32_t seq, const Mcp23017ProtoOp_t *ops_p, unsigned cnt);
+int mcp23017__client_recv (int fd, uint32_t *seq_p, Mcp23017ProtoResult_t *res_p, unsigned max);
+
+#endif
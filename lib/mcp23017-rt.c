@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * real-time mode
+ * locks the process's memory and prefaults some stack and heap so the
+ * control loop doesn't take page faults later; tells glibc's allocator to
+ * keep what it has instead of trimming or mmap()ing per allocation; and
+ * runs the threads the library starts from then on (async workers,
+ * sampler, scheduler) as SCHED_FIFO, optionally pinned to one CPU; and
+ * can hold a 0us PM QoS request so wakeups don't wait for a CPU to come
+ * out of a deep idle state
+ * mcp23017__rt_disable() undoes the memory locking, the allocator settings
+ * and the PM QoS request
+ * while it is on, the default log callback stays quiet, so failures only
+ * show up in the return values and mcp23017__last_error() (an application
+ * callback still gets every message)
+ * mcp23017__rt_measure() runs a periodic transfer and reports how late it
+ * completes, to check a configuration under the application's load
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <alloca.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define RT_DEFAULT_STACK (64 * 1024)
+#define RT_DEFAULT_HEAP (1024 * 1024)
+#define RT_STACK_MAX (1024 * 1024)
+#define RT_DMA_LATENCY_DEV "/dev/cpu_dma_latency"
+
+// glibc's allocator defaults; it has no way to read the current settings
+#define RT_MALLOC_TRIM_THRESHOLD (128 * 1024)
+#define RT_MALLOC_MMAP_MAX 65536
+
+atomic_bool mcp23017_priv__rtOn = false;
+
+static pthread_mutex_t rtLock_G = PTHREAD_MUTEX_INITIALIZER;
+static Mcp23017RtConfig_t rtCfg_G = { 0, -1, 0, 0, false };
+static int dmaLatencyFd_G = -1;         // the request lasts while it's open
+static bool heapHeld_G = false;         // allocator settings changed by us
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// touch 'len' bytes of this thread's stack so they're mapped (and, with
+// mlockall(MCL_FUTURE), locked) before they're needed
+static void __attribute__((noinline))
+prefault_stack (size_t len)
+{
+	volatile uint8_t *p;
+	size_t i, page;
+
+	if (len > RT_STACK_MAX)
+		len = RT_STACK_MAX;
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	p = alloca(len);
+	for (i = 0; i < len; i += page)
+		p[i] = 0;
+}
+
+// keep freed memory in the heap rather than returning it, and serve
+// large allocations from the heap too
+static void
+heap_hold (void)
+{
+	pthread_mutex_lock(&rtLock_G);
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	heapHeld_G = true;
+	pthread_mutex_unlock(&rtLock_G);
+}
+
+// put back the settings the process started with: the values given in the
+// environment (MALLOC_TRIM_THRESHOLD_, MALLOC_MMAP_MAX_), otherwise glibc's
+// defaults; a value the application set with mallopt() itself can't be
+// read back, and glibc's mmap threshold no longer adjusts itself
+// called with rtLock_G held
+static void
+heap_release (void)
+{
+	const char *env_p;
+
+	if (!heapHeld_G)
+		return;
+	env_p = getenv("MALLOC_TRIM_THRESHOLD_");
+	mallopt(M_TRIM_THRESHOLD, (env_p != NULL)? atoi(env_p) : RT_MALLOC_TRIM_THRESHOLD);
+	env_p = getenv("MALLOC_MMAP_MAX_");
+	mallopt(M_MMAP_MAX, (env_p != NULL)? atoi(env_p) : RT_MALLOC_MMAP_MAX);
+	heapHeld_G = false;
+}
+
+static bool
+prefault_heap (size_t len)
+{
+	uint8_t *p;
+	size_t i, page;
+
+	heap_hold();
+	if (len == 0)
+		return true;
+
+	p = malloc(len);
+	if (p == NULL)
+		return false;
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	for (i = 0; i < len; i += page)
+		p[i] = 0;
+	free(p);
+	return true;
+}
+
+// move the calling thread to 'cfg_p's CPU and priority
+static int
+thread_apply (const Mcp23017RtConfig_t *cfg_p)
+{
+	struct sched_param sp;
+	cpu_set_t set;
+	int ret;
+
+	if (cfg_p->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET((unsigned)cfg_p->cpu, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret != 0)
+			return ret;
+	}
+	if (cfg_p->priority > 0) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = cfg_p->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (ret != 0)
+			return ret;
+	}
+	prefault_stack(cfg_p->stackBytes);
+	return 0;
+}
+
+// best effort: without it only wakeups from idle get slower
+static void
+idle_hold (void)
+{
+	int32_t us = 0;
+
+	if (dmaLatencyFd_G >= 0)
+		return;
+	dmaLatencyFd_G = open(RT_DMA_LATENCY_DEV, O_WRONLY | O_CLOEXEC);
+	if (dmaLatencyFd_G < 0) {
+		mcp23017_priv__log_errno("rt: " RT_DMA_LATENCY_DEV);
+		return;
+	}
+	if (write(dmaLatencyFd_G, &us, sizeof(us)) != (ssize_t)sizeof(us)) {
+		mcp23017_priv__log_errno("rt: " RT_DMA_LATENCY_DEV);
+		close(dmaLatencyFd_G);
+		dmaLatencyFd_G = -1;
+	}
+}
+
+static void
+idle_release (void)
+{
+	if (dmaLatencyFd_G >= 0)
+		close(dmaLatencyFd_G);
+	dmaLatencyFd_G = -1;
+}
+
+// fail now, rather than in every thread started later, if SCHED_FIFO at
+// this priority isn't allowed
+static int
+fifo_check (int priority)
+{
+	struct sched_param sp, old;
+	int policy, ret;
+
+	if (priority <= 0)
+		return 0;
+	if ((priority < sched_get_priority_min(SCHED_FIFO)) || (priority > sched_get_priority_max(SCHED_FIFO)))
+		return EINVAL;
+
+	ret = pthread_getschedparam(pthread_self(), &policy, &old);
+	if (ret != 0)
+		return ret;
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = priority;
+	ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	if (ret == 0)
+		pthread_setschedparam(pthread_self(), policy, &old);
+	return ret;
+}
+
+/**
+ * turn real-time mode on (see Mcp23017RtConfig_t, NULL for the defaults)
+ * call it once the chips are open and configured, before the control loop
+ * starts; the calling thread's own scheduling is left alone, see
+ * mcp23017__rt_thread_setup()
+ * needs CAP_IPC_LOCK (or a big enough RLIMIT_MEMLOCK) and, for a
+ * priority, CAP_SYS_NICE (or RLIMIT_RTPRIO)
+ */
+bool
+mcp23017__rt_enable (const Mcp23017RtConfig_t *cfg_p)
+{
+	Mcp23017RtConfig_t cfg;
+	int ret;
+
+	if (cfg_p != NULL)
+		cfg = *cfg_p;
+	else {
+		cfg.priority = MCP23017_RT_DEFAULT_PRIO;
+		cfg.cpu = -1;
+		cfg.stackBytes = RT_DEFAULT_STACK;
+		cfg.heapBytes = RT_DEFAULT_HEAP;
+		cfg.noDeepIdle = true;
+	}
+
+	// preconds
+	if ((cfg.cpu >= CPU_SETSIZE) || (cfg.priority < 0)) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		return false;
+	}
+
+	ret = fifo_check(cfg.priority);
+	if (ret != 0) {
+		errno = ret;
+		mcp23017_priv__log_errno("rt: SCHED_FIFO");
+		mcp23017_priv__set_error(NULL, ret, -1, -1);
+		return false;
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		ret = errno;
+		mcp23017_priv__log_errno("rt: mlockall()");
+		mcp23017_priv__set_error(NULL, ret, -1, -1);
+		return false;
+	}
+	if (!prefault_heap(cfg.heapBytes)) {
+		pthread_mutex_lock(&rtLock_G);
+		if (!atomic_load(&mcp23017_priv__rtOn))
+			heap_release();
+		pthread_mutex_unlock(&rtLock_G);
+		munlockall();
+		mcp23017_priv__set_error(NULL, ENOMEM, -1, -1);
+		return false;
+	}
+	prefault_stack(cfg.stackBytes);
+
+	pthread_mutex_lock(&rtLock_G);
+	if (cfg.noDeepIdle)
+		idle_hold();
+	else
+		idle_release();
+	rtCfg_G = cfg;
+	atomic_store(&mcp23017_priv__rtOn, true);
+	pthread_mutex_unlock(&rtLock_G);
+	return true;
+}
+
+/**
+ * leave real-time mode: memory is unlocked, the allocator may trim and
+ * mmap() again (see heap_release()), CPUs may idle deeply again and threads
+ * started from now on get the default scheduling; running threads keep
+ * theirs
+ */
+void
+mcp23017__rt_disable (void)
+{
+	pthread_mutex_lock(&rtLock_G);
+	atomic_store(&mcp23017_priv__rtOn, false);
+	idle_release();
+	heap_release();
+	pthread_mutex_unlock(&rtLock_G);
+	munlockall();
+}
+
+/**
+ * give the calling thread (e.g. the application's control loop) the
+ * real-time mode's CPU and priority, and prefault its stack
+ */
+bool
+mcp23017__rt_thread_setup (void)
+{
+	Mcp23017RtConfig_t cfg;
+	int ret;
+
+	pthread_mutex_lock(&rtLock_G);
+	cfg = rtCfg_G;
+	pthread_mutex_unlock(&rtLock_G);
+
+	// preconds
+	if (!atomic_load(&mcp23017_priv__rtOn)) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		return false;
+	}
+
+	ret = thread_apply(&cfg);
+	if (ret != 0) {
+		mcp23017_priv__set_error(NULL, ret, -1, -1);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * called first thing by every thread the library starts
+ */
+void
+mcp23017_priv__rt_thread_init (const char *what_p)
+{
+	Mcp23017RtConfig_t cfg;
+	int ret;
+
+	if (!atomic_load(&mcp23017_priv__rtOn))
+		return;
+
+	pthread_mutex_lock(&rtLock_G);
+	cfg = rtCfg_G;
+	pthread_mutex_unlock(&rtLock_G);
+	ret = thread_apply(&cfg);
+	if (ret != 0) {
+		errno = ret;
+		mcp23017_priv__log_errno(what_p);
+	}
+}
+
+/**
+ * run a periodic transfer (a 16-bit read of 'dev_p's output latches, from
+ * the chip rather than the cache) 'cycles' times, every 'periodUs', on the
+ * calling thread, and report in 'jit_p' how late each completed relative
+ * to when it was due
+ * unlike a GPIO read, reading OLAT doesn't clear a pending interrupt, so
+ * the transfer doesn't change the chip's state and can run alongside the
+ * application
+ */
+bool
+mcp23017__rt_measure (Mcp23017_t *dev_p, unsigned cycles, uint32_t periodUs, Mcp23017Jitter_t *jit_p)
+{
+	struct timespec ts;
+	uint64_t due, wake, end, lateNs, sumNs = 0, periodNs;
+	unsigned i, bucket;
+	Mcp23017Xfer_t xfer[2];
+	uint8_t buf[2];
+	unsigned cnt;
+	bool ok = true;
+
+	// preconds
+	if ((dev_p == NULL) || (jit_p == NULL) || (cycles == 0) || (periodUs == 0)) {
+		mcp23017_priv__set_error(dev_p, EINVAL, -1, -1);
+		return false;
+	}
+
+	memset(jit_p, 0, sizeof(*jit_p));
+	periodNs = (uint64_t)periodUs * 1000u;
+	due = now_ns() + periodNs;
+	for (i = 0; i < cycles; ++i) {
+		ts.tv_sec = (time_t)(due / 1000000000ull);
+		ts.tv_nsec = (long)(due % 1000000000ull);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		wake = now_ns();
+		cnt = mcp23017_priv__port16_xfer(dev_p, MCP23017_OLAT, true, buf, xfer);
+		if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt)) {
+			++jit_p->errors;
+			ok = false;
+		}
+		end = now_ns();
+
+		lateNs = end - due;
+		sumNs += lateNs;
+		if (wake - due > jit_p->wakeMaxNs)
+			jit_p->wakeMaxNs = wake - due;
+		if (end - wake > jit_p->xferMaxNs)
+			jit_p->xferMaxNs = end - wake;
+		if (lateNs > jit_p->maxNs)
+			jit_p->maxNs = lateNs;
+		bucket = (unsigned)(63 - __builtin_clzll(lateNs | 1));
+		if (bucket >= MCP23017_STATS_BUCKETS)
+			bucket = MCP23017_STATS_BUCKETS - 1;
+		++jit_p->latency[bucket];
+		++jit_p->cycles;
+
+		// skip the periods this one ran into
+		due += periodNs;
+		if (end > due) {
+			++jit_p->overruns;
+			due += ((end - due) / periodNs + 1) * periodNs;
+		}
+	}
+	jit_p->meanNs = sumNs / jit_p->cycles;
+	return ok;
+}
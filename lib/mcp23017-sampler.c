@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * continuous input sampling ("logic analyzer" mode)
+ * a thread reads GPIOA, GPIOB or both as long runs in byte mode
+ * (IOCON.SEQOP=1, see mcp23017-burst.c for how the register pointer behaves)
+ * so every byte of a run is a fresh sample; each run is bracketed by the
+ * IOCON switch and restore in the same bus transfer, so other users of the
+ * adapter can get in between runs and always find the chip as they left it
+ * sample times are interpolated between the CLOCK_MONOTONIC readings taken
+ * either side of the transfer
+ * samples go into a single-producer/single-consumer ring which the
+ * consumer reads in place (peek/release)
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define IOCON_BANK 0x80
+#define IOCON_SEQOP 0x20
+
+#define SAMPLER_DEFAULT_RING 65536
+#define SAMPLER_DEFAULT_RUN 256
+#define SAMPLER_RUN_MAX 2000
+// pause after a failed run, so a missing chip doesn't keep the adapter busy
+#define SAMPLER_ERROR_WAIT_NS 1000000
+
+struct Mcp23017Sampler_s {
+	Mcp23017_t *dev_p;
+	Mcp23017SamplePorts_e ports;
+	unsigned runLen;                // samples per bus read
+	uint8_t *raw_p;
+
+	Mcp23017Sample_t *ring_p;
+	size_t mask;
+	_Alignas(64) atomic_size_t head;        // written by the sampler
+	_Alignas(64) atomic_size_t tail;        // written by the consumer
+
+	atomic_uint_fast64_t samples;
+	atomic_uint_fast64_t overruns;
+	atomic_uint_fast64_t reads;
+	atomic_uint_fast64_t errors;
+	uint64_t startNs;
+	atomic_uint_fast64_t lastNs;
+
+	atomic_bool stop;
+	pthread_t thread;
+};
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * one bracketed run; returns the number of samples read into raw_p, 0 if
+ * it failed
+ */
+static unsigned
+sample_run (Mcp23017Sampler_t *smp_p, uint64_t *t0_p, uint64_t *t1_p)
+{
+	Mcp23017_t *dev_p = smp_p->dev_p;
+	Mcp23017Xfer_t xfer[3];
+	uint8_t iocon, ioconRun;
+	bool bank1Run = (smp_p->ports != MCP23017_SAMPLE_PORTAB);
+	unsigned bytes;
+	bool ok;
+
+	bytes = smp_p->runLen * (bank1Run? 1u : 2u);
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon)) {
+		mcp23017_priv__bus_unlock(dev_p->bus_p);
+		atomic_fetch_add_explicit(&smp_p->reads, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&smp_p->errors, 1, memory_order_relaxed);
+		return 0;
+	}
+	ioconRun = (uint8_t)((iocon & ~IOCON_BANK) | IOCON_SEQOP | (bank1Run? IOCON_BANK : 0));
+
+	xfer[0].addr = dev_p->addr;
+	xfer[0].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA);
+	xfer[0].read = false;
+	xfer[0].fixedReg = false;
+	xfer[0].noRetry = false;
+	xfer[0].len = 1;
+	xfer[0].buf_p = &ioconRun;
+
+	xfer[1].addr = dev_p->addr;
+	if (bank1Run)
+		xfer[1].reg = (uint8_t)(((smp_p->ports == MCP23017_SAMPLE_PORTB)? 0x10 : 0x00) | MCP23017_GPIO);
+	else
+		xfer[1].reg = (uint8_t)(MCP23017_GPIO << 1);
+	xfer[1].read = true;
+	xfer[1].fixedReg = true;
+	xfer[1].noRetry = true;         // a redone run would be timed wrongly
+	xfer[1].len = (uint16_t)bytes;
+	xfer[1].buf_p = smp_p->raw_p;
+
+	xfer[2].addr = dev_p->addr;
+	xfer[2].reg = bank1Run? 0x05 : 0x0a;
+	xfer[2].read = false;
+	xfer[2].fixedReg = false;
+	xfer[2].noRetry = false;
+	xfer[2].len = 1;
+	xfer[2].buf_p = &iocon;
+
+	*t0_p = now_ns();
+	ok = mcp23017_priv__dev_xfer(dev_p, xfer, 3);
+	*t1_p = now_ns();
+
+	// the chip must not be left in the sampling layout
+	if ((xfer[0].result == 0) && (xfer[2].result != 0)) {
+		if (!mcp23017_priv__dev_write_byte(dev_p, xfer[2].reg, iocon))
+			mcp23017_priv__log("sampler: can't restore IOCON");
+	}
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+
+	atomic_fetch_add_explicit(&smp_p->reads, 1, memory_order_relaxed);
+	if (!ok || (xfer[1].result != 0)) {
+		atomic_fetch_add_explicit(&smp_p->errors, 1, memory_order_relaxed);
+		return 0;
+	}
+	return smp_p->runLen;
+}
+
+static void
+publish (Mcp23017Sampler_t *smp_p, unsigned cnt, uint64_t t0, uint64_t t1)
+{
+	size_t head, tail, room, i;
+	Mcp23017Sample_t *s_p;
+	uint16_t val;
+
+	head = atomic_load_explicit(&smp_p->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&smp_p->tail, memory_order_acquire);
+	room = (smp_p->mask + 1) - (head - tail);
+	if (cnt > room) {
+		atomic_fetch_add_explicit(&smp_p->overruns, cnt - room, memory_order_relaxed);
+		cnt = (unsigned)room;
+	}
+
+	for (i = 0; i < cnt; ++i) {
+		switch (smp_p->ports) {
+			case MCP23017_SAMPLE_PORTA:
+				val = smp_p->raw_p[i];
+				break;
+			case MCP23017_SAMPLE_PORTB:
+				val = (uint16_t)(smp_p->raw_p[i] << 8);
+				break;
+			default:
+				val = (uint16_t)(smp_p->raw_p[2 * i] | (smp_p->raw_p[2 * i + 1] << 8));
+				break;
+		}
+		s_p = &smp_p->ring_p[(head + i) & smp_p->mask];
+		s_p->ts = t0 + ((t1 - t0) * (2 * i + 1)) / (2 * smp_p->runLen);
+		s_p->val = val;
+	}
+
+	atomic_store_explicit(&smp_p->head, head + cnt, memory_order_release);
+	atomic_fetch_add_explicit(&smp_p->samples, cnt, memory_order_relaxed);
+	atomic_store_explicit(&smp_p->lastNs, t1, memory_order_relaxed);
+}
+
+static void *
+sampler (void *arg_p)
+{
+	Mcp23017Sampler_t *smp_p = arg_p;
+	struct timespec wait = { 0, SAMPLER_ERROR_WAIT_NS };
+	uint64_t t0, t1;
+	unsigned cnt;
+
+	mcp23017_priv__rt_thread_init("sampler");
+	while (!atomic_load_explicit(&smp_p->stop, memory_order_relaxed)) {
+		cnt = sample_run(smp_p, &t0, &t1);
+		if (cnt > 0)
+			publish(smp_p, cnt, t0, t1);
+		else
+			clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * start sampling 'ports' of 'dev_p' as fast as the bus allows
+ * 'ringSize': samples buffered for the consumer (rounded up to a power of
+ * two, 0 for the default); 'runLen': samples per bus read (0 for the
+ * default), longer runs mean less overhead but coarser interleaving with
+ * other users of the adapter
+ * the sampled pins should be inputs
+ */
+Mcp23017Sampler_t *
+mcp23017__sampler_start (Mcp23017_t *dev_p, Mcp23017SamplePorts_e ports, unsigned ringSize, unsigned runLen)
+{
+	Mcp23017Sampler_t *smp_p;
+	size_t size;
+
+	// preconds
+	if (dev_p == NULL)
+		return NULL;
+	if (ports > MCP23017_SAMPLE_PORTAB)
+		return NULL;
+	if (runLen > SAMPLER_RUN_MAX)
+		return NULL;
+
+	if (ringSize == 0)
+		ringSize = SAMPLER_DEFAULT_RING;
+	if (runLen == 0)
+		runLen = SAMPLER_DEFAULT_RUN;
+	for (size = 2; size < ringSize; size <<= 1)
+		;
+
+	smp_p = calloc(1, sizeof(*smp_p));
+	if (smp_p == NULL) {
+		mcp23017_priv__log_errno("calloc(sampler)");
+		return NULL;
+	}
+	smp_p->dev_p = dev_p;
+	smp_p->ports = ports;
+	smp_p->runLen = runLen;
+	smp_p->mask = size - 1;
+	smp_p->raw_p = malloc(2u * runLen);
+	smp_p->ring_p = malloc(size * sizeof(*smp_p->ring_p));
+	if ((smp_p->raw_p == NULL) || (smp_p->ring_p == NULL)) {
+		mcp23017_priv__log_errno("malloc(sampler)");
+		goto err1;
+	}
+	atomic_init(&smp_p->head, 0);
+	atomic_init(&smp_p->tail, 0);
+	atomic_init(&smp_p->samples, 0);
+	atomic_init(&smp_p->overruns, 0);
+	atomic_init(&smp_p->reads, 0);
+	atomic_init(&smp_p->errors, 0);
+	atomic_init(&smp_p->stop, false);
+	smp_p->startNs = now_ns();
+	atomic_init(&smp_p->lastNs, smp_p->startNs);
+
+	if (pthread_create(&smp_p->thread, NULL, sampler, smp_p) != 0) {
+		mcp23017_priv__log("can't create sampler thread");
+		goto err1;
+	}
+	return smp_p;
+
+err1:
+	free(smp_p->raw_p);
+	free(smp_p->ring_p);
+	free(smp_p);
+	return NULL;
+}
+
+void
+mcp23017__sampler_stop (Mcp23017Sampler_t *smp_p)
+{
+	// preconds
+	if (smp_p == NULL)
+		return;
+
+	atomic_store(&smp_p->stop, true);
+	pthread_join(smp_p->thread, NULL);
+	free(smp_p->raw_p);
+	free(smp_p->ring_p);
+	free(smp_p);
+}
+
+/**
+ * point '*samples_pp' at the oldest unconsumed samples, in the ring itself;
+ * returns how many can be read from there (contiguous, at most 'max'),
+ * 0 if none are waiting
+ * the samples stay valid until they are released
+ * only one thread may consume
+ */
+unsigned
+mcp23017__sampler_peek (Mcp23017Sampler_t *smp_p, const Mcp23017Sample_t **samples_pp, unsigned max)
+{
+	size_t head, tail, avail, contig;
+
+	// preconds
+	if ((smp_p == NULL) || (samples_pp == NULL))
+		return 0;
+
+	head = atomic_load_explicit(&smp_p->head, memory_order_acquire);
+	tail = atomic_load_explicit(&smp_p->tail, memory_order_relaxed);
+	avail = head - tail;
+	contig = (smp_p->mask + 1) - (tail & smp_p->mask);
+	if (avail > contig)
+		avail = contig;
+	if (avail > max)
+		avail = max;
+
+	*samples_pp = &smp_p->ring_p[tail & smp_p->mask];
+	return (unsigned)avail;
+}
+
+/**
+ * hand 'cnt' peeked samples back to the sampler
+ */
+void
+mcp23017__sampler_release (Mcp23017Sampler_t *smp_p, unsigned cnt)
+{
+	size_t tail;
+
+	// preconds
+	if (smp_p == NULL)
+		return;
+
+	tail = atomic_load_explicit(&smp_p->tail, memory_order_relaxed);
+	atomic_store_explicit(&smp_p->tail, tail + cnt, memory_order_release);
+}
+
+bool
+mcp23017__sampler_get_stats (Mcp23017Sampler_t *smp_p, Mcp23017SamplerStats_t *stats_p)
+{
+	uint64_t elapsed;
+
+	// preconds
+	if ((smp_p == NULL) || (stats_p == NULL))
+		return false;
+
+	stats_p->samples = atomic_load_explicit(&smp_p->samples, memory_order_relaxed);
+	stats_p->overruns = atomic_load_explicit(&smp_p->overruns, memory_order_relaxed);
+	stats_p->reads = atomic_load_explicit(&smp_p->reads, memory_order_relaxed);
+	stats_p->errors = atomic_load_explicit(&smp_p->errors, memory_order_relaxed);
+	elapsed = atomic_load_explicit(&smp_p->lastNs, memory_order_relaxed) - smp_p->startNs;
+	stats_p->rateHz = (elapsed > 0)?
+		(double)(stats_p->samples + stats_p->overruns) * 1e9 / (double)elapsed : 0.0;
+	return true;
+}
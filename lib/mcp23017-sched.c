@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * polling scheduler
+ * one thread serves any number of (chip, port, period, priority) entries:
+ * it sleeps until the earliest entry is due, then takes every entry that is
+ * due (or will be within SCHED_COALESCE_NS) and reads them with one batch
+ * per adapter, so a cycle costs one bus transfer per adapter however many
+ * chips are due; entries that aren't due cost nothing
+ * a cycle reads at most SCHED_BATCH_MAX registers per adapter, taken in
+ * priority order (then earliest first), and stops adding reads once the
+ * adapter's measured cost per register says the transfer would end after
+ * the earliest deadline already in it; whatever doesn't fit stays due and
+ * goes in the next cycle, so under load the low priorities slip first
+ * an entry's deadline is the start of its next period; a read completing
+ * after that is a miss, and periods that were missed entirely are skipped
+ * rather than caught up
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define SCHED_COALESCE_NS 200000ull
+#define SCHED_BATCH_MAX 32
+
+typedef struct {
+	bool used;
+	Mcp23017_t *dev_p;
+	Mcp23017SamplePorts_e ports;
+	uint64_t periodNs;
+	unsigned priority;
+	Mcp23017SchedCb_t cb;
+	void *cbArg_p;
+
+	uint64_t due;
+	unsigned bus;           // index into the scheduler's adapters
+	uint8_t val[2];
+	int op[2];              // batch op indices, -1 if not queued
+
+	uint64_t polls;
+	uint64_t misses;
+	uint64_t errors;
+	uint64_t maxLateNs;
+} SchedEntry_t;
+
+typedef struct {
+	Mcp23017Bus_t *bus_p;
+	Mcp23017Batch_t *batch_p;
+	unsigned ops;
+	uint64_t deadline;      // earliest deadline in this cycle's batch
+	uint64_t opNs;          // recent cost of one register read, 0 if unknown
+	uint64_t busyNs;
+} SchedBus_t;
+
+struct Mcp23017Sched_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	SchedEntry_t *ent_p;
+	unsigned entCnt;
+	SchedBus_t *bus_p;
+	unsigned busCnt;
+	unsigned *due_p;        // the current cycle's entries
+	bool busy;              // a cycle's bus traffic is in progress
+	bool stop;
+	uint64_t startNs;
+	pthread_t thread;
+};
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static struct timespec
+ns_to_ts (uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(ns / 1000000000ull);
+	ts.tv_nsec = (long)(ns % 1000000000ull);
+	return ts;
+}
+
+static bool
+reads_port (const SchedEntry_t *ent_p, Mcp23017Port_e port)
+{
+	if (ent_p->ports == MCP23017_SAMPLE_PORTA)
+		return port == PORTA;
+	if (ent_p->ports == MCP23017_SAMPLE_PORTB)
+		return port == PORTB;
+	return true;
+}
+
+// the scheduler's slot for 'bus_p', created if needed; called locked
+static int
+sched_bus (Mcp23017Sched_t *sched_p, Mcp23017Bus_t *bus_p)
+{
+	SchedBus_t *new_p;
+	unsigned i;
+
+	for (i = 0; i < sched_p->busCnt; ++i)
+		if (sched_p->bus_p[i].bus_p == bus_p)
+			return (int)i;
+
+	new_p = realloc(sched_p->bus_p, (sched_p->busCnt + 1) * sizeof(*new_p));
+	if (new_p == NULL)
+		return -1;
+	sched_p->bus_p = new_p;
+	new_p = &sched_p->bus_p[sched_p->busCnt];
+	new_p->bus_p = bus_p;
+	new_p->ops = 0;
+	new_p->opNs = 0;
+	new_p->busyNs = 0;
+	new_p->batch_p = mcp23017__batch_new();
+	if (new_p->batch_p == NULL)
+		return -1;
+	return (int)sched_p->busCnt++;
+}
+
+// higher priority first, then the earliest due
+static int
+due_cmp (const SchedEntry_t *a_p, const SchedEntry_t *b_p)
+{
+	if (a_p->priority != b_p->priority)
+		return (a_p->priority > b_p->priority)? -1 : 1;
+	if (a_p->due != b_p->due)
+		return (a_p->due < b_p->due)? -1 : 1;
+	return 0;
+}
+
+/*
+ * pick this cycle's entries and queue their reads; called locked
+ * returns the number of entries picked
+ */
+static unsigned
+plan (Mcp23017Sched_t *sched_p, uint64_t now)
+{
+	SchedEntry_t *ent_p;
+	SchedBus_t *bus_p;
+	unsigned i, j, cnt = 0, need, idx;
+	Mcp23017Port_e port;
+
+	for (i = 0; i < sched_p->entCnt; ++i) {
+		ent_p = &sched_p->ent_p[i];
+		if (!ent_p->used || (ent_p->due > now + SCHED_COALESCE_NS))
+			continue;
+
+		// insertion sort, the due list is short
+		for (j = cnt; (j > 0) && (due_cmp(ent_p, &sched_p->ent_p[sched_p->due_p[j - 1]]) < 0); --j)
+			sched_p->due_p[j] = sched_p->due_p[j - 1];
+		sched_p->due_p[j] = i;
+		++cnt;
+	}
+
+	for (i = 0; i < sched_p->busCnt; ++i) {
+		mcp23017__batch_reset(sched_p->bus_p[i].batch_p);
+		sched_p->bus_p[i].ops = 0;
+	}
+
+	for (i = j = 0; i < cnt; ++i) {
+		idx = sched_p->due_p[i];
+		ent_p = &sched_p->ent_p[idx];
+		bus_p = &sched_p->bus_p[ent_p->bus];
+		need = (ent_p->ports == MCP23017_SAMPLE_PORTAB)? 2 : 1;
+		if (bus_p->ops + need > SCHED_BATCH_MAX)
+			continue;
+		if ((bus_p->ops > 0) && (now + (bus_p->ops + need) * bus_p->opNs > bus_p->deadline))
+			continue;
+		if ((bus_p->ops == 0) || (ent_p->due + ent_p->periodNs < bus_p->deadline))
+			bus_p->deadline = ent_p->due + ent_p->periodNs;
+
+		for (port = PORTA; port <= PORTB; ++port) {
+			ent_p->op[port] = -1;
+			if (!reads_port(ent_p, port))
+				continue;
+			ent_p->val[port] = 0;
+			ent_p->op[port] = mcp23017__batch_add_read(bus_p->batch_p, ent_p->dev_p,
+					mcp23017_priv__reg_addr(ent_p->dev_p, MCP23017_GPIO, port), &ent_p->val[port]);
+		}
+		bus_p->ops += need;
+		sched_p->due_p[j++] = idx;
+	}
+	return j;
+}
+
+// account for, and report, one entry's read; called locked
+static void
+finish (Mcp23017Sched_t *sched_p, SchedEntry_t *ent_p, uint64_t done)
+{
+	Mcp23017Batch_t *batch_p = sched_p->bus_p[ent_p->bus].batch_p;
+	Mcp23017Port_e port;
+	uint64_t late;
+	bool ok = true;
+
+	// a read that couldn't be queued failed too
+	for (port = PORTA; port <= PORTB; ++port)
+		if (reads_port(ent_p, port) && ((ent_p->op[port] < 0) ||
+					(mcp23017__batch_result(batch_p, (unsigned)ent_p->op[port]) != 0)))
+			ok = false;
+
+	++ent_p->polls;
+	if (!ok)
+		++ent_p->errors;
+	late = (done > ent_p->due)? done - ent_p->due : 0;
+	if (late > ent_p->maxLateNs)
+		ent_p->maxLateNs = late;
+	if (late > ent_p->periodNs)
+		++ent_p->misses;
+
+	// next period that hasn't started yet
+	ent_p->due += ent_p->periodNs;
+	if (ent_p->due <= done)
+		ent_p->due += ((done - ent_p->due) / ent_p->periodNs + 1) * ent_p->periodNs;
+
+	if (ent_p->cb != NULL)
+		ent_p->cb(ent_p->dev_p, ok, (uint16_t)(ent_p->val[PORTA] | (ent_p->val[PORTB] << 8)), ent_p->cbArg_p);
+}
+
+static void *
+scheduler (void *arg_p)
+{
+	Mcp23017Sched_t *sched_p = arg_p;
+	SchedEntry_t *ent_p;
+	SchedBus_t *bus_p;
+	uint64_t now, next, t0, t1, opNs;
+	struct timespec ts;
+	unsigned i, cnt;
+
+	mcp23017_priv__rt_thread_init("scheduler");
+	pthread_mutex_lock(&sched_p->lock);
+	while (!sched_p->stop) {
+		// sleep until something is due
+		next = UINT64_MAX;
+		for (i = 0; i < sched_p->entCnt; ++i)
+			if (sched_p->ent_p[i].used && (sched_p->ent_p[i].due < next))
+				next = sched_p->ent_p[i].due;
+		now = now_ns();
+		if (next > now + SCHED_COALESCE_NS) {
+			if (next == UINT64_MAX)
+				pthread_cond_wait(&sched_p->cv, &sched_p->lock);
+			else {
+				ts = ns_to_ts(next);
+				pthread_cond_timedwait(&sched_p->cv, &sched_p->lock, &ts);
+			}
+			continue;
+		}
+
+		cnt = plan(sched_p, now);
+		if (cnt == 0)
+			continue;
+
+		// the bus traffic runs unlocked; add/remove wait for it
+		sched_p->busy = true;
+		pthread_mutex_unlock(&sched_p->lock);
+		for (i = 0; i < sched_p->busCnt; ++i) {
+			if (sched_p->bus_p[i].ops == 0)
+				continue;
+			t0 = now_ns();
+			mcp23017__batch_submit(sched_p->bus_p[i].batch_p);
+			t1 = now_ns();
+			bus_p = &sched_p->bus_p[i];
+			bus_p->busyNs += t1 - t0;
+			opNs = (t1 - t0) / bus_p->ops;
+			bus_p->opNs = (bus_p->opNs == 0)? opNs : (bus_p->opNs * 7 + opNs) / 8;
+		}
+		t1 = now_ns();
+		pthread_mutex_lock(&sched_p->lock);
+		sched_p->busy = false;
+		pthread_cond_broadcast(&sched_p->cv);
+
+		for (i = 0; i < cnt; ++i) {
+			ent_p = &sched_p->ent_p[sched_p->due_p[i]];
+			finish(sched_p, ent_p, t1);
+		}
+	}
+	pthread_mutex_unlock(&sched_p->lock);
+	return NULL;
+}
+
+// wait for the current cycle's bus traffic, if any; called locked
+static void
+sched_idle (Mcp23017Sched_t *sched_p)
+{
+	while (sched_p->busy)
+		pthread_cond_wait(&sched_p->cv, &sched_p->lock);
+}
+
+/**
+ * start an (empty) polling scheduler
+ */
+Mcp23017Sched_t *
+mcp23017__sched_start (void)
+{
+	Mcp23017Sched_t *sched_p;
+	pthread_condattr_t attr;
+
+	sched_p = calloc(1, sizeof(*sched_p));
+	if (sched_p == NULL) {
+		mcp23017_priv__log_errno("calloc(sched)");
+		return NULL;
+	}
+	pthread_mutex_init(&sched_p->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched_p->cv, &attr);
+	pthread_condattr_destroy(&attr);
+	sched_p->startNs = now_ns();
+
+	if (pthread_create(&sched_p->thread, NULL, scheduler, sched_p) != 0) {
+		mcp23017_priv__log("can't create scheduler thread");
+		pthread_cond_destroy(&sched_p->cv);
+		pthread_mutex_destroy(&sched_p->lock);
+		free(sched_p);
+		return NULL;
+	}
+	return sched_p;
+}
+
+void
+mcp23017__sched_stop (Mcp23017Sched_t *sched_p)
+{
+	unsigned i;
+
+	// preconds
+	if (sched_p == NULL)
+		return;
+
+	pthread_mutex_lock(&sched_p->lock);
+	sched_p->stop = true;
+	pthread_cond_broadcast(&sched_p->cv);
+	pthread_mutex_unlock(&sched_p->lock);
+	pthread_join(sched_p->thread, NULL);
+
+	for (i = 0; i < sched_p->busCnt; ++i)
+		mcp23017__batch_free(sched_p->bus_p[i].batch_p);
+	free(sched_p->bus_p);
+	free(sched_p->ent_p);
+	free(sched_p->due_p);
+	pthread_cond_destroy(&sched_p->cv);
+	pthread_mutex_destroy(&sched_p->lock);
+	free(sched_p);
+}
+
+/**
+ * poll 'ports' of 'dev_p' every 'periodUs' microseconds (the first read is
+ * due straight away) and pass each reading to 'cb' (port A in the low
+ * byte); a larger 'priority' wins when the adapter can't keep up
+ * 'cb' runs on the scheduler's thread and must not call the scheduler
+ * returns the entry's id, or -1
+ */
+int
+mcp23017__sched_add (Mcp23017Sched_t *sched_p, Mcp23017_t *dev_p, Mcp23017SamplePorts_e ports,
+		uint32_t periodUs, unsigned priority, Mcp23017SchedCb_t cb, void *cbArg_p)
+{
+	SchedEntry_t *ent_p;
+	unsigned *due_p;
+	unsigned i;
+	int bus, id = -1;
+
+	// preconds
+	if ((sched_p == NULL) || (dev_p == NULL))
+		return -1;
+	if (ports > MCP23017_SAMPLE_PORTAB)
+		return -1;
+	if (periodUs == 0)
+		return -1;
+
+	pthread_mutex_lock(&sched_p->lock);
+	sched_idle(sched_p);
+
+	for (i = 0; i < sched_p->entCnt; ++i)
+		if (!sched_p->ent_p[i].used)
+			break;
+	if (i == sched_p->entCnt) {
+		ent_p = realloc(sched_p->ent_p, (i + 1) * sizeof(*ent_p));
+		if (ent_p == NULL)
+			goto err;
+		sched_p->ent_p = ent_p;
+		due_p = realloc(sched_p->due_p, (i + 1) * sizeof(*due_p));
+		if (due_p == NULL)
+			goto err;
+		sched_p->due_p = due_p;
+		sched_p->ent_p[i].used = false;
+		++sched_p->entCnt;
+	}
+
+	bus = sched_bus(sched_p, dev_p->bus_p);
+	if (bus < 0)
+		goto err;
+
+	ent_p = &sched_p->ent_p[i];
+	memset(ent_p, 0, sizeof(*ent_p));
+	ent_p->dev_p = dev_p;
+	ent_p->ports = ports;
+	ent_p->periodNs = (uint64_t)periodUs * 1000ull;
+	ent_p->priority = priority;
+	ent_p->cb = cb;
+	ent_p->cbArg_p = cbArg_p;
+	ent_p->bus = (unsigned)bus;
+	ent_p->due = now_ns();
+	ent_p->used = true;
+	id = (int)i;
+	pthread_cond_broadcast(&sched_p->cv);
+	goto done;
+
+err:
+	mcp23017_priv__log_errno("sched_add()");
+done:
+	pthread_mutex_unlock(&sched_p->lock);
+	return id;
+}
+
+/**
+ * stop polling entry 'id'; once this returns its callback won't be called
+ * again
+ */
+bool
+mcp23017__sched_remove (Mcp23017Sched_t *sched_p, int id)
+{
+	bool ok = false;
+
+	// preconds
+	if ((sched_p == NULL) || (id < 0))
+		return false;
+
+	pthread_mutex_lock(&sched_p->lock);
+	sched_idle(sched_p);
+	if (((unsigned)id < sched_p->entCnt) && sched_p->ent_p[id].used) {
+		sched_p->ent_p[id].used = false;
+		ok = true;
+	}
+	pthread_mutex_unlock(&sched_p->lock);
+	return ok;
+}
+
+/**
+ * counters of entry 'id', or of the whole scheduler if 'id' is -1
+ * 'utilisation' is the fraction of the time since the start (or the last
+ * reset) the entry's adapter spent on scheduled reads; for the whole
+ * scheduler, that of the busiest adapter
+ */
+bool
+mcp23017__sched_get_stats (Mcp23017Sched_t *sched_p, int id, Mcp23017SchedStats_t *stats_p)
+{
+	SchedEntry_t *ent_p;
+	uint64_t elapsed, busy = 0;
+	unsigned i;
+	bool ok = true;
+
+	// preconds
+	if ((sched_p == NULL) || (stats_p == NULL))
+		return false;
+
+	memset(stats_p, 0, sizeof(*stats_p));
+	pthread_mutex_lock(&sched_p->lock);
+	sched_idle(sched_p);
+	if (id >= 0) {
+		if (((unsigned)id >= sched_p->entCnt) || !sched_p->ent_p[id].used) {
+			ok = false;
+			goto done;
+		}
+		ent_p = &sched_p->ent_p[id];
+		stats_p->polls = ent_p->polls;
+		stats_p->misses = ent_p->misses;
+		stats_p->errors = ent_p->errors;
+		stats_p->maxLateNs = ent_p->maxLateNs;
+		busy = sched_p->bus_p[ent_p->bus].busyNs;
+	}
+	else {
+		for (i = 0; i < sched_p->entCnt; ++i) {
+			ent_p = &sched_p->ent_p[i];
+			if (!ent_p->used)
+				continue;
+			stats_p->polls += ent_p->polls;
+			stats_p->misses += ent_p->misses;
+			stats_p->errors += ent_p->errors;
+			if (ent_p->maxLateNs > stats_p->maxLateNs)
+				stats_p->maxLateNs = ent_p->maxLateNs;
+		}
+		for (i = 0; i < sched_p->busCnt; ++i)
+			if (sched_p->bus_p[i].busyNs > busy)
+				busy = sched_p->bus_p[i].busyNs;
+	}
+
+	elapsed = now_ns() - sched_p->startNs;
+	stats_p->utilisation = (elapsed > 0)? (double)busy / (double)elapsed : 0.0;
+done:
+	pthread_mutex_unlock(&sched_p->lock);
+	return ok;
+}
+
+bool
+mcp23017__sched_reset_stats (Mcp23017Sched_t *sched_p)
+{
+	SchedEntry_t *ent_p;
+	unsigned i;
+
+	// preconds
+	if (sched_p == NULL)
+		return false;
+
+	pthread_mutex_lock(&sched_p->lock);
+	sched_idle(sched_p);
+	for (i = 0; i < sched_p->entCnt; ++i) {
+		ent_p = &sched_p->ent_p[i];
+		ent_p->polls = 0;
+		ent_p->misses = 0;
+		ent_p->errors = 0;
+		ent_p->maxLateNs = 0;
+	}
+	for (i = 0; i < sched_p->busCnt; ++i)
+		sched_p->bus_p[i].busyNs = 0;
+	sched_p->startNs = now_ns();
+	pthread_mutex_unlock(&sched_p->lock);
+	return true;
+}
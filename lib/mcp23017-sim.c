@@ -0,0 +1,640 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * in-process register-level simulator, selected with a "sim://<name>" device
+ * path; every distinct name is a separate bus with a chip at each of the
+ * eight MCP23017 addresses (0x20-0x27)
+ *
+ * modelled (see doc/mcp23017-mcp23S17-datasheet.pdf):
+ *  - all 22 registers, in either IOCON.BANK layout (switching BANK takes
+ *    effect on the very next byte, as on the real part)
+ *  - the address pointer: sequential mode increments (wrapping to 0x00),
+ *    byte mode (IOCON.SEQOP=1) toggles within the A/B pair with BANK=0 and
+ *    stays put with BANK=1
+ *  - pin levels: outputs drive OLAT, inputs see an externally driven level,
+ *    the pull-up, or (with loopback) the matching pin of the other port;
+ *    IPOL inverts inputs
+ *  - interrupt-on-change/compare: INTF, INTCAP, clearing on a GPIO or
+ *    INTCAP read, IOCON.MIRROR, and an eventfd standing in for the INT pin
+ *
+ * bus time is accounted with a simple per-transaction plus per-byte model so
+ * that the cost of the library's access patterns can be measured
+ * deterministically; optionally the simulator also sleeps for that long
+ *
+ * the same chips can also be reached over the spidev transport's framing
+ * ("spi+sim://<name>"), where IOCON.HAEN hardware addressing is modelled
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <linux/spi/spidev.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define SIM_BASE_ADDR 0x20
+#define SIM_CHIP_CNT 8
+
+#define IOCON_BANK 0x80
+#define IOCON_MIRROR 0x40
+#define IOCON_SEQOP 0x20
+#define IOCON_HAEN 0x08
+
+// 400kHz: 9 clocks per byte (8 data + ACK)
+#define SIM_DEFAULT_TXN_NS 10000
+#define SIM_DEFAULT_BYTE_NS 22500
+
+typedef struct {
+	uint8_t regs[MCP23017_REG_CNT][2];      // GPIO is computed, not stored
+	uint16_t driveMask;                     // pins driven from outside
+	uint16_t driveLevels;
+	uint16_t prevLevels;                    // for interrupt-on-change
+	bool loopback;
+	bool intAsserted;
+	int intFd;
+} SimChip_t;
+
+typedef struct {
+	SimChip_t chips[SIM_CHIP_CNT];
+	uint32_t txnNs;
+	uint32_t byteNs;
+	bool sleep;
+	unsigned faults;        // transfers still to fail
+	int faultErr;
+	Mcp23017SimStats_t stats;
+} Sim_t;
+
+static void
+chip_por (SimChip_t *chip_p)
+{
+	int intFd = chip_p->intFd;
+
+	memset(chip_p, 0, sizeof(*chip_p));
+	chip_p->regs[MCP23017_IODIR][PORTA] = 0xff;
+	chip_p->regs[MCP23017_IODIR][PORTB] = 0xff;
+	chip_p->intFd = intFd;
+}
+
+/**
+ * a set of simulated chips, with the bus-time model given
+ */
+void *
+mcp23017_priv__sim_new (uint32_t txnNs, uint32_t byteNs)
+{
+	Sim_t *sim_p;
+	unsigned i;
+
+	sim_p = calloc(1, sizeof(*sim_p));
+	if (sim_p == NULL) {
+		mcp23017_priv__log_errno("calloc(sim)");
+		return NULL;
+	}
+	for (i = 0; i < SIM_CHIP_CNT; ++i) {
+		sim_p->chips[i].intFd = -1;
+		chip_por(&sim_p->chips[i]);
+	}
+	sim_p->txnNs = txnNs;
+	sim_p->byteNs = byteNs;
+	return sim_p;
+}
+
+void
+mcp23017_priv__sim_free (void *p)
+{
+	Sim_t *sim_p = p;
+	unsigned i;
+
+	if (sim_p == NULL)
+		return;
+	for (i = 0; i < SIM_CHIP_CNT; ++i)
+		if (sim_p->chips[i].intFd >= 0)
+			close(sim_p->chips[i].intFd);
+	free(sim_p);
+}
+
+static bool
+sim_open (Mcp23017Bus_t *bus_p)
+{
+	bus_p->sim_p = mcp23017_priv__sim_new(SIM_DEFAULT_TXN_NS, SIM_DEFAULT_BYTE_NS);
+	if (bus_p->sim_p == NULL)
+		return false;
+	bus_p->funcs = I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_I2C_BLOCK;
+	return true;
+}
+
+static void
+sim_close (Mcp23017Bus_t *bus_p)
+{
+	mcp23017_priv__sim_free(bus_p->sim_p);
+	bus_p->sim_p = NULL;
+}
+
+/**
+ * actual level of every pin, port A in the low byte
+ */
+static uint16_t
+pin_levels (const SimChip_t *chip_p)
+{
+	uint16_t iodir, olat, levels = 0;
+	unsigned pin, partner;
+	bool level;
+
+	iodir = (uint16_t)(chip_p->regs[MCP23017_IODIR][PORTA] | (chip_p->regs[MCP23017_IODIR][PORTB] << 8));
+	olat = (uint16_t)(chip_p->regs[MCP23017_OLAT][PORTA] | (chip_p->regs[MCP23017_OLAT][PORTB] << 8));
+
+	for (pin = 0; pin < 16; ++pin) {
+		partner = (pin + 8) % 16;
+		if (!(iodir & (1u << pin)))
+			level = (olat & (1u << pin)) != 0;
+		else if (chip_p->loopback && !(iodir & (1u << partner)))
+			level = (olat & (1u << partner)) != 0;
+		else if (chip_p->driveMask & (1u << pin))
+			level = (chip_p->driveLevels & (1u << pin)) != 0;
+		else
+			level = (chip_p->regs[MCP23017_GPPU][pin / 8] & (1u << (pin % 8))) != 0;
+		if (level)
+			levels |= (uint16_t)(1u << pin);
+	}
+
+	return levels;
+}
+
+static uint8_t
+gpio_value (const SimChip_t *chip_p, uint16_t levels, Mcp23017Port_e port)
+{
+	uint8_t val = (uint8_t)(levels >> (8 * port));
+
+	// IPOL only affects inputs
+	return val ^ (chip_p->regs[MCP23017_IPOL][port] & chip_p->regs[MCP23017_IODIR][port]);
+}
+
+/**
+ * re-evaluate the interrupt logic after anything that might change a pin
+ */
+static void
+chip_update (SimChip_t *chip_p)
+{
+	uint16_t levels;
+	uint8_t cur, prev, en, trig;
+	Mcp23017Port_e port;
+	bool asserted;
+	uint64_t one = 1;
+	ssize_t ret;
+
+	levels = pin_levels(chip_p);
+	for (port = PORTA; port <= PORTB; ++port) {
+		cur = gpio_value(chip_p, levels, port);
+		prev = (uint8_t)(chip_p->prevLevels >> (8 * port));
+		en = chip_p->regs[MCP23017_GPINTEN][port] & chip_p->regs[MCP23017_IODIR][port];
+		trig = (uint8_t)(en & chip_p->regs[MCP23017_INTCON][port] & (cur ^ chip_p->regs[MCP23017_DEFVAL][port]));
+		trig |= (uint8_t)(en & ~chip_p->regs[MCP23017_INTCON][port] & (cur ^ prev));
+
+		// INTCAP holds the first capture until the interrupt is cleared
+		if (trig && (chip_p->regs[MCP23017_INTF][port] == 0)) {
+			chip_p->regs[MCP23017_INTF][port] = trig;
+			chip_p->regs[MCP23017_INTCAP][port] = cur;
+		}
+	}
+	chip_p->prevLevels = (uint16_t)(gpio_value(chip_p, levels, PORTA) | (gpio_value(chip_p, levels, PORTB) << 8));
+
+	// with MIRROR clear each INT pin follows its own port; either way the
+	// eventfd stands for "an INT pin became active"
+	asserted = (chip_p->regs[MCP23017_INTF][PORTA] | chip_p->regs[MCP23017_INTF][PORTB]) != 0;
+	if (asserted && !chip_p->intAsserted && (chip_p->intFd >= 0)) {
+		ret = write(chip_p->intFd, &one, sizeof(one));
+		(void)ret;
+	}
+	chip_p->intAsserted = asserted;
+}
+
+static bool
+decode (const SimChip_t *chip_p, uint8_t addr, Mcp23017Reg_e *reg_p, Mcp23017Port_e *port_p)
+{
+	if (chip_p->regs[MCP23017_IOCON][PORTA] & IOCON_BANK) {
+		if ((addr > 0x1a) || ((addr & 0x0f) > 0x0a))
+			return false;
+		*reg_p = (Mcp23017Reg_e)(addr & 0x0f);
+		*port_p = (addr & 0x10)? PORTB : PORTA;
+		return true;
+	}
+
+	if (addr > 0x15)
+		return false;
+	*reg_p = (Mcp23017Reg_e)(addr >> 1);
+	*port_p = (addr & 0x01)? PORTB : PORTA;
+	return true;
+}
+
+static uint8_t
+next_addr (const SimChip_t *chip_p, uint8_t addr)
+{
+	uint8_t iocon = chip_p->regs[MCP23017_IOCON][PORTA];
+
+	if (iocon & IOCON_SEQOP) {
+		if (iocon & IOCON_BANK)
+			return addr;
+		return addr ^ 0x01;
+	}
+
+	if (iocon & IOCON_BANK) {
+		++addr;
+		if ((addr & 0x0f) > 0x0a)
+			addr = (addr & 0x10)? 0x00 : 0x10;
+		return addr;
+	}
+
+	return (addr >= 0x15)? 0x00 : (uint8_t)(addr + 1);
+}
+
+static uint8_t
+chip_read (SimChip_t *chip_p, uint8_t addr)
+{
+	Mcp23017Reg_e reg;
+	Mcp23017Port_e port;
+	uint8_t val;
+
+	if (!decode(chip_p, addr, &reg, &port))
+		return 0;
+
+	switch (reg) {
+		case MCP23017_GPIO:
+			val = gpio_value(chip_p, pin_levels(chip_p), port);
+			chip_p->regs[MCP23017_INTF][port] = 0;
+			chip_update(chip_p);
+			return val;
+
+		case MCP23017_INTCAP:
+			val = chip_p->regs[MCP23017_INTCAP][port];
+			chip_p->regs[MCP23017_INTF][port] = 0;
+			chip_update(chip_p);
+			return val;
+
+		default:
+			return chip_p->regs[reg][port];
+	}
+}
+
+static void
+chip_write (SimChip_t *chip_p, uint8_t addr, uint8_t val)
+{
+	Mcp23017Reg_e reg;
+	Mcp23017Port_e port;
+
+	if (!decode(chip_p, addr, &reg, &port))
+		return;
+
+	switch (reg) {
+		case MCP23017_INTF:
+		case MCP23017_INTCAP:
+			return;
+
+		case MCP23017_IOCON:
+			// bit 0 is unimplemented
+			chip_p->regs[MCP23017_IOCON][PORTA] = val & 0xfe;
+			chip_p->regs[MCP23017_IOCON][PORTB] = val & 0xfe;
+			break;
+
+		case MCP23017_GPIO:
+			chip_p->regs[MCP23017_OLAT][port] = val;
+			break;
+
+		default:
+			chip_p->regs[reg][port] = val;
+			break;
+	}
+	chip_update(chip_p);
+}
+
+static void
+sim_account (Sim_t *sim_p, uint64_t txns, uint64_t bytes)
+{
+	uint64_t ns;
+	struct timespec ts;
+
+	ns = txns * sim_p->txnNs + bytes * sim_p->byteNs;
+	sim_p->stats.transactions += txns;
+	sim_p->stats.bytes += bytes;
+	sim_p->stats.busNs += ns;
+
+	if (sim_p->sleep && (ns > 0)) {
+		ts.tv_sec = (time_t)(ns / 1000000000ull);
+		ts.tv_nsec = (long)(ns % 1000000000ull);
+		while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR))
+			;
+	}
+}
+
+/**
+ * the simulated adapter handles combined transfers, so a call is accounted
+ * like an I2C_RDWR: one transaction per I2C_RDWR_IOCTL_MAX_MSGS messages
+ */
+static bool
+sim_xfer (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	Sim_t *sim_p = bus_p->sim_p;
+	SimChip_t *chip_p;
+	unsigned i, j, msgs = 0;
+	uint64_t txns = 0, bytes = 0;
+	uint8_t addr;
+	bool ok = true;
+
+	if (sim_p->faults > 0) {
+		--sim_p->faults;
+		for (i = 0; i < cnt; ++i)
+			xfer_p[i].result = -sim_p->faultErr;
+		sim_account(sim_p, 1, 1);
+		return false;
+	}
+
+	for (i = 0; i < cnt; ++i) {
+		if ((msgs == 0) || (msgs + (xfer_p[i].read? 2u : 1u) > I2C_RDWR_IOCTL_MAX_MSGS)) {
+			++txns;
+			msgs = 0;
+		}
+		msgs += xfer_p[i].read? 2u : 1u;
+
+		// slave address, register, [repeated start + slave address,] data
+		bytes += 2u + (xfer_p[i].read? 1u : 0u) + xfer_p[i].len;
+
+		if ((xfer_p[i].addr < SIM_BASE_ADDR) || (xfer_p[i].addr >= SIM_BASE_ADDR + SIM_CHIP_CNT)) {
+			// nobody ACKs the address
+			xfer_p[i].result = -ENXIO;
+			ok = false;
+			continue;
+		}
+
+		chip_p = &sim_p->chips[xfer_p[i].addr - SIM_BASE_ADDR];
+		addr = xfer_p[i].reg;
+		for (j = 0; j < xfer_p[i].len; ++j) {
+			if (xfer_p[i].read)
+				xfer_p[i].buf_p[j] = chip_read(chip_p, addr);
+			else
+				chip_write(chip_p, addr, xfer_p[i].buf_p[j]);
+			addr = next_addr(chip_p, addr);
+		}
+		xfer_p[i].result = 0;
+	}
+
+	sim_account(sim_p, txns, bytes);
+	return ok;
+}
+
+/**
+ * MCP23S17 behind the spidev transport: each transfer is one chip-select
+ * assertion carrying opcode (0100 A2 A1 A0 R/W), register, then data
+ * with IOCON.HAEN clear a chip ignores the hardware address bits, so every
+ * such chip on the chip select answers
+ */
+bool
+mcp23017_priv__sim_spi_message (void *p, struct spi_ioc_transfer *xfer_p, unsigned cnt)
+{
+	Sim_t *sim_p = p;
+	SimChip_t *chip_p;
+	const uint8_t *tx_p;
+	uint8_t *rx_p;
+	uint64_t bytes = 0;
+	unsigned i, j, hw;
+	uint8_t addr;
+	bool read, answered;
+
+	for (i = 0; i < cnt; ++i) {
+		bytes += xfer_p[i].len;
+		if (xfer_p[i].len < 2)
+			continue;
+		tx_p = (const uint8_t *)(uintptr_t)xfer_p[i].tx_buf;
+		rx_p = (uint8_t *)(uintptr_t)xfer_p[i].rx_buf;
+		if ((tx_p[0] & 0xf0) != 0x40)
+			continue;
+		read = (tx_p[0] & 0x01) != 0;
+
+		answered = false;
+		for (hw = 0; hw < SIM_CHIP_CNT; ++hw) {
+			chip_p = &sim_p->chips[hw];
+			if ((chip_p->regs[MCP23017_IOCON][PORTA] & IOCON_HAEN) && (((tx_p[0] >> 1) & 0x07) != hw))
+				continue;
+
+			addr = tx_p[1];
+			for (j = 2; j < xfer_p[i].len; ++j) {
+				if (!read)
+					chip_write(chip_p, addr, tx_p[j]);
+				else if (!answered && (rx_p != NULL))
+					rx_p[j] = chip_read(chip_p, addr);
+				else
+					(void)chip_read(chip_p, addr);
+				addr = next_addr(chip_p, addr);
+			}
+			answered = true;
+		}
+	}
+
+	sim_account(sim_p, cnt, bytes);
+	return true;
+}
+
+const Mcp23017BusOps_t mcp23017_priv__simOps = {
+	.open = sim_open,
+	.close = sim_close,
+	.xfer = sim_xfer,
+};
+
+static Sim_t *
+dev_sim (Mcp23017_t *dev_p)
+{
+	if (dev_p == NULL)
+		return NULL;
+	return dev_p->bus_p->sim_p;
+}
+
+static SimChip_t *
+dev_chip (Mcp23017_t *dev_p)
+{
+	Sim_t *sim_p = dev_sim(dev_p);
+
+	if (sim_p == NULL)
+		return NULL;
+	if ((dev_p->addr < SIM_BASE_ADDR) || (dev_p->addr >= SIM_BASE_ADDR + SIM_CHIP_CNT))
+		return NULL;
+	return &sim_p->chips[dev_p->addr & 0x07];
+}
+
+/**
+ * configure the bus-time model of the simulated bus 'dev_p' sits on
+ * txnNs: fixed cost per transaction (start/stop, driver overhead)
+ * byteNs: cost per byte on the wire (9 clocks)
+ * sleep: also actually wait that long, instead of only accounting for it
+ */
+bool
+mcp23017__sim_set_latency (Mcp23017_t *dev_p, uint32_t txnNs, uint32_t byteNs, bool sleep)
+{
+	Sim_t *sim_p = dev_sim(dev_p);
+
+	// preconds
+	if (sim_p == NULL)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	sim_p->txnNs = txnNs;
+	sim_p->byteNs = byteNs;
+	sim_p->sleep = sleep;
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * traffic seen by the simulated adapter 'dev_p' sits on
+ */
+bool
+mcp23017__sim_get_stats (Mcp23017_t *dev_p, Mcp23017SimStats_t *stats_p)
+{
+	Sim_t *sim_p = dev_sim(dev_p);
+
+	// preconds
+	if ((sim_p == NULL) || (stats_p == NULL))
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	*stats_p = sim_p->stats;
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+bool
+mcp23017__sim_reset_stats (Mcp23017_t *dev_p)
+{
+	Sim_t *sim_p = dev_sim(dev_p);
+
+	// preconds
+	if (sim_p == NULL)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	memset(&sim_p->stats, 0, sizeof(sim_p->stats));
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * drive the input pins in 'mask' (port A in the low byte) to 'levels' from
+ * outside the chip; pins not in 'mask' are released (pull-up or floating low)
+ */
+bool
+mcp23017__sim_drive_pins (Mcp23017_t *dev_p, uint16_t mask, uint16_t levels)
+{
+	SimChip_t *chip_p = dev_chip(dev_p);
+
+	// preconds
+	if (chip_p == NULL)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	chip_p->driveMask = mask;
+	chip_p->driveLevels = levels & mask;
+	chip_update(chip_p);
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * wire each port A pin to the matching port B pin: an input sees the level
+ * of its partner when the partner is an output
+ */
+bool
+mcp23017__sim_loopback (Mcp23017_t *dev_p, bool enable)
+{
+	SimChip_t *chip_p = dev_chip(dev_p);
+
+	// preconds
+	if (chip_p == NULL)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	chip_p->loopback = enable;
+	chip_update(chip_p);
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * return the simulated chip to its power-on-reset state (like pulsing /RESET)
+ */
+bool
+mcp23017__sim_reset (Mcp23017_t *dev_p)
+{
+	SimChip_t *chip_p = dev_chip(dev_p);
+	uint16_t mask, levels;
+	bool loopback;
+
+	// preconds
+	if (chip_p == NULL)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	// what's wired to the pins survives a reset
+	mask = chip_p->driveMask;
+	levels = chip_p->driveLevels;
+	loopback = chip_p->loopback;
+	chip_por(chip_p);
+	chip_p->driveMask = mask;
+	chip_p->driveLevels = levels;
+	chip_p->loopback = loopback;
+	chip_p->prevLevels = pin_levels(chip_p);
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * make the next 'cnt' transfers on the simulated I2C adapter 'dev_p' sits
+ * on fail with errno 'err' (e.g. EREMOTEIO for a NAK)
+ */
+bool
+mcp23017__sim_inject_faults (Mcp23017_t *dev_p, unsigned cnt, int err)
+{
+	Sim_t *sim_p = dev_sim(dev_p);
+
+	// preconds
+	if (sim_p == NULL)
+		return false;
+	if (err <= 0)
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	sim_p->faults = cnt;
+	sim_p->faultErr = err;
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return true;
+}
+
+/**
+ * an eventfd that becomes readable whenever the simulated chip asserts INT;
+ * suitable for mcp23017__irq_attach_fd()
+ */
+int
+mcp23017__sim_int_fd (Mcp23017_t *dev_p)
+{
+	SimChip_t *chip_p = dev_chip(dev_p);
+
+	// preconds
+	if (chip_p == NULL)
+		return -1;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (chip_p->intFd < 0) {
+		chip_p->intFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (chip_p->intFd < 0)
+			mcp23017_priv__log_errno("eventfd()");
+	}
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return chip_p->intFd;
+}
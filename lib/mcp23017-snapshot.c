@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * whole register file in as few runs as the layout allows
+ * BANK=0: the 22 registers are contiguous (0x00-0x15), one run
+ * BANK=1: one run per port (0x00-0x0a, 0x10-0x1a)
+ * both need the address pointer to advance (IOCON.SEQOP=0); in byte mode
+ * every register is a run of its own, still in a single bus transfer
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define IOCON_BANK 0x80
+#define IOCON_SEQOP 0x20
+
+#define BLOCK_LEN (2 * MCP23017_REG_CNT)
+
+/*
+ * the runs covering 'buf_p', which is in the device's register layout
+ * (BANK=0: 0x00-0x15; BANK=1: port A 0x00-0x0a, port B at +MCP23017_REG_CNT)
+ * returns the number of runs
+ */
+static unsigned
+block_xfer (Mcp23017_t *dev_p, uint8_t iocon, bool read, uint8_t *buf_p, Mcp23017Xfer_t *xfer_p)
+{
+	Mcp23017Reg_e reg;
+	Mcp23017Port_e port;
+	unsigned i, cnt = 0;
+
+	if (iocon & IOCON_SEQOP) {
+		for (port = PORTA; port <= PORTB; ++port) {
+			for (reg = MCP23017_IODIR; reg < MCP23017_REG_CNT; ++reg) {
+				xfer_p[cnt].reg = mcp23017_priv__reg_addr(dev_p, reg, port);
+				xfer_p[cnt].len = 1;
+				xfer_p[cnt].buf_p = dev_p->bank1?
+					&buf_p[port * MCP23017_REG_CNT + reg] : &buf_p[2 * reg + port];
+				++cnt;
+			}
+		}
+	}
+	else if (dev_p->bank1) {
+		for (port = PORTA; port <= PORTB; ++port) {
+			xfer_p[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, port);
+			xfer_p[cnt].len = MCP23017_REG_CNT;
+			xfer_p[cnt].buf_p = &buf_p[port * MCP23017_REG_CNT];
+			++cnt;
+		}
+	}
+	else {
+		xfer_p[cnt].reg = 0x00;
+		xfer_p[cnt].len = BLOCK_LEN;
+		xfer_p[cnt].buf_p = buf_p;
+		++cnt;
+	}
+
+	for (i = 0; i < cnt; ++i) {
+		xfer_p[i].addr = dev_p->addr;
+		xfer_p[i].read = read;
+		xfer_p[i].fixedReg = false;
+		xfer_p[i].noRetry = false;
+	}
+	return cnt;
+}
+
+static uint8_t *
+block_reg (Mcp23017_t *dev_p, uint8_t *buf_p, Mcp23017Reg_e reg, Mcp23017Port_e port)
+{
+	if (dev_p->bank1)
+		return &buf_p[port * MCP23017_REG_CNT + reg];
+	return &buf_p[2 * reg + port];
+}
+
+/**
+ * read every register of the chip, in one bus transfer
+ * also refreshes the cache
+ * this reads GPIO and INTCAP too, which clears a pending interrupt: read
+ * the events (mcp23017__irq_read_events()) first if that matters
+ */
+bool
+mcp23017__dev_snapshot (Mcp23017_t *dev_p, Mcp23017Snapshot_t *snap_p)
+{
+	uint8_t buf[BLOCK_LEN];
+	uint8_t iocon;
+	Mcp23017Xfer_t xfer[BLOCK_LEN];
+	Mcp23017Reg_e reg;
+	Mcp23017Port_e port;
+	unsigned cnt;
+	bool ok = false;
+
+	// preconds
+	if ((dev_p == NULL) || (snap_p == NULL))
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon))
+		goto done;
+
+	cnt = block_xfer(dev_p, iocon, true, buf, xfer);
+	if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt))
+		goto done;
+
+	for (port = PORTA; port <= PORTB; ++port) {
+		for (reg = MCP23017_IODIR; reg < MCP23017_REG_CNT; ++reg) {
+			snap_p->regs[reg][port] = *block_reg(dev_p, buf, reg, port);
+			mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, reg, port),
+					snap_p->regs[reg][port]);
+		}
+	}
+	ok = true;
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
+
+/**
+ * write a whole configuration back, in one bus transfer: the output
+ * latches first (so pins turning into outputs come up at the right level),
+ * then the register block with IOCON left as it is, then IOCON itself
+ * INTF/INTCAP are read-only and GPIO is written with the OLAT value;
+ * IOCON.BANK always stays as the handle was opened
+ */
+bool
+mcp23017__dev_restore (Mcp23017_t *dev_p, const Mcp23017Snapshot_t *snap_p)
+{
+	uint8_t buf[BLOCK_LEN];
+	uint8_t olat[2];
+	uint8_t iocon, ioconNew;
+	Mcp23017Xfer_t xfer[BLOCK_LEN + 3];
+	Mcp23017Reg_e reg;
+	Mcp23017Port_e port;
+	unsigned cnt = 0;
+	bool ok = false;
+
+	// preconds
+	if ((dev_p == NULL) || (snap_p == NULL))
+		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), &iocon))
+		goto done;
+	ioconNew = (uint8_t)((snap_p->regs[MCP23017_IOCON][PORTA] & ~IOCON_BANK) |
+			(dev_p->bank1? IOCON_BANK : 0));
+
+	for (port = PORTA; port <= PORTB; ++port) {
+		for (reg = MCP23017_IODIR; reg < MCP23017_REG_CNT; ++reg)
+			*block_reg(dev_p, buf, reg, port) = snap_p->regs[reg][port];
+		*block_reg(dev_p, buf, MCP23017_IOCON, port) = iocon;
+		*block_reg(dev_p, buf, MCP23017_GPIO, port) = snap_p->regs[MCP23017_OLAT][port];
+		olat[port] = snap_p->regs[MCP23017_OLAT][port];
+
+		xfer[cnt].addr = dev_p->addr;
+		xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, port);
+		xfer[cnt].read = false;
+		xfer[cnt].fixedReg = false;
+		xfer[cnt].noRetry = false;
+		xfer[cnt].len = 1;
+		xfer[cnt].buf_p = &olat[port];
+		++cnt;
+	}
+
+	cnt += block_xfer(dev_p, iocon, false, buf, &xfer[cnt]);
+
+	xfer[cnt].addr = dev_p->addr;
+	xfer[cnt].reg = mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA);
+	xfer[cnt].read = false;
+	xfer[cnt].fixedReg = false;
+	xfer[cnt].noRetry = false;
+	xfer[cnt].len = 1;
+	xfer[cnt].buf_p = &ioconNew;
+	++cnt;
+
+	if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt)) {
+		// no telling which registers made it
+		dev_p->regCacheValid = 0;
+		if (dev_p->cacheEnable)
+			mcp23017__dev_cache_resync(dev_p);
+		goto done;
+	}
+
+	for (port = PORTA; port <= PORTB; ++port)
+		for (reg = MCP23017_IODIR; reg < MCP23017_REG_CNT; ++reg)
+			if ((reg != MCP23017_IOCON) && (reg != MCP23017_GPIO))
+				mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, reg, port),
+						snap_p->regs[reg][port]);
+	mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA), ioconNew);
+	ok = true;
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * spidev transport for the MCP23S17 (the SPI flavour of the part)
+ * up to eight chips share one chip select using hardware addressing
+ * (IOCON.HAEN, set on all of them when the bus is opened); the chip's
+ * "address" is the same 0x20-0x27 used on i2c, only A2..A0 matter
+ * each register run is one chip-select assertion, and all the runs of a
+ * transfer go to the kernel as a single SPI_IOC_MESSAGE(n)
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define SPI_SPEED_HZ 10000000
+#define SPI_OPCODE 0x40
+#define SPI_READ 0x01
+
+// spidev's default per-message buffer limit
+#define SPI_MSG_BYTES 4096
+#define SPI_MSG_XFERS 64
+
+// staging for ordinary transfers, so only bursts ever grow it
+#define SPI_SCRATCH_PREALLOC 512
+
+// 10MHz: 8 clocks per byte
+#define SPI_SIM_TXN_NS 1000
+#define SPI_SIM_BYTE_NS 800
+
+// IOCON is at 0x0a/0x0b with BANK=0 and at 0x05/0x15 with BANK=1
+#define IOCON_BANK0 0x0a
+#define IOCON_BANK1 0x05
+#define IOCON_BANK 0x80
+#define IOCON_HAEN 0x08
+
+static bool
+spi_message (Mcp23017Bus_t *bus_p, struct spi_ioc_transfer *xfer_p, unsigned cnt)
+{
+	if (bus_p->sim_p != NULL)
+		return mcp23017_priv__sim_spi_message(bus_p->sim_p, xfer_p, cnt);
+	return ioctl(bus_p->fd, SPI_IOC_MESSAGE(cnt), xfer_p) >= 0;
+}
+
+/*
+ * turn on hardware addressing: with HAEN clear every chip on the chip
+ * select answers hardware address 0, so they all switch at once
+ * the chips may be in either layout (e.g. set up by an earlier run with
+ * BANK=1), so IOCON is located first and only HAEN is added to it; BANK=1
+ * is recognized by 0x05 and 0x15 (IOCON there) agreeing with BANK set,
+ * anything else is taken as BANK=0, where IOCON is at 0x0a
+ * the probe reads hardware address 0, i.e. every chip that still has HAEN
+ * clear (and one at address 0 that has it set) drives SO at once, so it is
+ * only reliable when the chips share one layout and IOCON value
+ * the write is sent even if the value read has HAEN set: that may be only
+ * the chip at address 0, with others (e.g. reset since) still waiting for
+ * it; chips that already have HAEN set elsewhere ignore it
+ */
+static bool
+spi_enable_haen (Mcp23017Bus_t *bus_p)
+{
+	static const uint8_t probe[] = { IOCON_BANK1, IOCON_BANK0, IOCON_BANK1 | 0x10 };
+	uint8_t tx[3][3], rx[3][3];
+	struct spi_ioc_transfer xfer[3];
+	uint8_t iocon;
+	unsigned i;
+	bool bank1;
+
+	memset(xfer, 0, sizeof(xfer));
+	memset(rx, 0, sizeof(rx));
+	for (i = 0; i < 3; ++i) {
+		tx[i][0] = SPI_OPCODE | SPI_READ;
+		tx[i][1] = probe[i];
+		tx[i][2] = 0;
+		xfer[i].tx_buf = (uintptr_t)tx[i];
+		xfer[i].rx_buf = (uintptr_t)rx[i];
+		xfer[i].len = sizeof(tx[i]);
+		xfer[i].cs_change = (i < 2);
+	}
+	if (!spi_message(bus_p, xfer, 3))
+		return false;
+
+	bank1 = (rx[0][2] & IOCON_BANK) && (rx[0][2] == rx[2][2]);
+	iocon = bank1? rx[0][2] : rx[1][2];
+
+	tx[0][0] = SPI_OPCODE;
+	tx[0][1] = bank1? IOCON_BANK1 : IOCON_BANK0;
+	tx[0][2] = (uint8_t)(iocon | IOCON_HAEN);
+	memset(&xfer[0], 0, sizeof(xfer[0]));
+	xfer[0].tx_buf = (uintptr_t)tx[0];
+	xfer[0].len = sizeof(tx[0]);
+	return spi_message(bus_p, xfer, 1);
+}
+
+static bool
+spi_open (Mcp23017Bus_t *bus_p)
+{
+	uint8_t mode = SPI_MODE_0;
+	uint8_t bits = 8;
+	uint32_t speed = SPI_SPEED_HZ;
+
+	if (strncmp(bus_p->devFile, MCP23017_SPI_SIM_PREFIX, strlen(MCP23017_SPI_SIM_PREFIX)) == 0) {
+		bus_p->sim_p = mcp23017_priv__sim_new(SPI_SIM_TXN_NS, SPI_SIM_BYTE_NS);
+		if (bus_p->sim_p == NULL)
+			return false;
+	}
+	else {
+		bus_p->fd = open(bus_p->devFile, O_RDWR);
+		if (bus_p->fd < 0) {
+			mcp23017_priv__log_errno("open(spi device)");
+			return false;
+		}
+		if ((ioctl(bus_p->fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+				(ioctl(bus_p->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+				(ioctl(bus_p->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)) {
+			mcp23017_priv__log_errno("spi setup");
+			goto err1;
+		}
+	}
+
+	if (!spi_enable_haen(bus_p)) {
+		mcp23017_priv__log_errno("spi enable IOCON.HAEN");
+		goto err1;
+	}
+
+	// not having it now only means allocating it later
+	bus_p->scratch_p = malloc(SPI_SCRATCH_PREALLOC);
+	if (bus_p->scratch_p != NULL)
+		bus_p->scratchLen = SPI_SCRATCH_PREALLOC;
+	return true;
+err1:
+	if (bus_p->fd >= 0)
+		close(bus_p->fd);
+	bus_p->fd = -1;
+	mcp23017_priv__sim_free(bus_p->sim_p);
+	bus_p->sim_p = NULL;
+	return false;
+}
+
+static void
+spi_close (Mcp23017Bus_t *bus_p)
+{
+	if (bus_p->fd >= 0)
+		close(bus_p->fd);
+	bus_p->fd = -1;
+	mcp23017_priv__sim_free(bus_p->sim_p);
+	bus_p->sim_p = NULL;
+	free(bus_p->scratch_p);
+	bus_p->scratch_p = NULL;
+	bus_p->scratchLen = 0;
+}
+
+static bool
+spi_flush (Mcp23017Bus_t *bus_p, struct spi_ioc_transfer *spi_p, unsigned nspi, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	unsigned i;
+	int result = 0;
+	const uint8_t *rx_p;
+
+	// deassert chip select between runs, but not after the last one
+	spi_p[nspi - 1].cs_change = 0;
+	if (!spi_message(bus_p, spi_p, nspi))
+		result = -errno;
+
+	for (i = 0; i < cnt; ++i) {
+		xfer_p[i].result = result;
+		if ((result == 0) && xfer_p[i].read) {
+			rx_p = (const uint8_t *)(uintptr_t)spi_p[i].rx_buf;
+			memcpy(xfer_p[i].buf_p, rx_p + 2, xfer_p[i].len);
+		}
+	}
+	return result == 0;
+}
+
+static bool
+spi_xfer (Mcp23017Bus_t *bus_p, Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	struct spi_ioc_transfer spi[SPI_MSG_XFERS];
+	unsigned i, first, nspi;
+	size_t off, need, bytes;
+	uint8_t *tx_p;
+	uint8_t *p;
+	bool ok = true;
+
+	// opcode + register + data, transmit and receive side by side
+	need = 0;
+	for (i = 0; i < cnt; ++i)
+		need += 2u * ((size_t)xfer_p[i].len + 2u);
+	if (bus_p->scratchLen < need) {
+		p = realloc(bus_p->scratch_p, need);
+		if (p == NULL) {
+			for (i = 0; i < cnt; ++i)
+				xfer_p[i].result = -ENOMEM;
+			return false;
+		}
+		bus_p->scratch_p = p;
+		bus_p->scratchLen = need;
+	}
+
+	nspi = 0;
+	first = 0;
+	off = 0;
+	bytes = 0;
+	for (i = 0; i < cnt; ++i) {
+		if ((nspi == SPI_MSG_XFERS) || ((nspi > 0) && (bytes + xfer_p[i].len + 2u > SPI_MSG_BYTES))) {
+			ok &= spi_flush(bus_p, spi, nspi, &xfer_p[first], i - first);
+			nspi = 0;
+			first = i;
+			bytes = 0;
+		}
+
+		tx_p = bus_p->scratch_p + off;
+		tx_p[0] = (uint8_t)(SPI_OPCODE | ((xfer_p[i].addr & 0x07) << 1) | (xfer_p[i].read? SPI_READ : 0));
+		tx_p[1] = xfer_p[i].reg;
+		if (xfer_p[i].read)
+			memset(tx_p + 2, 0, xfer_p[i].len);
+		else
+			memcpy(tx_p + 2, xfer_p[i].buf_p, xfer_p[i].len);
+
+		memset(&spi[nspi], 0, sizeof(spi[nspi]));
+		spi[nspi].tx_buf = (uintptr_t)tx_p;
+		spi[nspi].rx_buf = (uintptr_t)(tx_p + xfer_p[i].len + 2);
+		spi[nspi].len = (uint32_t)xfer_p[i].len + 2u;
+		spi[nspi].cs_change = 1;
+		++nspi;
+
+		off += 2u * ((size_t)xfer_p[i].len + 2u);
+		bytes += (size_t)xfer_p[i].len + 2u;
+	}
+
+	ok &= spi_flush(bus_p, spi, nspi, &xfer_p[first], cnt - first);
+	return ok;
+}
+
+const Mcp23017BusOps_t mcp23017_priv__spiOps = {
+	.open = spi_open,
+	.close = spi_close,
+	.xfer = spi_xfer,
+};
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * per-chip transfer statistics
+ * counters are relaxed atomics so any thread can bump or read them
+ * without a lock; a snapshot is therefore not guaranteed to be
+ * consistent across fields while transfers are in flight
+ * configure --disable-stats compiles all of this out of the transfer path
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#ifdef ENABLE_STATS
+uint64_t
+mcp23017_priv__stats_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void
+mcp23017_priv__stats_count (Mcp23017_t *dev_p, const Mcp23017Xfer_t *xfer_p, unsigned cnt)
+{
+	unsigned i;
+	uint64_t bytes = 0;
+
+	for (i = 0; i < cnt; ++i) {
+		if (xfer_p[i].read)
+			atomic_fetch_add_explicit(&dev_p->stats.reads, 1, memory_order_relaxed);
+		else
+			atomic_fetch_add_explicit(&dev_p->stats.writes, 1, memory_order_relaxed);
+		if (xfer_p[i].result != 0)
+			atomic_fetch_add_explicit(&dev_p->stats.errors, 1, memory_order_relaxed);
+		if (xfer_p[i].retries != 0)
+			atomic_fetch_add_explicit(&dev_p->stats.retries, xfer_p[i].retries, memory_order_relaxed);
+		bytes += xfer_p[i].len;
+	}
+	atomic_fetch_add_explicit(&dev_p->stats.bytes, bytes, memory_order_relaxed);
+}
+
+void
+mcp23017_priv__stats_latency (Mcp23017_t *dev_p, uint64_t ns)
+{
+	unsigned bucket;
+
+	// floor(log2(ns))
+	bucket = (unsigned)(63 - __builtin_clzll(ns | 1));
+	if (bucket >= MCP23017_STATS_BUCKETS)
+		bucket = MCP23017_STATS_BUCKETS - 1;
+	atomic_fetch_add_explicit(&dev_p->stats.latency[bucket], 1, memory_order_relaxed);
+}
+#endif
+
+/**
+ * copy out the chip's counters
+ * returns false if the library was built without statistics
+ */
+bool
+mcp23017__stats_get (Mcp23017_t *dev_p, Mcp23017Stats_t *stats_p)
+{
+#ifdef ENABLE_STATS
+	unsigned i;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+	if (stats_p == NULL)
+		return false;
+
+	stats_p->reads = atomic_load_explicit(&dev_p->stats.reads, memory_order_relaxed);
+	stats_p->writes = atomic_load_explicit(&dev_p->stats.writes, memory_order_relaxed);
+	stats_p->bytes = atomic_load_explicit(&dev_p->stats.bytes, memory_order_relaxed);
+	stats_p->errors = atomic_load_explicit(&dev_p->stats.errors, memory_order_relaxed);
+	stats_p->retries = atomic_load_explicit(&dev_p->stats.retries, memory_order_relaxed);
+	for (i = 0; i < MCP23017_STATS_BUCKETS; ++i)
+		stats_p->latency[i] = atomic_load_explicit(&dev_p->stats.latency[i], memory_order_relaxed);
+	return true;
+#else
+	(void)dev_p;
+	(void)stats_p;
+	return false;
+#endif
+}
+
+bool
+mcp23017__stats_reset (Mcp23017_t *dev_p)
+{
+#ifdef ENABLE_STATS
+	unsigned i;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	atomic_store_explicit(&dev_p->stats.reads, 0, memory_order_relaxed);
+	atomic_store_explicit(&dev_p->stats.writes, 0, memory_order_relaxed);
+	atomic_store_explicit(&dev_p->stats.bytes, 0, memory_order_relaxed);
+	atomic_store_explicit(&dev_p->stats.errors, 0, memory_order_relaxed);
+	atomic_store_explicit(&dev_p->stats.retries, 0, memory_order_relaxed);
+	for (i = 0; i < MCP23017_STATS_BUCKETS; ++i)
+		atomic_store_explicit(&dev_p->stats.latency[i], 0, memory_order_relaxed);
+	return true;
+#else
+	(void)dev_p;
+	return false;
+#endif
+}
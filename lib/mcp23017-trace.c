@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * transaction tracing
+ * while on, every register run handed to an adapter is recorded (when,
+ * how long the transfer took, chip, register, direction, its data and the
+ * outcome) in a ring of fixed-size records, as many per run as its data
+ * needs; when the ring is full the oldest runs are dropped, whole
+ * off, it costs bus_xfer() one relaxed atomic load; on, two clock reads per
+ * transfer and a copy of each run's data under the ring's lock
+ * saved traces are what samples/mcp23017replay.c plays back
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "mcp23017-private.h"
+#include "config.h"
+
+#define TRACE_MAGIC 0x5433324du         // "M23T"
+#define TRACE_VERSION 2
+
+// at the start of a saved trace, followed by 'cnt' records, oldest first
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recSize;
+	uint32_t cnt;
+	uint32_t reserved;
+	uint64_t dropped;
+} TraceFileHdr_t;
+
+atomic_bool mcp23017_priv__traceOn = false;
+
+static pthread_mutex_t traceLock_G = PTHREAD_MUTEX_INITIALIZER;
+static Mcp23017TraceRec_t *ring_pG = NULL;
+static unsigned ringSize_G = 0;
+static unsigned head_G = 0;             // oldest record
+static unsigned cnt_G = 0;
+static uint64_t dropped_G = 0;
+
+uint64_t
+mcp23017_priv__trace_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * free 'n' records by dropping the oldest runs: a run's first record and
+ * the continuation records after it
+ */
+static void
+ring_make_room (unsigned n)
+{
+	while (cnt_G + n > ringSize_G) {
+		do {
+			head_G = (head_G + 1) % ringSize_G;
+			--cnt_G;
+			++dropped_G;
+		} while ((cnt_G > 0) && (ring_pG[head_G].flags & MCP23017_TRACE_CONT));
+	}
+}
+
+/**
+ * record the 'cnt' runs of one transfer on 'bus_p', which ran from 'start'
+ * to 'end'; called with the adapter locked
+ */
+void
+mcp23017_priv__trace (const Mcp23017Bus_t *bus_p, const Mcp23017Xfer_t *xfer_p, unsigned cnt, uint64_t start, uint64_t end)
+{
+	Mcp23017TraceRec_t *rec_p;
+	unsigned i, r, recs;
+	size_t len, off;
+	uint8_t flags;
+
+	pthread_mutex_lock(&traceLock_G);
+	if (ring_pG == NULL)
+		goto done;
+
+	for (i = 0; i < cnt; ++i) {
+		flags = 0;
+		if (xfer_p[i].read)
+			flags |= MCP23017_TRACE_READ;
+		if (xfer_p[i].fixedReg)
+			flags |= MCP23017_TRACE_FIXED;
+
+		// a failed read left nothing worth keeping
+		len = 0;
+		if ((xfer_p[i].buf_p != NULL) && (!xfer_p[i].read || (xfer_p[i].result == 0)))
+			len = xfer_p[i].len;
+		recs = (unsigned)((len + MCP23017_TRACE_DATA - 1) / MCP23017_TRACE_DATA);
+		if (recs == 0)
+			recs = 1;
+		if (recs > ringSize_G) {
+			recs = ringSize_G;
+			flags |= MCP23017_TRACE_TRUNC;
+		}
+		ring_make_room(recs);
+
+		for (r = 0; r < recs; ++r) {
+			rec_p = &ring_pG[(head_G + cnt_G++) % ringSize_G];
+			memset(rec_p, 0, sizeof(*rec_p));
+			rec_p->ts = start;
+			rec_p->durNs = (end - start > UINT32_MAX)? UINT32_MAX : (uint32_t)(end - start);
+			rec_p->len = xfer_p[i].len;
+			rec_p->result = (int16_t)xfer_p[i].result;
+			rec_p->bus = (uint8_t)bus_p->id;
+			rec_p->addr = xfer_p[i].addr;
+			rec_p->reg = xfer_p[i].reg;
+			rec_p->flags = flags;
+			if (r > 0)
+				rec_p->flags |= MCP23017_TRACE_CONT;
+			else if (i == 0)
+				rec_p->flags |= MCP23017_TRACE_FIRST;
+			off = (size_t)r * MCP23017_TRACE_DATA;
+			if (off < len)
+				memcpy(rec_p->data, xfer_p[i].buf_p + off,
+						(len - off < MCP23017_TRACE_DATA)? len - off : MCP23017_TRACE_DATA);
+		}
+	}
+
+done:
+	pthread_mutex_unlock(&traceLock_G);
+}
+
+/**
+ * start tracing into a ring of 'recCnt' records (a register run takes one
+ * per MCP23017_TRACE_DATA bytes of data), discarding any earlier trace
+ */
+bool
+mcp23017__trace_start (unsigned recCnt)
+{
+	Mcp23017TraceRec_t *ring_p;
+
+	// preconds
+	if (recCnt == 0)
+		return false;
+
+	ring_p = calloc(recCnt, sizeof(*ring_p));
+	if (ring_p == NULL) {
+		mcp23017_priv__log_errno("calloc(trace)");
+		return false;
+	}
+
+	pthread_mutex_lock(&traceLock_G);
+	free(ring_pG);
+	ring_pG = ring_p;
+	ringSize_G = recCnt;
+	head_G = cnt_G = 0;
+	dropped_G = 0;
+	atomic_store_explicit(&mcp23017_priv__traceOn, true, memory_order_relaxed);
+	pthread_mutex_unlock(&traceLock_G);
+	return true;
+}
+
+/**
+ * stop recording; what was recorded can still be read or saved
+ */
+void
+mcp23017__trace_stop (void)
+{
+	pthread_mutex_lock(&traceLock_G);
+	atomic_store_explicit(&mcp23017_priv__traceOn, false, memory_order_relaxed);
+	pthread_mutex_unlock(&traceLock_G);
+}
+
+/**
+ * take up to 'max' records out of the ring, oldest first; a run's
+ * continuation records may be left for the next call
+ * returns the number taken
+ */
+unsigned
+mcp23017__trace_read (Mcp23017TraceRec_t *recs_p, unsigned max)
+{
+	unsigned i;
+
+	// preconds
+	if ((recs_p == NULL) && (max > 0))
+		return 0;
+
+	pthread_mutex_lock(&traceLock_G);
+	for (i = 0; (i < max) && (cnt_G > 0); ++i) {
+		recs_p[i] = ring_pG[head_G];
+		head_G = (head_G + 1) % ringSize_G;
+		--cnt_G;
+	}
+	pthread_mutex_unlock(&traceLock_G);
+	return i;
+}
+
+/**
+ * records lost to a full ring since tracing started
+ */
+uint64_t
+mcp23017__trace_dropped (void)
+{
+	uint64_t dropped;
+
+	pthread_mutex_lock(&traceLock_G);
+	dropped = dropped_G;
+	pthread_mutex_unlock(&traceLock_G);
+	return dropped;
+}
+
+/**
+ * write the ring's contents to 'path_p' (they stay in the ring)
+ */
+bool
+mcp23017__trace_save (const char *path_p)
+{
+	TraceFileHdr_t hdr;
+	FILE *file;
+	unsigned i, first;
+	bool ok = true;
+
+	// preconds
+	if (path_p == NULL)
+		return false;
+
+	file = fopen(path_p, "wb");
+	if (file == NULL) {
+		mcp23017_priv__log_errno(path_p);
+		return false;
+	}
+
+	pthread_mutex_lock(&traceLock_G);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.recSize = (uint16_t)sizeof(Mcp23017TraceRec_t);
+	hdr.cnt = cnt_G;
+	hdr.dropped = dropped_G;
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+		ok = false;
+	// at most two pieces: up to the end of the ring, then from its start
+	if (ok && (cnt_G > 0)) {
+		first = ringSize_G - head_G;
+		if (first > cnt_G)
+			first = cnt_G;
+		if (fwrite(&ring_pG[head_G], sizeof(*ring_pG), first, file) != first)
+			ok = false;
+		i = cnt_G - first;
+		if (ok && (i > 0) && (fwrite(ring_pG, sizeof(*ring_pG), i, file) != i))
+			ok = false;
+	}
+	pthread_mutex_unlock(&traceLock_G);
+
+	if (fclose(file) != 0)
+		ok = false;
+	if (!ok)
+		mcp23017_priv__log_errno(path_p);
+	return ok;
+}
+
+/**
+ * read a trace saved by mcp23017__trace_save()
+ * returns its records (free() them) and their number in 'cnt_p', or NULL
+ */
+Mcp23017TraceRec_t *
+mcp23017__trace_load (const char *path_p, unsigned *cnt_p)
+{
+	TraceFileHdr_t hdr;
+	Mcp23017TraceRec_t *recs_p = NULL;
+	FILE *file;
+
+	// preconds
+	if ((path_p == NULL) || (cnt_p == NULL))
+		return NULL;
+
+	file = fopen(path_p, "rb");
+	if (file == NULL) {
+		mcp23017_priv__set_error(NULL, errno, -1, -1);
+		return NULL;
+	}
+	if ((fread(&hdr, sizeof(hdr), 1, file) != 1) || (hdr.magic != TRACE_MAGIC)
+			|| (hdr.version != TRACE_VERSION) || (hdr.recSize != sizeof(*recs_p))) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		goto done;
+	}
+
+	recs_p = malloc((hdr.cnt > 0? hdr.cnt : 1) * sizeof(*recs_p));
+	if (recs_p == NULL) {
+		mcp23017_priv__set_error(NULL, ENOMEM, -1, -1);
+		goto done;
+	}
+	if (fread(recs_p, sizeof(*recs_p), hdr.cnt, file) != hdr.cnt) {
+		mcp23017_priv__set_error(NULL, EINVAL, -1, -1);
+		free(recs_p);
+		recs_p = NULL;
+		goto done;
+	}
+	*cnt_p = hdr.cnt;
+
+done:
+	fclose(file);
+	return recs_p;
+}
@@ -8,19 +8,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <getopt.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/ioctl.h>
-#include <linux/i2c.h>
-#include <linux/i2c-dev.h>
-#include <i2c/smbus.h>
-
-#include "mcp23017.h"
+#include <errno.h>
+#include <pthread.h>
+
+#include "mcp23017-private.h"
 #include "config.h"
 
+#define IOCON_BANK 0x80
+
 uint8_t IODIRA;
 uint8_t IODIRB;
 uint8_t GPIOA;
@@ -28,317 +23,787 @@ uint8_t GPIOB;
 uint8_t OLATA;
 uint8_t OLATB;
 
-static char *i2cDevice_pG = "/dev/i2c-1";
-static bool freeDeviceString_G = false;
-static uint8_t i2cAddr_G = 0x20;
-static int i2cFd_G = 0;
-static bool libInit_G = false;
+// the chip driven by the original (handle-less) API
+static Mcp23017_t *defaultDev_pG = NULL;
+static bool defaultCacheEnable_G = true;
+static bool atexitSet_G = false;
+
+static bool cache_fill (Mcp23017_t *dev_p);
+
+static Mcp23017_t *
+dev_open (const char *devFile_p, uint8_t i2cAddr, bool altRegAddr, bool cacheEnable)
+{
+	Mcp23017_t *dev_p;
+	uint8_t val;
+
+	// preconds
+	if (devFile_p == NULL)
+		return NULL;
+
+	dev_p = calloc(1, sizeof(*dev_p));
+	if (dev_p == NULL) {
+		mcp23017_priv__log_errno("calloc(dev)");
+		return NULL;
+	}
+	dev_p->addr = i2cAddr;
+	dev_p->cacheEnable = cacheEnable;
+	dev_p->irqFd = -1;
+
+	dev_p->bus_p = mcp23017_priv__bus_get(devFile_p);
+	if (dev_p->bus_p == NULL)
+		goto err1;
+
+	// set IOCON.BANK → 1
+	// assume initially bank is set to 0, meaning IOCON is at 0x0a/0x0b
+	if (altRegAddr) {
+		if (!mcp23017_priv__dev_read_byte(dev_p, 0x0a, &val))
+			goto err2;
+		val |= 0x80;
+		mcp23017_priv__dev_write_byte(dev_p, 0x0a, val);
+	}
+	dev_p->bank1 = altRegAddr;
+
+	if (dev_p->cacheEnable && !cache_fill(dev_p))
+		goto err2;
+
+	return dev_p;
+err2:
+	mcp23017_priv__bus_put(dev_p->bus_p);
+err1:
+	free(dev_p);
+	return NULL;
+}
+
+/**
+ * open the chip at 'i2cAddr' on adapter 'devFile_p'
+ * any number of chips, on any number of adapters, can be open at once;
+ * chips on the same adapter share its file descriptor
+ * if 'altRegAddr' is set the chip is switched to IOCON.BANK=1
+ */
+Mcp23017_t *
+mcp23017__open (const char *devFile_p, uint8_t i2cAddr, bool altRegAddr)
+{
+	return dev_open(devFile_p, i2cAddr, altRegAddr, true);
+}
 
 void
-mcp23017__cleanup (void)
+mcp23017__close (Mcp23017_t *dev_p)
 {
 	// preconds
-	if (!libInit_G)
+	if (dev_p == NULL)
 		return;
 
-	if (freeDeviceString_G)
-		free(i2cDevice_pG);
-	if (i2cFd_G > 0)
-		close(i2cFd_G);
+	mcp23017_priv__irq_release(dev_p);
+	mcp23017_priv__bus_put(dev_p->bus_p);
+	free(dev_p);
+}
 
-	libInit_G = false;
+/**
+ * the handle used by the handle-less API, NULL before mcp23017__init()
+ */
+Mcp23017_t *
+mcp23017__default_dev (void)
+{
+	return defaultDev_pG;
+}
+
+void
+mcp23017__cleanup (void)
+{
+	// preconds
+	if (defaultDev_pG == NULL)
+		return;
+
+	mcp23017__close(defaultDev_pG);
+	defaultDev_pG = NULL;
 }
 
 bool
 mcp23017__init (const char *devFile_p, uint8_t *i2cAddr_p, bool altRegAddr)
 {
 	int ret;
-	unsigned long funcs;
-	uint8_t val;
+	Mcp23017_t *dev_p;
 
 	// preconds
-	if (libInit_G)
+	if (defaultDev_pG != NULL)
 		return false;
 
-	// open i2c device
-	if (devFile_p != NULL) {
-		i2cDevice_pG = strdup(devFile_p);
-		if (i2cDevice_pG == NULL) {
-			perror("strdup on device filename");
-			return false;
-		}
-		freeDeviceString_G = true;
-	}
-	i2cFd_G = open(i2cDevice_pG, O_RDWR);
-	if (i2cFd_G < 0) {
-		perror("open(i2c device)");
+	dev_p = dev_open(devFile_p != NULL? devFile_p : "/dev/i2c-1",
+			i2cAddr_p != NULL? *i2cAddr_p : 0x20,
+			altRegAddr, defaultCacheEnable_G);
+	if (dev_p == NULL)
 		return false;
-	}
 
-	// check/verify i2c functionality on device
-	ret = ioctl(i2cFd_G, I2C_FUNCS, &funcs);
-	if (ret < 0) {
-		perror("can't get i2c functionality");
-		goto err1;
-	}
-	if (!(funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
-		fprintf(stderr, "I2C_FUNC_SMBUS_WRITE_BYTE_DATA not available\n");
-		goto err1;
-	}
-	if (!(funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
-		fprintf(stderr, "I2C_FUNC_SMBUS_READ_BYTE_DATA not available\n");
-		goto err1;
+	IODIRA = mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, PORTA);
+	IODIRB = mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, PORTB);
+	GPIOA = mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, PORTA);
+	GPIOB = mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, PORTB);
+	OLATA = mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTA);
+	OLATB = mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTB);
+
+	if (!atexitSet_G) {
+		ret = atexit(mcp23017__cleanup);
+		if (ret != 0)
+			mcp23017_priv__log_errno("atexit()");
+		else
+			atexitSet_G = true;
 	}
 
-	// set device
-	if (i2cAddr_p != NULL)
-		i2cAddr_G = *i2cAddr_p;
-	ret = ioctl(i2cFd_G, I2C_SLAVE, i2cAddr_G);
-	if (ret < 0) {
-		perror("can't set i2c slave address");
-		goto err1;
+	defaultDev_pG = dev_p;
+	return true;
+}
+
+/**
+ * any implemented register, in the handle's layout
+ */
+bool
+mcp23017_priv__is_reg_valid (Mcp23017_t *dev_p, uint8_t reg)
+{
+	if (dev_p->bank1) {
+		if (((reg & 0x0f) < MCP23017_REG_CNT) && (reg < 0x20))
+			return true;
 	}
+	else if (reg < 2 * MCP23017_REG_CNT)
+		return true;
 
-	// set IOCON.BANK → 1
-	// assume initially bank is set to 0, meaning IOCON is at 0x0a/0x0b
-	if (altRegAddr) {
-		ret = i2c_smbus_read_byte_data(i2cFd_G, 0x0a);
-		if (ret == -1)
+	mcp23017_priv__set_error(dev_p, EINVAL, reg, -1);
+	return false;
+}
+
+/**
+ * 'val' as it may be written to 'reg': an IOCON write keeps the BANK
+ * setting the handle was opened with, so the handle and its cache keep
+ * describing the chip's layout
+ */
+uint8_t
+mcp23017_priv__keep_bank (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	if ((reg != mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA))
+			&& (reg != mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTB)))
+		return val;
+	return (uint8_t)((val & ~IOCON_BANK) | (dev_p->bank1? IOCON_BANK : 0));
+}
+
+/**
+ * returns true if 'reg' holds state that only changes when we write it
+ * (i.e. everything except GPIO, INTF, INTCAP, and unimplemented addresses)
+ */
+static bool
+is_reg_cacheable (Mcp23017_t *dev_p, uint8_t reg)
+{
+	uint8_t idx;
+
+	if (dev_p->bank1) {
+		if ((reg & 0x0f) > 0x0a)
 			return false;
-		val = (uint8_t)ret;
-		val |= 0x80;
-		i2c_smbus_write_byte_data(i2cFd_G, 0x0a, val);
-
-		IODIRA = 0x00;
-		IODIRB = 0x10;
-		GPIOA = 0x09;
-		GPIOB = 0x19;
-		OLATA = 0x0a;
-		OLATB = 0x1a;
+		if (reg > 0x1a)
+			return false;
+		idx = reg & 0x0f;
 	}
 	else {
-		IODIRA = 0x00;
-		IODIRB = 0x01;
-		GPIOA = 0x12;
-		GPIOB = 0x13;
-		OLATA = 0x14;
-		OLATB = 0x15;
+		if (reg > 0x15)
+			return false;
+		idx = (uint8_t)(reg >> 1);
 	}
 
-	ret = atexit(mcp23017__cleanup);
-	if (ret != 0)
-		perror("atexit()");
+	if ((idx == MCP23017_INTF) || (idx == MCP23017_INTCAP) || (idx == MCP23017_GPIO))
+		return false;
+	return true;
+}
+
+void
+mcp23017_priv__cache_store (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	uint8_t ioconA = mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTA);
+	uint8_t ioconB = mcp23017_priv__reg_addr(dev_p, MCP23017_IOCON, PORTB);
+
+	if (!dev_p->cacheEnable)
+		return;
+	if (!is_reg_cacheable(dev_p, reg))
+		return;
+
+	// IOCON is one register visible at two addresses
+	if ((reg == ioconA) || (reg == ioconB)) {
+		dev_p->regCache[ioconA] = val;
+		dev_p->regCache[ioconB] = val;
+		dev_p->regCacheValid |= (1u << ioconA) | (1u << ioconB);
+		return;
+	}
+
+	dev_p->regCache[reg] = val;
+	dev_p->regCacheValid |= (1u << reg);
+}
 
-	libInit_G = true;
+bool
+mcp23017_priv__cache_lookup (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p)
+{
+	if (!dev_p->cacheEnable)
+		return false;
+	if ((dev_p->regCacheValid & (1u << reg)) == 0)
+		return false;
+	*val_p = dev_p->regCache[reg];
 	return true;
-err1:
-	close(i2cFd_G);
-	if (freeDeviceString_G)
-		free(i2cDevice_pG);
-	return false;
 }
 
 static bool
-is_reg_valid (uint8_t reg)
-{
-	if ((reg == IODIRA) |
-		(reg == IODIRB) |
-		(reg == GPIOA) |
-		(reg == GPIOB) |
-		(reg == OLATA) |
-		(reg == OLATB)) {
-		return true;
+cache_fill (Mcp23017_t *dev_p)
+{
+	uint8_t reg, val;
+
+	dev_p->regCacheValid = 0;
+	for (reg = 0; reg < 0x20; ++reg) {
+		if (!is_reg_cacheable(dev_p, reg))
+			continue;
+		if (!mcp23017_priv__dev_read_byte(dev_p, reg, &val)) {
+			mcp23017_priv__log_errno("cache_fill() read byte");
+			dev_p->regCacheValid = 0;
+			return false;
+		}
+		mcp23017_priv__cache_store(dev_p, reg, val);
 	}
 
-	fprintf(stderr, "invalid reg: 0x%02x\n", reg);
-	return false;
+	return true;
 }
 
-static bool
-set_ones (uint8_t reg, uint8_t val)
+/**
+ * re-read every cached register from the chip; use this if something other
+ * than this library (a hardware reset, another process) may have changed
+ * the chip's configuration
+ */
+bool
+mcp23017__dev_cache_resync (Mcp23017_t *dev_p)
 {
-	int32_t ret;
-	uint8_t newval;
+	bool ok;
 
-	if (!is_reg_valid(reg))
+	// preconds
+	if (dev_p == NULL)
 		return false;
-	if (val == 0)
+
+	if (!dev_p->cacheEnable)
 		return true;
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	ok = cache_fill(dev_p);
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
 
-	ret = i2c_smbus_read_byte_data(i2cFd_G, reg);
-	if (ret == -1) {
-		perror("set_ones() read byte");
+/**
+ * the register cache is on by default; with it off every read-modify-write
+ * goes to the chip (as it did before the cache existed)
+ */
+bool
+mcp23017__dev_cache_enable (Mcp23017_t *dev_p, bool enable)
+{
+	bool ok = true;
+
+	// preconds
+	if (dev_p == NULL)
 		return false;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!enable) {
+		dev_p->cacheEnable = false;
+		dev_p->regCacheValid = 0;
 	}
+	else if (!dev_p->cacheEnable) {
+		dev_p->cacheEnable = true;
+		ok = cache_fill(dev_p);
+	}
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
 
-	newval = (uint8_t)ret;
-	newval |= val;
+/**
+ * read a register, from the cache if possible
+ */
+bool
+mcp23017_priv__read_reg (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p)
+{
+	bool ok = true;
 
-	ret = i2c_smbus_write_byte_data(i2cFd_G, reg, newval);
-	if (ret != 0) {
-		perror("set_ones() write byte");
-		return false;
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__cache_lookup(dev_p, reg, val_p)) {
+		ok = mcp23017_priv__dev_read_byte(dev_p, reg, val_p);
+		if (ok)
+			mcp23017_priv__cache_store(dev_p, reg, *val_p);
 	}
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
 
-	return true;
+bool
+mcp23017_priv__write_reg (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	bool ok;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	ok = mcp23017_priv__dev_write_byte(dev_p, reg, val);
+	if (ok)
+		mcp23017_priv__cache_written(dev_p, reg, val);
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
 }
 
+/**
+ * update the cache after 'val' has been successfully written to 'reg'
+ */
+void
+mcp23017_priv__cache_written (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	// a write to GPIO lands in OLAT
+	if (reg == mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, PORTA))
+		reg = mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTA);
+	else if (reg == mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, PORTB))
+		reg = mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTB);
+	mcp23017_priv__cache_store(dev_p, reg, val);
+}
+
+/*
+ * the adapter stays locked from the read to the write, so concurrent
+ * updates of the same register can't lose each other's bits
+ */
 static bool
-set_zeros (uint8_t reg, uint8_t val)
+set_ones (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
 {
-	int32_t ret;
-	uint8_t newval;
+	uint8_t oldval, newval;
+	bool ok = true;
 
-	if (!is_reg_valid(reg))
+	if (!mcp23017_priv__is_reg_valid(dev_p, reg))
 		return false;
 	if (val == 0)
 		return true;
 
-	ret = i2c_smbus_read_byte_data(i2cFd_G, reg);
-	if (ret == -1) {
-		perror("set_zeros() read byte");
-		return false;
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, reg, &oldval)) {
+		ok = false;
+		goto done;
 	}
 
-	newval = (uint8_t)ret;
-	newval &= (uint8_t)(~(uint8_t)val);
+	newval = oldval | val;
+	if (dev_p->cacheEnable && (newval == oldval))
+		goto done;
 
-	ret = i2c_smbus_write_byte_data(i2cFd_G, reg, newval);
-	if (ret != 0) {
-		perror("set_zeros() write byte");
+	if (!mcp23017_priv__write_reg(dev_p, reg, newval))
+		ok = false;
+
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
+
+static bool
+set_zeros (Mcp23017_t *dev_p, uint8_t reg, uint8_t val)
+{
+	uint8_t oldval, newval;
+	bool ok = true;
+
+	if (!mcp23017_priv__is_reg_valid(dev_p, reg))
 		return false;
+	if (val == 0)
+		return true;
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	if (!mcp23017_priv__read_reg(dev_p, reg, &oldval)) {
+		ok = false;
+		goto done;
 	}
 
-	return true;
+	newval = oldval & (uint8_t)(~(uint8_t)val);
+	if (dev_p->cacheEnable && (newval == oldval))
+		goto done;
+
+	if (!mcp23017_priv__write_reg(dev_p, reg, newval))
+		ok = false;
+
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
 }
 
 /**
  * set to '1' any pins you want set as output
  */
 bool
-mcp23017__set_output_pins (uint8_t portAmask, uint8_t portBmask)
+mcp23017__dev_set_output_pins (Mcp23017_t *dev_p, uint8_t portAmask, uint8_t portBmask)
 {
 	// preconds
-	if (!libInit_G)
-		return false;
-	if (i2cFd_G <= 0)
+	if (dev_p == NULL)
 		return false;
 
-	if (!set_zeros(IODIRA, portAmask))
+	if (!set_zeros(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, PORTA), portAmask))
 		return false;
-	return set_zeros(IODIRB, portBmask);
+	return set_zeros(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, PORTB), portBmask);
 }
 
 /**
  * set to '1' any pins you want to set as input
  */
 bool
-mcp23017__set_input_pins (uint8_t portAmask, uint8_t portBmask)
+mcp23017__dev_set_input_pins (Mcp23017_t *dev_p, uint8_t portAmask, uint8_t portBmask)
 {
 	// preconds
-	if (!libInit_G)
-		return false;
-	if (i2cFd_G < 0)
+	if (dev_p == NULL)
 		return false;
 
-	if (!set_ones(IODIRA, portAmask))
+	if (!set_ones(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, PORTA), portAmask))
 		return false;
-	return set_ones(IODIRB, portBmask);
+	return set_ones(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, PORTB), portBmask);
+}
+
+/**
+ * apply new = (old & andMask) ^ xorMask to 'port's output latch
+ * updates of the same port from several threads are combined: whichever
+ * thread finds the port idle takes every update queued so far, folds them
+ * into one and/xor pair (in queue order) and does a single read-modify-write
+ * on everybody's behalf, the others just wait for their result
+ * an 'andMask' of 0 is a plain write, which needs no read
+ * must not be called with the adapter locked
+ */
+bool
+mcp23017_priv__port_update (Mcp23017_t *dev_p, Mcp23017Port_e port, uint8_t andMask, uint8_t xorMask)
+{
+	Mcp23017Bus_t *bus_p = dev_p->bus_p;
+	Mcp23017PortReq_t req, *req_p, *next_p, *list_p;
+	Mcp23017Error_t err;
+	uint8_t a, x, oldval, newval;
+	uint8_t olat = mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, port);
+	uint8_t gpio = mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, port);
+	bool ok;
+
+	req.andMask = andMask;
+	req.xorMask = xorMask;
+	req.done = false;
+	req.ok = false;
+	req.next_p = NULL;
+
+	pthread_mutex_lock(&bus_p->combLock);
+	if (dev_p->portReqTail_p[port] != NULL)
+		dev_p->portReqTail_p[port]->next_p = &req;
+	else
+		dev_p->portReq_p[port] = &req;
+	dev_p->portReqTail_p[port] = &req;
+
+	while (!req.done) {
+		if (dev_p->portBusy[port]) {
+			pthread_cond_wait(&bus_p->combCv, &bus_p->combLock);
+			continue;
+		}
+
+		// combine everything queued so far (which includes 'req')
+		dev_p->portBusy[port] = true;
+		list_p = dev_p->portReq_p[port];
+		dev_p->portReq_p[port] = NULL;
+		dev_p->portReqTail_p[port] = NULL;
+		pthread_mutex_unlock(&bus_p->combLock);
+
+		a = 0xff;
+		x = 0x00;
+		for (req_p = list_p; req_p != NULL; req_p = req_p->next_p) {
+			a &= req_p->andMask;
+			x = (uint8_t)((x & req_p->andMask) ^ req_p->xorMask);
+		}
+
+		mcp23017_priv__bus_lock(bus_p);
+		if (a == 0)
+			ok = mcp23017_priv__write_reg(dev_p, gpio, x);
+		else {
+			ok = mcp23017_priv__read_reg(dev_p, olat, &oldval);
+			if (ok) {
+				newval = (uint8_t)((oldval & a) ^ x);
+				if (!dev_p->cacheEnable || (newval != oldval))
+					ok = mcp23017_priv__write_reg(dev_p, gpio, newval);
+			}
+		}
+		mcp23017_priv__bus_unlock(bus_p);
+		if (!ok)
+			mcp23017__last_error(&err);
+
+		pthread_mutex_lock(&bus_p->combLock);
+		for (req_p = list_p; req_p != NULL; req_p = next_p) {
+			next_p = req_p->next_p;
+			req_p->ok = ok;
+			if (!ok)
+				req_p->err = err;
+			req_p->done = true;
+		}
+		dev_p->portBusy[port] = false;
+		pthread_cond_broadcast(&bus_p->combCv);
+	}
+	pthread_mutex_unlock(&bus_p->combLock);
+
+	// the transfer may have been done by another thread
+	if (!req.ok)
+		mcp23017_priv__set_error(dev_p, req.err.err, req.err.reg, req.err.xfer);
+	return req.ok;
 }
 
 static bool
-write_port (uint8_t reg, uint8_t val)
+write_port (Mcp23017_t *dev_p, Mcp23017Port_e port, uint8_t val)
 {
-	int32_t ret;
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	return mcp23017_priv__port_update(dev_p, port, 0x00, val);
+}
+
+bool
+mcp23017__dev_write_portA (Mcp23017_t *dev_p, uint8_t val)
+{
+	return write_port(dev_p, PORTA, val);
+}
+
+bool
+mcp23017__dev_write_portB (Mcp23017_t *dev_p, uint8_t val)
+{
+	return write_port(dev_p, PORTB, val);
+}
+
+/**
+ * always reads the chip; the value read also refreshes the cache
+ */
+bool
+mcp23017__dev_get_reg (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p)
+{
+	bool ok;
 
 	// preconds
-	if (!libInit_G)
+	if (dev_p == NULL)
 		return false;
-	if (i2cFd_G < 0)
+	if (!mcp23017_priv__is_reg_valid(dev_p, reg))
 		return false;
-	if (!is_reg_valid(reg))
+	if (val_p == NULL)
 		return false;
 
-	ret = i2c_smbus_write_byte_data(i2cFd_G, reg, val);
-	if (ret != 0)
-		return false;
-	return true;
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	ok = mcp23017_priv__dev_read_byte(dev_p, reg, val_p);
+	if (ok)
+		mcp23017_priv__cache_store(dev_p, reg, *val_p);
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
 }
 
 bool
-mcp23017__write_portA (uint8_t val)
+mcp23017__dev_get_portA (Mcp23017_t *dev_p, uint8_t *val_p)
 {
-	return write_port(GPIOA, val);
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	return mcp23017__dev_get_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, PORTA), val_p);
 }
 
 bool
-mcp23017__write_portB (uint8_t val)
+mcp23017__dev_get_portB (Mcp23017_t *dev_p, uint8_t *val_p)
+{
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	return mcp23017__dev_get_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_GPIO, PORTB), val_p);
+}
+
+/**
+ * fill 'xfer_p' with the GPIOA/GPIOB (or OLATA/OLATB) pair; with BANK=0 the
+ * two registers are adjacent so one run covers both (this also holds in
+ * byte mode, where the address pointer toggles between the A/B pair)
+ * returns the number of runs used
+ */
+unsigned
+mcp23017_priv__port16_xfer (Mcp23017_t *dev_p, Mcp23017Reg_e reg, bool read, uint8_t *buf_p, Mcp23017Xfer_t *xfer_p)
 {
-	return write_port(GPIOB, val);
+	xfer_p[0].addr = dev_p->addr;
+	xfer_p[0].reg = mcp23017_priv__reg_addr(dev_p, reg, PORTA);
+	xfer_p[0].read = read;
+	xfer_p[0].fixedReg = false;
+	xfer_p[0].noRetry = false;
+	xfer_p[0].buf_p = buf_p;
+	if (!dev_p->bank1) {
+		xfer_p[0].len = 2;
+		return 1;
+	}
+
+	xfer_p[0].len = 1;
+	xfer_p[1] = xfer_p[0];
+	xfer_p[1].reg = mcp23017_priv__reg_addr(dev_p, reg, PORTB);
+	xfer_p[1].buf_p = buf_p + 1;
+	return 2;
 }
 
+/**
+ * sample both ports in a single bus transaction
+ * port A is the low byte, port B the high byte
+ */
 bool
-mcp23017__get_reg (uint8_t reg, uint8_t *val_p)
+mcp23017__dev_read_port16 (Mcp23017_t *dev_p, uint16_t *val_p)
 {
-	int32_t ret;
+	uint8_t buf[2];
+	Mcp23017Xfer_t xfer[2];
+	unsigned cnt;
 
 	// preconds
-	if (!libInit_G)
-		return false;
-	if (i2cFd_G < 0)
-		return false;
-	if (!is_reg_valid(reg))
+	if (dev_p == NULL)
 		return false;
 	if (val_p == NULL)
 		return false;
 
-	ret = i2c_smbus_read_byte_data(i2cFd_G, reg);
-	if (ret == -1)
+	cnt = mcp23017_priv__port16_xfer(dev_p, MCP23017_GPIO, true, buf, xfer);
+	if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt))
 		return false;
-	*val_p = (uint8_t)ret;
+	*val_p = (uint16_t)(buf[0] | (buf[1] << 8));
 	return true;
 }
 
+/**
+ * update both ports in a single bus transaction
+ * port A is the low byte, port B the high byte
+ */
 bool
-mcp23017__get_portA (uint8_t *val_p)
+mcp23017__dev_write_port16 (Mcp23017_t *dev_p, uint16_t val)
 {
-	return mcp23017__get_reg(GPIOA, val_p);
+	uint8_t buf[2];
+	Mcp23017Xfer_t xfer[2];
+	unsigned cnt;
+	bool ok;
+
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	buf[0] = (uint8_t)(val & 0xff);
+	buf[1] = (uint8_t)(val >> 8);
+	cnt = mcp23017_priv__port16_xfer(dev_p, MCP23017_GPIO, false, buf, xfer);
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	ok = mcp23017_priv__dev_xfer(dev_p, xfer, cnt);
+	if (ok) {
+		mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTA), buf[0]);
+		mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTB), buf[1]);
+	}
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
 }
 
+/*
+ * apply new = (old & andMask) ^ xorMask to both output latches (port A in
+ * the low byte): a port that isn't affected isn't touched, a single port
+ * goes through mcp23017_priv__port_update(), and when both change the pair
+ * is read (unless cached or not needed) and written as one 16-bit run
+ */
+static bool
+update16 (Mcp23017_t *dev_p, uint16_t andMask, uint16_t xorMask)
+{
+	uint8_t a[2], x[2], old[2], buf[2];
+	Mcp23017Xfer_t xfer[2];
+	Mcp23017Port_e port;
+	unsigned cnt;
+	bool ok = false;
+
+	a[PORTA] = (uint8_t)(andMask & 0xff);
+	a[PORTB] = (uint8_t)(andMask >> 8);
+	x[PORTA] = (uint8_t)(xorMask & 0xff);
+	x[PORTB] = (uint8_t)(xorMask >> 8);
+
+	if ((a[PORTB] == 0xff) && (x[PORTB] == 0x00)) {
+		if ((a[PORTA] == 0xff) && (x[PORTA] == 0x00))
+			return true;
+		return mcp23017_priv__port_update(dev_p, PORTA, a[PORTA], x[PORTA]);
+	}
+	if ((a[PORTA] == 0xff) && (x[PORTA] == 0x00))
+		return mcp23017_priv__port_update(dev_p, PORTB, a[PORTB], x[PORTB]);
+
+	mcp23017_priv__bus_lock(dev_p->bus_p);
+	old[PORTA] = old[PORTB] = 0;
+	if (andMask != 0) {
+		if (!mcp23017_priv__cache_lookup(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTA), &old[PORTA]) ||
+				!mcp23017_priv__cache_lookup(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, PORTB), &old[PORTB])) {
+			cnt = mcp23017_priv__port16_xfer(dev_p, MCP23017_OLAT, true, old, xfer);
+			if (!mcp23017_priv__dev_xfer(dev_p, xfer, cnt))
+				goto done;
+			for (port = PORTA; port <= PORTB; ++port)
+				mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, port), old[port]);
+		}
+	}
+
+	for (port = PORTA; port <= PORTB; ++port)
+		buf[port] = (uint8_t)((old[port] & a[port]) ^ x[port]);
+	if (dev_p->cacheEnable && (andMask != 0) && (buf[PORTA] == old[PORTA]) && (buf[PORTB] == old[PORTB])) {
+		ok = true;
+		goto done;
+	}
+
+	cnt = mcp23017_priv__port16_xfer(dev_p, MCP23017_GPIO, false, buf, xfer);
+	ok = mcp23017_priv__dev_xfer(dev_p, xfer, cnt);
+	if (!ok)
+		goto done;
+	for (port = PORTA; port <= PORTB; ++port)
+		mcp23017_priv__cache_store(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_OLAT, port), buf[port]);
+
+done:
+	mcp23017_priv__bus_unlock(dev_p->bus_p);
+	return ok;
+}
+
+/**
+ * drive the pins in 'setMask' high and those in 'clrMask' low (setMask
+ * wins where both are given), all in one write per affected port, or one
+ * 16-bit write if both ports change; port A is the low byte
+ * pins that are inputs only have their output latch changed
+ */
 bool
-mcp23017__get_portB (uint8_t *val_p)
+mcp23017__dev_modify (Mcp23017_t *dev_p, uint16_t setMask, uint16_t clrMask)
 {
-	return mcp23017__get_reg(GPIOB, val_p);
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	return update16(dev_p, (uint16_t)~(setMask | clrMask), setMask);
+}
+
+/**
+ * invert the pins in 'mask', see mcp23017__dev_modify()
+ */
+bool
+mcp23017__dev_toggle (Mcp23017_t *dev_p, uint16_t mask)
+{
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	return update16(dev_p, 0xffff, mask);
+}
+
+/**
+ * set the pins in 'mask' to their bit in 'val', leaving the others alone,
+ * see mcp23017__dev_modify()
+ */
+bool
+mcp23017__dev_write_masked (Mcp23017_t *dev_p, uint16_t mask, uint16_t val)
+{
+	// preconds
+	if (dev_p == NULL)
+		return false;
+
+	return update16(dev_p, (uint16_t)~mask, (uint16_t)(val & mask));
 }
 
 static bool
-is_output_bit (Mcp23017Bit_e bit)
+is_output_bit (Mcp23017_t *dev_p, Mcp23017Bit_e bit)
 {
 	uint8_t val;
 	uint8_t mask;
+	Mcp23017Port_e port;
 
-	if (!libInit_G)
-		return false;
-	if (i2cFd_G < 0)
-		return false;
 	if ((bit <= INVALID) || (bit >= END))
 		return false;
 
-	if (bit < GPB0) {
-		if (!mcp23017__get_reg(IODIRA, &val))
-			return false;
-		mask = 1 << (bit - GPA0);
-	}
-	else {
-		if (!mcp23017__get_reg(IODIRB, &val))
-			return false;
-		mask = 1 < (bit - GPB0);
-	}
+	port = (bit < GPB0)? PORTA : PORTB;
+	if (!mcp23017_priv__read_reg(dev_p, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, port), &val))
+		return false;
+	mask = (uint8_t)(1 << ((bit - GPA0) % 8));
 
 	// output bits are 0
 	if ((mask & val) != 0) {
-		fprintf(stderr, "bit %d is not an output (mask:0x%02x val:0x%02x)\n",
-				bit, mask, val);
+		mcp23017_priv__set_error(dev_p, EINVAL, mcp23017_priv__reg_addr(dev_p, MCP23017_IODIR, port), -1);
 		return false;
 	}
 
@@ -346,95 +811,152 @@ is_output_bit (Mcp23017Bit_e bit)
 }
 
 bool
-mcp23017__set_bit (Mcp23017Bit_e bit)
+mcp23017__dev_set_bit (Mcp23017_t *dev_p, Mcp23017Bit_e bit)
 {
-	uint8_t val;
-	uint8_t mask = 0;
+	uint8_t mask;
+	Mcp23017Port_e port;
 
 	// preconds
-	if (!libInit_G)
-		return false;
-	if (i2cFd_G < 0)
+	if (dev_p == NULL)
 		return false;
 	if ((bit <= INVALID) || (bit >= END))
 		return false;
 
 	// check if direction bit is output
-	if (!is_output_bit(bit))
+	if (!is_output_bit(dev_p, bit))
 		return false;
 
 	// set bit
-	if (bit < GPB0) {
-		if (!mcp23017__get_reg(OLATA, &val)) {
-			fprintf(stderr, "set_bit(): can't get olatA\n");
-			return false;
-		}
-		mask = 1 << (bit - GPA0);
-		val |= mask;
-		if (!mcp23017__write_portA(val)) {
-			fprintf(stderr, "set_bit(): can't write portA\n");
-			return false;
-		}
-	}
-	else {
-		if (!mcp23017__get_reg(OLATB, &val)) {
-			fprintf(stderr, "set_bit(): can't get olatB\n");
-			return false;
-		}
-		mask = 1 << (bit - GPB0);
-		val |= mask;
-		if (!mcp23017__write_portB(val)) {
-			fprintf(stderr, "set_bit(): can't write portB\n");
-			return false;
-		}
-	}
-
-	return true;
+	port = (bit < GPB0)? PORTA : PORTB;
+	mask = (uint8_t)(1 << ((bit - GPA0) % 8));
+	return mcp23017_priv__port_update(dev_p, port, (uint8_t)~mask, mask);
 }
 
 bool
-mcp23017__clear_bit (Mcp23017Bit_e bit)
+mcp23017__dev_clear_bit (Mcp23017_t *dev_p, Mcp23017Bit_e bit)
 {
-	uint8_t val;
 	uint8_t mask;
+	Mcp23017Port_e port;
 
 	// preconds
-	if (!libInit_G)
-		return false;
-	if (i2cFd_G < 0)
+	if (dev_p == NULL)
 		return false;
 	if ((bit <= INVALID) || (bit >= END))
 		return false;
 
 	// check if direction is output
-	if (!is_output_bit(bit))
+	if (!is_output_bit(dev_p, bit))
 		return false;
 
 	// clear bit
-	if (bit < GPB0) {
-		if (!mcp23017__get_reg(OLATA, &val)) {
-			fprintf(stderr, "clear_bit(): can't get olatA\n");
-			return false;
-		}
-		mask = (uint8_t)~(1 << (bit - GPA0));
-		val &= mask;
-		if (!mcp23017__write_portA(val)) {
-			fprintf(stderr, "clear_bit(): can't write portA\n");
-			return false;
-		}
-	}
-	else {
-		if (!mcp23017__get_reg(OLATB, &val)) {
-			fprintf(stderr, "clear_bit(): can't get olatB\n");
-			return false;
-		}
-		mask = (uint8_t)~(1 << (bit - GPB0));
-		val &= mask;
-		if (!mcp23017__write_portB(val)) {
-			fprintf(stderr, "clear_bit(): can't write portB\n");
-			return false;
-		}
+	port = (bit < GPB0)? PORTA : PORTB;
+	mask = (uint8_t)(1 << ((bit - GPA0) % 8));
+	return mcp23017_priv__port_update(dev_p, port, (uint8_t)~mask, 0x00);
+}
+
+/*
+ * handle-less API, operating on the default handle created by mcp23017__init()
+ */
+
+bool
+mcp23017__set_output_pins (uint8_t portAmask, uint8_t portBmask)
+{
+	return mcp23017__dev_set_output_pins(defaultDev_pG, portAmask, portBmask);
+}
+
+bool
+mcp23017__set_input_pins (uint8_t portAmask, uint8_t portBmask)
+{
+	return mcp23017__dev_set_input_pins(defaultDev_pG, portAmask, portBmask);
+}
+
+bool
+mcp23017__write_portA (uint8_t val)
+{
+	return mcp23017__dev_write_portA(defaultDev_pG, val);
+}
+
+bool
+mcp23017__write_portB (uint8_t val)
+{
+	return mcp23017__dev_write_portB(defaultDev_pG, val);
+}
+
+bool
+mcp23017__get_reg (uint8_t reg, uint8_t *val_p)
+{
+	return mcp23017__dev_get_reg(defaultDev_pG, reg, val_p);
+}
+
+bool
+mcp23017__get_portA (uint8_t *val_p)
+{
+	return mcp23017__dev_get_portA(defaultDev_pG, val_p);
+}
+
+bool
+mcp23017__get_portB (uint8_t *val_p)
+{
+	return mcp23017__dev_get_portB(defaultDev_pG, val_p);
+}
+
+bool
+mcp23017__read_port16 (uint16_t *val_p)
+{
+	return mcp23017__dev_read_port16(defaultDev_pG, val_p);
+}
+
+bool
+mcp23017__write_port16 (uint16_t val)
+{
+	return mcp23017__dev_write_port16(defaultDev_pG, val);
+}
+
+bool
+mcp23017__modify (uint16_t setMask, uint16_t clrMask)
+{
+	return mcp23017__dev_modify(defaultDev_pG, setMask, clrMask);
+}
+
+bool
+mcp23017__toggle (uint16_t mask)
+{
+	return mcp23017__dev_toggle(defaultDev_pG, mask);
+}
+
+bool
+mcp23017__write_masked (uint16_t mask, uint16_t val)
+{
+	return mcp23017__dev_write_masked(defaultDev_pG, mask, val);
+}
+
+bool
+mcp23017__set_bit (Mcp23017Bit_e bit)
+{
+	return mcp23017__dev_set_bit(defaultDev_pG, bit);
+}
+
+bool
+mcp23017__clear_bit (Mcp23017Bit_e bit)
+{
+	return mcp23017__dev_clear_bit(defaultDev_pG, bit);
+}
+
+bool
+mcp23017__cache_resync (void)
+{
+	return mcp23017__dev_cache_resync(defaultDev_pG);
+}
+
+bool
+mcp23017__cache_enable (bool enable)
+{
+	// before init this only sets the default for the handle init creates
+	if (defaultDev_pG == NULL) {
+		defaultCacheEnable_G = enable;
+		return true;
 	}
 
-	return true;
+	defaultCacheEnable_G = enable;
+	return mcp23017__dev_cache_enable(defaultDev_pG, enable);
 }
@@ -8,6 +8,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 
 typedef enum {
 	INVALID,
@@ -16,6 +18,356 @@ typedef enum {
 	END
 } Mcp23017Bit_e;
 
+typedef enum {
+	PORTA,
+	PORTB,
+} Mcp23017Port_e;
+
+// register index within a port; the address depends on IOCON.BANK
+typedef enum {
+	MCP23017_IODIR,
+	MCP23017_IPOL,
+	MCP23017_GPINTEN,
+	MCP23017_DEFVAL,
+	MCP23017_INTCON,
+	MCP23017_IOCON,
+	MCP23017_GPPU,
+	MCP23017_INTF,
+	MCP23017_INTCAP,
+	MCP23017_GPIO,
+	MCP23017_OLAT,
+	MCP23017_REG_CNT
+} Mcp23017Reg_e;
+
+// device path prefixes selecting the in-process simulator, e.g. "sim://bench",
+// reached either directly or through the MCP23S17 SPI framing
+// ("/dev/spidevB.C" selects a real MCP23S17 chip select)
+#define MCP23017_SIM_PREFIX "sim://"
+#define MCP23017_SPI_SIM_PREFIX "spi+sim://"
+
+// one chip (handle-based API)
+typedef struct Mcp23017_s Mcp23017_t;
+
+Mcp23017_t *mcp23017__open (const char *devFile_p, uint8_t i2cAddr, bool altRegAddr);
+void mcp23017__close (Mcp23017_t *dev_p);
+Mcp23017_t *mcp23017__default_dev (void);
+bool mcp23017__dev_set_output_pins (Mcp23017_t *dev_p, uint8_t portAmask, uint8_t portBmask);
+bool mcp23017__dev_set_input_pins (Mcp23017_t *dev_p, uint8_t portAmask, uint8_t portBmask);
+bool mcp23017__dev_write_portA (Mcp23017_t *dev_p, uint8_t val);
+bool mcp23017__dev_write_portB (Mcp23017_t *dev_p, uint8_t val);
+bool mcp23017__dev_get_reg (Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p);
+bool mcp23017__dev_get_portA (Mcp23017_t *dev_p, uint8_t *val_p);
+bool mcp23017__dev_get_portB (Mcp23017_t *dev_p, uint8_t *val_p);
+bool mcp23017__dev_read_port16 (Mcp23017_t *dev_p, uint16_t *val_p);
+bool mcp23017__dev_write_port16 (Mcp23017_t *dev_p, uint16_t val);
+bool mcp23017__dev_modify (Mcp23017_t *dev_p, uint16_t setMask, uint16_t clrMask);
+bool mcp23017__dev_toggle (Mcp23017_t *dev_p, uint16_t mask);
+bool mcp23017__dev_write_masked (Mcp23017_t *dev_p, uint16_t mask, uint16_t val);
+bool mcp23017__dev_set_bit (Mcp23017_t *dev_p, Mcp23017Bit_e bit);
+bool mcp23017__dev_clear_bit (Mcp23017_t *dev_p, Mcp23017Bit_e bit);
+bool mcp23017__dev_cache_enable (Mcp23017_t *dev_p, bool enable);
+bool mcp23017__dev_cache_resync (Mcp23017_t *dev_p);
+
+// errors: the details of a failed call, kept per thread (like errno)
+typedef struct {
+	int err;                // errno value
+	Mcp23017_t *dev_p;      // chip involved, if any
+	int reg;                // register address involved, -1 if none
+	int xfer;               // failed run within its bus transfer, -1 if none
+} Mcp23017Error_t;
+
+// messages the library would otherwise print to stderr
+typedef void (*Mcp23017LogCb_t) (const char *msg_p, void *arg_p);
+
+bool mcp23017__last_error (Mcp23017Error_t *err_p);
+void mcp23017__set_log (Mcp23017LogCb_t cb, void *arg_p);
+bool mcp23017__dev_set_retry (Mcp23017_t *dev_p, unsigned retries, unsigned backoffUs);
+
+// batched register access
+typedef struct Mcp23017Batch_s Mcp23017Batch_t;
+
+Mcp23017Batch_t *mcp23017__batch_new (void);
+void mcp23017__batch_free (Mcp23017Batch_t *batch_p);
+void mcp23017__batch_reset (Mcp23017Batch_t *batch_p);
+unsigned mcp23017__batch_count (const Mcp23017Batch_t *batch_p);
+int mcp23017__batch_add_write (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, uint8_t val);
+int mcp23017__batch_add_read (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, uint8_t *val_p);
+int mcp23017__batch_add_raw (Mcp23017Batch_t *batch_p, Mcp23017_t *dev_p, uint8_t reg, bool read, bool fixedReg, uint8_t *buf_p, uint16_t len);
+bool mcp23017__batch_submit (Mcp23017Batch_t *batch_p);
+int mcp23017__batch_result (const Mcp23017Batch_t *batch_p, unsigned idx);
+
+// interrupt-on-change
+typedef enum {
+	MCP23017_IRQ_NONE,      // pin doesn't interrupt
+	MCP23017_IRQ_CHANGE,    // any change from the previous level
+	MCP23017_IRQ_COMPARE,   // level differs from DEFVAL
+} Mcp23017IrqMode_e;
+
+typedef struct {
+	Mcp23017Bit_e pin;
+	bool level;             // pin level latched in INTCAP
+	struct timespec ts;     // CLOCK_MONOTONIC time of the INT edge
+} Mcp23017Event_t;
+
+// events one interrupt can produce (one per pin); the most irq_read_events()
+// and irq_wait() may have to store
+#define MCP23017_IRQ_EVENTS_MAX 16
+
+bool mcp23017__irq_config_pins (Mcp23017_t *dev_p, uint16_t pins, Mcp23017IrqMode_e mode, uint16_t defval);
+bool mcp23017__irq_config_output (Mcp23017_t *dev_p, bool mirror, bool openDrain, bool activeHigh);
+bool mcp23017__irq_attach_gpio (Mcp23017_t *dev_p, const char *chip_p, unsigned line);
+bool mcp23017__irq_attach_fd (Mcp23017_t *dev_p, int fd);
+int mcp23017__irq_fd (Mcp23017_t *dev_p);
+int mcp23017__irq_read_events (Mcp23017_t *dev_p, Mcp23017Event_t *events_p, unsigned max);
+int mcp23017__irq_wait (Mcp23017_t *dev_p, int timeoutMs, Mcp23017Event_t *events_p, unsigned max);
+
+// per-chip transfer statistics (configure --disable-stats removes them)
+#define MCP23017_STATS_BUCKETS 32
+
+typedef struct {
+	uint64_t reads;         // register runs read
+	uint64_t writes;        // register runs written
+	uint64_t bytes;         // register bytes moved
+	uint64_t errors;        // runs that failed
+	uint64_t retries;       // extra attempts made by the transport
+	// latency[i]: transfers taking [2^i, 2^(i+1)) ns, the last bucket
+	// also holds everything slower
+	uint64_t latency[MCP23017_STATS_BUCKETS];
+} Mcp23017Stats_t;
+
+bool mcp23017__stats_get (Mcp23017_t *dev_p, Mcp23017Stats_t *stats_p);
+bool mcp23017__stats_reset (Mcp23017_t *dev_p);
+
+// the whole register file, independent of the IOCON.BANK layout
+typedef struct {
+	uint8_t regs[MCP23017_REG_CNT][2];      // [Mcp23017Reg_e][Mcp23017Port_e]
+} Mcp23017Snapshot_t;
+
+bool mcp23017__dev_snapshot (Mcp23017_t *dev_p, Mcp23017Snapshot_t *snap_p);
+bool mcp23017__dev_restore (Mcp23017_t *dev_p, const Mcp23017Snapshot_t *snap_p);
+
+// declarative pin configuration
+typedef struct {
+	bool output;
+	bool pullUp;            // GPPU (inputs)
+	bool invert;            // IPOL (inputs)
+	Mcp23017IrqMode_e irq;
+	bool defval;            // level compared against with MCP23017_IRQ_COMPARE
+	bool level;             // output level (OLAT)
+} Mcp23017PinConfig_t;
+
+typedef struct {
+	Mcp23017PinConfig_t pins[16];   // GPA0..GPA7, GPB0..GPB7
+} Mcp23017Config_t;
+
+bool mcp23017__dev_config_get (Mcp23017_t *dev_p, Mcp23017Config_t *cfg_p);
+bool mcp23017__dev_config_apply (Mcp23017_t *dev_p, const Mcp23017Config_t *cfg_p);
+
+// burst output (see mcp23017__dev_burst_write())
+typedef enum {
+	MCP23017_BURST_PORTA,
+	MCP23017_BURST_PORTB,
+	MCP23017_BURST_PORTAB,  // buffer holds A, B, A, B, ...
+} Mcp23017Burst_e;
+
+bool mcp23017__dev_burst_write (Mcp23017_t *dev_p, Mcp23017Burst_e mode, const uint8_t *buf_p, size_t len);
+
+// continuous input sampling
+typedef enum {
+	MCP23017_SAMPLE_PORTA,
+	MCP23017_SAMPLE_PORTB,
+	MCP23017_SAMPLE_PORTAB,
+} Mcp23017SamplePorts_e;
+
+typedef struct {
+	uint64_t ts;            // CLOCK_MONOTONIC ns (interpolated)
+	uint16_t val;           // port A in the low byte, port B in the high byte
+} Mcp23017Sample_t;
+
+typedef struct {
+	uint64_t samples;       // delivered to the ring
+	uint64_t overruns;      // dropped because the ring was full
+	uint64_t reads;         // bus reads issued
+	uint64_t errors;        // failed reads
+	double rateHz;          // samples (delivered or dropped) per second
+} Mcp23017SamplerStats_t;
+
+typedef struct Mcp23017Sampler_s Mcp23017Sampler_t;
+
+Mcp23017Sampler_t *mcp23017__sampler_start (Mcp23017_t *dev_p, Mcp23017SamplePorts_e ports, unsigned ringSize, unsigned runLen);
+void mcp23017__sampler_stop (Mcp23017Sampler_t *smp_p);
+unsigned mcp23017__sampler_peek (Mcp23017Sampler_t *smp_p, const Mcp23017Sample_t **samples_pp, unsigned max);
+void mcp23017__sampler_release (Mcp23017Sampler_t *smp_p, unsigned cnt);
+bool mcp23017__sampler_get_stats (Mcp23017Sampler_t *smp_p, Mcp23017SamplerStats_t *stats_p);
+
+// polling scheduler: periodic reads of many chips, batched per adapter
+typedef void (*Mcp23017SchedCb_t) (Mcp23017_t *dev_p, bool ok, uint16_t val, void *arg_p);
+
+typedef struct {
+	uint64_t polls;
+	uint64_t misses;        // reads completed after the next period began
+	uint64_t errors;
+	uint64_t maxLateNs;     // worst time from due to completion
+	double utilisation;     // fraction of time the adapter spent polling
+} Mcp23017SchedStats_t;
+
+typedef struct Mcp23017Sched_s Mcp23017Sched_t;
+
+Mcp23017Sched_t *mcp23017__sched_start (void);
+void mcp23017__sched_stop (Mcp23017Sched_t *sched_p);
+int mcp23017__sched_add (Mcp23017Sched_t *sched_p, Mcp23017_t *dev_p, Mcp23017SamplePorts_e ports,
+		uint32_t periodUs, unsigned priority, Mcp23017SchedCb_t cb, void *cbArg_p);
+bool mcp23017__sched_remove (Mcp23017Sched_t *sched_p, int id);
+bool mcp23017__sched_get_stats (Mcp23017Sched_t *sched_p, int id, Mcp23017SchedStats_t *stats_p);
+bool mcp23017__sched_reset_stats (Mcp23017Sched_t *sched_p);
+
+// asynchronous operation: one worker thread per adapter executes requests
+// taken from a lock-free submission ring
+typedef enum {
+	MCP23017_ASYNC_READ_REG,
+	MCP23017_ASYNC_WRITE_REG,
+	MCP23017_ASYNC_READ_PORT16,
+	MCP23017_ASYNC_WRITE_PORT16,
+	MCP23017_ASYNC_SET_BIT,
+	MCP23017_ASYNC_CLEAR_BIT,
+} Mcp23017AsyncOp_e;
+
+typedef struct {
+	Mcp23017_t *dev_p;
+	Mcp23017AsyncOp_e op;
+	uint64_t tag;           // as given in the request
+	int result;             // 0 or -errno
+	uint16_t val;           // value read (READ_REG, READ_PORT16)
+} Mcp23017Completion_t;
+
+// called on the adapter's worker thread
+typedef void (*Mcp23017AsyncCb_t) (const Mcp23017Completion_t *comp_p, void *arg_p);
+
+typedef struct {
+	Mcp23017AsyncOp_e op;
+	uint8_t reg;            // READ_REG, WRITE_REG
+	Mcp23017Bit_e bit;      // SET_BIT, CLEAR_BIT
+	uint16_t val;           // WRITE_REG (low byte, IOCON keeps its BANK bit), WRITE_PORT16
+	uint64_t tag;
+	Mcp23017AsyncCb_t cb;   // NULL: completion goes to the completion ring
+	void *cbArg_p;
+} Mcp23017AsyncReq_t;
+
+bool mcp23017__async_start (Mcp23017_t *dev_p, unsigned depth);
+void mcp23017__async_stop (Mcp23017_t *dev_p);
+bool mcp23017__async_submit (Mcp23017_t *dev_p, const Mcp23017AsyncReq_t *req_p);
+int mcp23017__async_fd (Mcp23017_t *dev_p);
+int mcp23017__async_reap (Mcp23017_t *dev_p, Mcp23017Completion_t *comp_p, unsigned max);
+
+// bus groups: chips on several adapters, one pinned worker per adapter,
+// with fan-out across all of them
+typedef struct Mcp23017Group_s Mcp23017Group_t;
+
+Mcp23017Group_t *mcp23017__group_new (const int *cpus_p, unsigned cpuCnt);
+void mcp23017__group_free (Mcp23017Group_t *grp_p);
+int mcp23017__group_add (Mcp23017Group_t *grp_p, Mcp23017_t *dev_p);
+unsigned mcp23017__group_count (const Mcp23017Group_t *grp_p);
+bool mcp23017__group_submit (Mcp23017Group_t *grp_p, const Mcp23017AsyncReq_t *req_p, Mcp23017Completion_t *comp_p);
+bool mcp23017__group_write_port16 (Mcp23017Group_t *grp_p, uint16_t val);
+bool mcp23017__group_read_port16 (Mcp23017Group_t *grp_p, uint16_t *vals_p);
+
+// transaction tracing: every register run the library puts on a bus, kept
+// in a ring (oldest runs dropped) and savable to a file for mcp23017replay
+// a run's data takes one record per MCP23017_TRACE_DATA bytes: its first
+// record, then records flagged MCP23017_TRACE_CONT carrying the rest
+#define MCP23017_TRACE_READ 0x01        // run read from the chip
+#define MCP23017_TRACE_FIRST 0x02       // first run of a bus transfer
+#define MCP23017_TRACE_FIXED 0x04       // every byte went to/from 'reg'
+#define MCP23017_TRACE_CONT 0x08        // more data of the preceding record's run
+#define MCP23017_TRACE_TRUNC 0x10       // run too long for the ring, data cut short
+#define MCP23017_TRACE_DATA 12
+
+typedef struct {
+	uint64_t ts;            // CLOCK_MONOTONIC ns when the transfer started
+	uint32_t durNs;         // how long the whole transfer took, retries included
+	uint16_t len;           // bytes in the run
+	int16_t result;         // 0 or -errno, after any retries
+	uint8_t bus;            // adapter, numbered in the order they were opened
+	uint8_t addr;           // I2C address
+	uint8_t reg;            // first register address
+	uint8_t flags;          // MCP23017_TRACE_...
+	uint8_t data[MCP23017_TRACE_DATA];      // this record's share of the run's bytes
+} Mcp23017TraceRec_t;
+
+bool mcp23017__trace_start (unsigned recCnt);
+void mcp23017__trace_stop (void);
+unsigned mcp23017__trace_read (Mcp23017TraceRec_t *recs_p, unsigned max);
+uint64_t mcp23017__trace_dropped (void);
+bool mcp23017__trace_save (const char *path_p);
+Mcp23017TraceRec_t *mcp23017__trace_load (const char *path_p, unsigned *cnt_p);
+
+// shared-memory mirror of input state: one publisher, any number of
+// readers (in any process) that read it without syscalls or bus traffic
+typedef struct {
+	uint16_t gpio;          // last reading, port A in the low byte
+	uint16_t intcap;        // level of each pin at its last interrupt
+	uint16_t intf;          // pins that caused the last interrupt
+	uint64_t gpioTs;        // CLOCK_MONOTONIC ns of 'gpio', 0 if never
+	uint64_t intcapTs;      // CLOCK_MONOTONIC ns of the last interrupt, 0 if never
+} Mcp23017MirrorState_t;
+
+typedef struct Mcp23017Mirror_s Mcp23017Mirror_t;
+
+Mcp23017Mirror_t *mcp23017__mirror_create (const char *path_p, unsigned chipCnt);
+Mcp23017Mirror_t *mcp23017__mirror_open (const char *path_p);
+void mcp23017__mirror_close (Mcp23017Mirror_t *mirror_p);
+unsigned mcp23017__mirror_count (const Mcp23017Mirror_t *mirror_p);
+bool mcp23017__mirror_publish (Mcp23017Mirror_t *mirror_p, unsigned idx, uint16_t gpio);
+bool mcp23017__mirror_publish_events (Mcp23017Mirror_t *mirror_p, unsigned idx, const Mcp23017Event_t *events_p, unsigned cnt);
+bool mcp23017__mirror_poll (Mcp23017Mirror_t *mirror_p, unsigned idx, Mcp23017_t *dev_p);
+bool mcp23017__mirror_read (const Mcp23017Mirror_t *mirror_p, unsigned idx, Mcp23017MirrorState_t *state_p);
+
+// real-time mode: locked, prefaulted memory, SCHED_FIFO library threads and
+// no stdio from the library; transfers on opened chips don't allocate
+#define MCP23017_RT_DEFAULT_PRIO 80
+
+typedef struct {
+	int priority;           // SCHED_FIFO priority of the library's threads, 0 leaves them alone
+	int cpu;                // CPU they (and rt_thread_setup() callers) run on, -1 for any
+	size_t stackBytes;      // stack prefaulted per thread (up to 1MiB)
+	size_t heapBytes;       // heap prefaulted and kept by the allocator
+	bool noDeepIdle;        // keep CPUs out of slow-to-leave idle states
+} Mcp23017RtConfig_t;
+
+typedef struct {
+	uint64_t cycles;
+	uint64_t overruns;      // cycles that completed after the next one was due
+	uint64_t errors;        // failed transfers
+	uint64_t wakeMaxNs;     // worst time from due to the thread running
+	uint64_t xferMaxNs;     // worst transfer time
+	uint64_t maxNs;         // worst time from due to completion
+	uint64_t meanNs;        // mean time from due to completion
+	// latency[i]: cycles completing [2^i, 2^(i+1)) ns after they were due
+	uint64_t latency[MCP23017_STATS_BUCKETS];
+} Mcp23017Jitter_t;
+
+bool mcp23017__rt_enable (const Mcp23017RtConfig_t *cfg_p);
+void mcp23017__rt_disable (void);
+bool mcp23017__rt_thread_setup (void);
+bool mcp23017__rt_measure (Mcp23017_t *dev_p, unsigned cycles, uint32_t periodUs, Mcp23017Jitter_t *jit_p);
+
+// simulator (device path MCP23017_SIM_PREFIX...)
+typedef struct {
+	uint64_t transactions;  // start ... stop
+	uint64_t bytes;         // on the wire, including address/register bytes
+	uint64_t busNs;         // modelled bus time
+} Mcp23017SimStats_t;
+
+bool mcp23017__sim_set_latency (Mcp23017_t *dev_p, uint32_t txnNs, uint32_t byteNs, bool sleep);
+bool mcp23017__sim_get_stats (Mcp23017_t *dev_p, Mcp23017SimStats_t *stats_p);
+bool mcp23017__sim_reset_stats (Mcp23017_t *dev_p);
+bool mcp23017__sim_drive_pins (Mcp23017_t *dev_p, uint16_t mask, uint16_t levels);
+bool mcp23017__sim_loopback (Mcp23017_t *dev_p, bool enable);
+bool mcp23017__sim_reset (Mcp23017_t *dev_p);
+bool mcp23017__sim_inject_faults (Mcp23017_t *dev_p, unsigned cnt, int err);
+int mcp23017__sim_int_fd (Mcp23017_t *dev_p);
+
+// handle-less API, drives the chip given to mcp23017__init()
 bool mcp23017__init (const char *devFile_p, uint8_t *i2cAddr_p, bool atlRegAddr);
 void mcp23017__cleanup (void);
 bool mcp23017__set_output_pins (uint8_t portAmask, uint8_t portBmask);
@@ -25,7 +377,14 @@ bool mcp23017__write_portB (uint8_t val);
 bool mcp23017__get_reg (uint8_t reg, uint8_t *val_p);
 bool mcp23017__get_portA (uint8_t *val_p);
 bool mcp23017__get_portB (uint8_t *val_p);
+bool mcp23017__read_port16 (uint16_t *val_p);
+bool mcp23017__write_port16 (uint16_t val);
+bool mcp23017__modify (uint16_t setMask, uint16_t clrMask);
+bool mcp23017__toggle (uint16_t mask);
+bool mcp23017__write_masked (uint16_t mask, uint16_t val);
 bool mcp23017__set_bit (Mcp23017Bit_e bit);
 bool mcp23017__clear_bit (Mcp23017Bit_e bit);
+bool mcp23017__cache_enable (bool enable);
+bool mcp23017__cache_resync (void);
 
 #endif
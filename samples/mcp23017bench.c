@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * run each public operation many times and report what it costs:
+ * bus transactions per op (simulator only), modelled bus time per op
+ * (simulator only), ops/sec and p50/p99/p999 latency
+ * by default runs against the simulator so numbers are comparable between
+ * builds; -d selects a real adapter instead
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "mcp23017.h"
+#include "config.h"
+
+typedef enum {
+	FMT_TEXT,
+	FMT_CSV,
+	FMT_JSON,
+} Format_e;
+
+typedef struct {
+	const char *name_p;
+	bool (*fn) (Mcp23017_t *dev_p, unsigned iter);
+	// run before each call, neither timed nor counted
+	bool (*prep) (Mcp23017_t *dev_p, unsigned iter);
+} Bench_t;
+
+static char *device_pG = MCP23017_SIM_PREFIX "bench";
+static uint8_t i2cAddr_G = 0x20;
+static bool altRegAddr_G = false;
+static bool cache_G = true;
+static bool simSleep_G = false;
+static unsigned iterations_G = 10000;
+static Format_e format_G = FMT_TEXT;
+static Mcp23017Batch_t *batch_pG = NULL;
+
+static void usage (char *cmd_p);
+static bool process_cmdline_args (int argc, char *argv[]);
+
+// the bit ops are preceded by the opposite one (see Bench_t.prep), so the
+// cache never finds the latch already as wanted and every call writes it
+static bool
+b_set_bit (Mcp23017_t *dev_p, unsigned iter)
+{
+	return mcp23017__dev_set_bit(dev_p, (Mcp23017Bit_e)(GPA0 + (iter % 8)));
+}
+
+static bool
+b_clear_bit (Mcp23017_t *dev_p, unsigned iter)
+{
+	return mcp23017__dev_clear_bit(dev_p, (Mcp23017Bit_e)(GPA0 + (iter % 8)));
+}
+
+// flip GPB7 between input and output so every call has something to do
+static bool
+b_set_output_pins (Mcp23017_t *dev_p, unsigned iter)
+{
+	if (iter & 1)
+		return mcp23017__dev_set_input_pins(dev_p, 0x00, 0x80);
+	return mcp23017__dev_set_output_pins(dev_p, 0x00, 0x80);
+}
+
+static bool
+b_write_portA (Mcp23017_t *dev_p, unsigned iter)
+{
+	return mcp23017__dev_write_portA(dev_p, (uint8_t)iter);
+}
+
+static bool
+b_get_portA (Mcp23017_t *dev_p, unsigned iter)
+{
+	uint8_t val;
+
+	(void)iter;
+	return mcp23017__dev_get_portA(dev_p, &val);
+}
+
+static bool
+b_get_portAB (Mcp23017_t *dev_p, unsigned iter)
+{
+	uint8_t val;
+
+	(void)iter;
+	if (!mcp23017__dev_get_portA(dev_p, &val))
+		return false;
+	return mcp23017__dev_get_portB(dev_p, &val);
+}
+
+static bool
+b_read_port16 (Mcp23017_t *dev_p, unsigned iter)
+{
+	uint16_t val;
+
+	(void)iter;
+	return mcp23017__dev_read_port16(dev_p, &val);
+}
+
+static bool
+b_write_port16 (Mcp23017_t *dev_p, unsigned iter)
+{
+	return mcp23017__dev_write_port16(dev_p, (uint16_t)iter);
+}
+
+static bool
+b_batch8 (Mcp23017_t *dev_p, unsigned iter)
+{
+	static uint8_t vals[8];
+	unsigned i;
+
+	(void)dev_p;
+	(void)iter;
+	if (mcp23017__batch_count(batch_pG) == 0)
+		for (i = 0; i < 8; ++i)
+			if (mcp23017__batch_add_read(batch_pG, dev_p, (uint8_t)i, &vals[i]) < 0)
+				return false;
+	return mcp23017__batch_submit(batch_pG);
+}
+
+static bool
+b_burst64 (Mcp23017_t *dev_p, unsigned iter)
+{
+	static uint8_t buf[64];
+	unsigned i;
+
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = (uint8_t)(iter + i);
+	return mcp23017__dev_burst_write(dev_p, MCP23017_BURST_PORTA, buf, sizeof(buf));
+}
+
+static const Bench_t benches_G[] = {
+	{"set_bit", b_set_bit, b_clear_bit},
+	{"clear_bit", b_clear_bit, b_set_bit},
+	{"set_output/input_pins", b_set_output_pins, NULL},
+	{"write_portA", b_write_portA, NULL},
+	{"get_portA", b_get_portA, NULL},
+	{"get_portA+get_portB", b_get_portAB, NULL},
+	{"read_port16", b_read_port16, NULL},
+	{"write_port16", b_write_port16, NULL},
+	{"batch_8_reads", b_batch8, NULL},
+	{"burst_write_64", b_burst64, NULL},
+};
+
+static int
+cmp_u64 (const void *a_p, const void *b_p)
+{
+	uint64_t a = *(const uint64_t *)a_p;
+	uint64_t b = *(const uint64_t *)b_p;
+
+	return (a > b) - (a < b);
+}
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t
+percentile (const uint64_t *sorted_p, unsigned cnt, unsigned permille)
+{
+	unsigned idx = (unsigned)(((uint64_t)cnt * permille) / 1000u);
+
+	if (idx >= cnt)
+		idx = cnt - 1;
+	return sorted_p[idx];
+}
+
+static void
+print_header (void)
+{
+	switch (format_G) {
+		case FMT_TEXT:
+			printf("%s  device:%s addr:0x%02x bank:%d cache:%s iterations:%u\n",
+					PACKAGE_STRING, device_pG, i2cAddr_G, altRegAddr_G? 1 : 0,
+					cache_G? "on" : "off", iterations_G);
+			printf("%-22s %10s %12s %12s %10s %10s %10s\n",
+					"op", "txns/op", "bus-ns/op", "ops/sec", "p50-ns", "p99-ns", "p999-ns");
+			break;
+		case FMT_CSV:
+			printf("op,device,bank,cache,iterations,errors,txns_per_op,bus_ns_per_op,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+			break;
+		case FMT_JSON:
+			printf("[\n");
+			break;
+	}
+}
+
+static void
+print_result (const char *name_p, unsigned errors, double txns, double busNs, double opsPerSec,
+		uint64_t p50, uint64_t p99, uint64_t p999, bool sim, bool last)
+{
+	switch (format_G) {
+		case FMT_TEXT:
+			if (sim)
+				printf("%-22s %10.2f %12.0f %12.0f %10llu %10llu %10llu%s\n",
+						name_p, txns, busNs, opsPerSec,
+						(unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+						errors? "  (errors)" : "");
+			else
+				printf("%-22s %10s %12s %12.0f %10llu %10llu %10llu%s\n",
+						name_p, "-", "-", opsPerSec,
+						(unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+						errors? "  (errors)" : "");
+			break;
+		case FMT_CSV:
+			printf("%s,%s,%d,%d,%u,%u,", name_p, device_pG, altRegAddr_G? 1 : 0, cache_G? 1 : 0,
+					iterations_G, errors);
+			if (sim)
+				printf("%.4f,%.0f,", txns, busNs);
+			else
+				printf(",,");
+			printf("%.0f,%llu,%llu,%llu\n", opsPerSec,
+					(unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+			break;
+		case FMT_JSON:
+			printf("  {\"op\":\"%s\",\"device\":\"%s\",\"bank\":%d,\"cache\":%s,\"iterations\":%u,\"errors\":%u,",
+					name_p, device_pG, altRegAddr_G? 1 : 0, cache_G? "true" : "false",
+					iterations_G, errors);
+			if (sim)
+				printf("\"txns_per_op\":%.4f,\"bus_ns_per_op\":%.0f,", txns, busNs);
+			else
+				printf("\"txns_per_op\":null,\"bus_ns_per_op\":null,");
+			printf("\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}%s\n",
+					opsPerSec, (unsigned long long)p50, (unsigned long long)p99,
+					(unsigned long long)p999, last? "" : ",");
+			break;
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	Mcp23017_t *dev_p;
+	Mcp23017SimStats_t stats, prepStats;
+	uint64_t *lat_p;
+	uint64_t start, t0, total, prepNs, prepTxns, prepBusNs;
+	unsigned b, i, errors;
+	bool sim;
+	int ret = 1;
+
+	if (!process_cmdline_args(argc, argv)) {
+		printf("cmdline error\n");
+		return 1;
+	}
+
+	lat_p = calloc(iterations_G, sizeof(*lat_p));
+	if (lat_p == NULL) {
+		perror("calloc()");
+		return 1;
+	}
+
+	dev_p = mcp23017__open(device_pG, i2cAddr_G, altRegAddr_G);
+	if (dev_p == NULL) {
+		fprintf(stderr, "can't open %s @ 0x%02x\n", device_pG, i2cAddr_G);
+		goto done1;
+	}
+	if (!cache_G)
+		mcp23017__dev_cache_enable(dev_p, false);
+	sim = mcp23017__sim_get_stats(dev_p, &stats);
+	if (sim && simSleep_G) {
+		// keep the default model, but really wait for it
+		mcp23017__sim_set_latency(dev_p, 10000, 22500, true);
+	}
+
+	batch_pG = mcp23017__batch_new();
+	if (batch_pG == NULL)
+		goto done2;
+
+	// port A outputs (the bit ops need them), port B inputs
+	if (!mcp23017__dev_set_output_pins(dev_p, 0xff, 0x00) ||
+			!mcp23017__dev_set_input_pins(dev_p, 0x00, 0xff)) {
+		fprintf(stderr, "can't configure pins\n");
+		goto done3;
+	}
+
+	print_header();
+	for (b = 0; b < sizeof(benches_G) / sizeof(benches_G[0]); ++b) {
+		errors = 0;
+		prepNs = prepTxns = prepBusNs = 0;
+		mcp23017__sim_reset_stats(dev_p);
+
+		start = now_ns();
+		for (i = 0; i < iterations_G; ++i) {
+			if (benches_G[b].prep != NULL) {
+				t0 = now_ns();
+				mcp23017__sim_get_stats(dev_p, &prepStats);
+				prepTxns -= prepStats.transactions;
+				prepBusNs -= prepStats.busNs;
+				if (!benches_G[b].prep(dev_p, i))
+					++errors;
+				mcp23017__sim_get_stats(dev_p, &prepStats);
+				prepTxns += prepStats.transactions;
+				prepBusNs += prepStats.busNs;
+				prepNs += now_ns() - t0;
+			}
+			t0 = now_ns();
+			if (!benches_G[b].fn(dev_p, i))
+				++errors;
+			lat_p[i] = now_ns() - t0;
+		}
+		total = now_ns() - start - prepNs;
+		mcp23017__sim_get_stats(dev_p, &stats);
+		stats.transactions -= prepTxns;
+		stats.busNs -= prepBusNs;
+
+		// back to port A outputs, port B inputs
+		mcp23017__dev_set_input_pins(dev_p, 0x00, 0xff);
+		qsort(lat_p, iterations_G, sizeof(*lat_p), cmp_u64);
+		print_result(benches_G[b].name_p, errors,
+				(double)stats.transactions / iterations_G,
+				(double)stats.busNs / iterations_G,
+				total? (double)iterations_G * 1e9 / (double)total : 0.0,
+				percentile(lat_p, iterations_G, 500),
+				percentile(lat_p, iterations_G, 990),
+				percentile(lat_p, iterations_G, 999),
+				sim, b + 1 == sizeof(benches_G) / sizeof(benches_G[0]));
+	}
+	if (format_G == FMT_JSON)
+		printf("]\n");
+	ret = 0;
+
+done3:
+	mcp23017__batch_free(batch_pG);
+done2:
+	mcp23017__close(dev_p);
+done1:
+	free(lat_p);
+	return ret;
+}
+
+static void
+usage (char *cmd_p)
+{
+	printf("%s\n\n", PACKAGE_STRING);
+	if (cmd_p != NULL)
+		printf("%s [options]\n", cmd_p);
+	printf("  options\n");
+	printf(" -h|--help           Print usage help and exit successfully\n");
+	printf(" -d|--device <d>     Use device <d> (default:%s)\n", device_pG);
+	printf(" -a|--address <a>    Use i2c device address <a> (default:0x20)\n");
+	printf(" -1|--bank1          Use IOCON.BANK=1 (default:IOCON.BANK=0)\n");
+	printf(" -n|--iterations <n> Run each op <n> times (default:%u)\n", iterations_G);
+	printf(" -c|--no-cache       Turn the register cache off\n");
+	printf(" -s|--sim-sleep      Simulator: really wait for the modelled bus time\n");
+	printf(" -f|--format <f>     Output format: text, csv, json (default:text)\n");
+}
+
+static bool
+process_cmdline_args (int argc, char *argv[])
+{
+	int c;
+	uint8_t tmp;
+	struct option longOpts[] = {
+		{"help",       no_argument,       NULL, 'h'},
+		{"device",     required_argument, NULL, 'd'},
+		{"address",    required_argument, NULL, 'a'},
+		{"bank1",      no_argument,       NULL, '1'},
+		{"iterations", required_argument, NULL, 'n'},
+		{"no-cache",   no_argument,       NULL, 'c'},
+		{"sim-sleep",  no_argument,       NULL, 's'},
+		{"format",     required_argument, NULL, 'f'},
+		{NULL,         0,                 NULL,  0},
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "hd:a:1n:csf:", longOpts, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+				break;
+
+			case 'd':
+				device_pG = optarg;
+				break;
+
+			case 'a':
+				if (sscanf(optarg, "%hhi", &tmp) != 1) {
+					fprintf(stderr, "conversion error\n");
+					return false;
+				}
+				i2cAddr_G = (uint8_t)tmp;
+				break;
+
+			case '1':
+				altRegAddr_G = true;
+				break;
+
+			case 'n':
+				if ((sscanf(optarg, "%u", &iterations_G) != 1) || (iterations_G == 0)) {
+					fprintf(stderr, "invalid iteration count\n");
+					return false;
+				}
+				break;
+
+			case 'c':
+				cache_G = false;
+				break;
+
+			case 's':
+				simSleep_G = true;
+				break;
+
+			case 'f':
+				if (strcmp(optarg, "text") == 0)
+					format_G = FMT_TEXT;
+				else if (strcmp(optarg, "csv") == 0)
+					format_G = FMT_CSV;
+				else if (strcmp(optarg, "json") == 0)
+					format_G = FMT_JSON;
+				else {
+					fprintf(stderr, "unknown format: %s\n", optarg);
+					return false;
+				}
+				break;
+
+			default:
+				printf("getopt error: %c (0x%x)\n", c, c);
+				break;
+		}
+	}
+
+	return true;
+}
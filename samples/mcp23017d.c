@@ -0,0 +1,702 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * daemon that owns the configured buses and chips and serves clients over
+ * a Unix socket (protocol: lib/mcp23017-proto.h), so that only one process
+ * ever opens, probes or reconfigures the chips
+ * every round of the poll loop takes whatever requests have arrived, from
+ * all clients, and runs them as one batch: one bus transfer per adapter
+ * however many clients and requests are involved
+ * read-modify-write ops (modify, toggle, write masked) are resolved against
+ * the daemon's copy of each chip's output latches, so they go into the
+ * same batch as plain writes instead of needing a read first
+ * clients can't write IOCON: the daemon relies on the layout it set up
+ * with -m the daemon also publishes every chip's inputs to a shared-memory
+ * mirror (see mcp23017__mirror_open()), polled by the library's scheduler,
+ * for processes that only need the current levels
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mcp23017.h"
+#include "mcp23017-proto.h"
+#include "config.h"
+
+#define REQ_MAX_BYTES (sizeof(Mcp23017ProtoHdr_t) + MCP23017_PROTO_OPS_MAX * sizeof(Mcp23017ProtoOp_t))
+#define IN_MAX (4 * REQ_MAX_BYTES)
+// replies a client hasn't read yet; past this it isn't read from
+#define OUT_MAX (64 * 1024)
+
+typedef struct {
+	Mcp23017_t *dev_p;
+	bool bank1;
+	uint8_t olat[2];        // what the output latches hold, as far as we know
+	bool stale;             // a latch write failed, 'olat' can't be trusted
+} Chip_t;
+
+typedef struct {
+	int fd;
+	bool dead;
+	uint8_t in[IN_MAX];
+	size_t inLen;
+	uint8_t *out_p;
+	size_t outLen;
+	size_t outMax;
+} Client_t;
+
+// one request taken this round
+typedef struct {
+	Client_t *cl_p;
+	Mcp23017ProtoHdr_t hdr;
+	Mcp23017ProtoOp_t ops[MCP23017_PROTO_OPS_MAX];
+	Mcp23017ProtoResult_t res[MCP23017_PROTO_OPS_MAX];
+	int idx[MCP23017_PROTO_OPS_MAX][2];     // batch ops, -1 if none
+	uint8_t val[MCP23017_PROTO_OPS_MAX][2];
+} Req_t;
+
+static char *socket_pG = MCP23017_PROTO_SOCKET;
+static Chip_t *chips_pG = NULL;
+static unsigned chipCnt_G = 0;
+static Client_t **clients_ppG = NULL;
+static unsigned clientCnt_G = 0;
+static Req_t *reqs_pG = NULL;
+static unsigned reqCnt_G = 0;
+static unsigned reqMax_G = 0;
+static Mcp23017Batch_t *batch_pG = NULL;
+static char *mirror_pG = NULL;
+static uint32_t periodUs_G = 1000;
+static Mcp23017Mirror_t *mirrorPub_pG = NULL;
+static volatile sig_atomic_t run_G = 1;
+
+static void usage (char *cmd_p);
+static bool process_cmdline_args (int argc, char *argv[]);
+
+static void
+on_signal (int sig)
+{
+	(void)sig;
+	run_G = 0;
+}
+
+static void
+on_poll (Mcp23017_t *dev_p, bool ok, uint16_t val, void *arg_p)
+{
+	(void)dev_p;
+	if (ok)
+		mcp23017__mirror_publish(mirrorPub_pG, (unsigned)(uintptr_t)arg_p, val);
+}
+
+static uint8_t
+reg_addr (const Chip_t *chip_p, unsigned reg, unsigned port)
+{
+	if (chip_p->bank1)
+		return (uint8_t)((port << 4) | reg);
+	return (uint8_t)((reg << 1) | port);
+}
+
+static bool
+chip_add (const char *device_p, uint8_t i2cAddr, bool bank1)
+{
+	Chip_t *chips_p;
+	Chip_t *chip_p;
+
+	if (chipCnt_G > UINT8_MAX) {
+		fprintf(stderr, "too many chips\n");
+		return false;
+	}
+	chips_p = realloc(chips_pG, (chipCnt_G + 1) * sizeof(*chips_p));
+	if (chips_p == NULL) {
+		perror("realloc(chips)");
+		return false;
+	}
+	chips_pG = chips_p;
+	chip_p = &chips_pG[chipCnt_G];
+	memset(chip_p, 0, sizeof(*chip_p));
+
+	chip_p->dev_p = mcp23017__open(device_p, i2cAddr, bank1);
+	if (chip_p->dev_p == NULL) {
+		fprintf(stderr, "can't open chip 0x%02x on %s\n", i2cAddr, device_p);
+		return false;
+	}
+	chip_p->bank1 = bank1;
+	chip_p->stale = true;
+	++chipCnt_G;
+	return true;
+}
+
+// reread the output latches of a chip whose copy is stale
+static void
+chip_resync (Chip_t *chip_p)
+{
+	if (!chip_p->stale)
+		return;
+	if (!mcp23017__dev_cache_resync(chip_p->dev_p))
+		return;
+	if (!mcp23017__dev_get_reg(chip_p->dev_p, reg_addr(chip_p, MCP23017_OLAT, PORTA), &chip_p->olat[PORTA]))
+		return;
+	if (!mcp23017__dev_get_reg(chip_p->dev_p, reg_addr(chip_p, MCP23017_OLAT, PORTB), &chip_p->olat[PORTB]))
+		return;
+	chip_p->stale = false;
+}
+
+static int
+listen_on (const char *path_p)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path_p) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path_p);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path_p);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket()");
+		return -1;
+	}
+	unlink(path_p);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		perror("bind()");
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, 16) != 0) {
+		perror("listen()");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+client_accept (int lfd)
+{
+	Client_t **clients_pp;
+	Client_t *cl_p;
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	clients_pp = realloc(clients_ppG, (clientCnt_G + 1) * sizeof(*clients_pp));
+	if (clients_pp == NULL) {
+		close(fd);
+		return;
+	}
+	clients_ppG = clients_pp;
+	cl_p = calloc(1, sizeof(*cl_p));
+	if (cl_p == NULL) {
+		close(fd);
+		return;
+	}
+	cl_p->fd = fd;
+	clients_ppG[clientCnt_G++] = cl_p;
+}
+
+// drop the clients that went away
+static void
+clients_reap (void)
+{
+	unsigned i, j;
+
+	for (i = j = 0; i < clientCnt_G; ++i) {
+		if (clients_ppG[i]->dead) {
+			close(clients_ppG[i]->fd);
+			free(clients_ppG[i]->out_p);
+			free(clients_ppG[i]);
+			continue;
+		}
+		clients_ppG[j++] = clients_ppG[i];
+	}
+	clientCnt_G = j;
+}
+
+static Req_t *
+req_new (void)
+{
+	Req_t *reqs_p;
+	unsigned max;
+
+	if (reqCnt_G == reqMax_G) {
+		max = (reqMax_G == 0)? 16 : reqMax_G * 2;
+		reqs_p = realloc(reqs_pG, max * sizeof(*reqs_p));
+		if (reqs_p == NULL)
+			return NULL;
+		reqs_pG = reqs_p;
+		reqMax_G = max;
+	}
+	return &reqs_pG[reqCnt_G++];
+}
+
+// take the client's complete requests out of its input buffer
+static void
+client_parse (Client_t *cl_p)
+{
+	Mcp23017ProtoHdr_t hdr;
+	size_t pos = 0, len;
+	Req_t *req_p;
+
+	while (cl_p->inLen - pos >= sizeof(hdr)) {
+		memcpy(&hdr, &cl_p->in[pos], sizeof(hdr));
+		if ((hdr.magic != MCP23017_PROTO_MAGIC) || (hdr.version != MCP23017_PROTO_VERSION)
+				|| (hdr.cnt == 0) || (hdr.cnt > MCP23017_PROTO_OPS_MAX)) {
+			cl_p->dead = true;
+			return;
+		}
+		len = sizeof(hdr) + hdr.cnt * sizeof(Mcp23017ProtoOp_t);
+		if (cl_p->inLen - pos < len)
+			break;
+
+		req_p = req_new();
+		if (req_p == NULL) {
+			cl_p->dead = true;
+			return;
+		}
+		req_p->cl_p = cl_p;
+		req_p->hdr = hdr;
+		memcpy(req_p->ops, &cl_p->in[pos + sizeof(hdr)], hdr.cnt * sizeof(Mcp23017ProtoOp_t));
+		pos += len;
+	}
+
+	memmove(cl_p->in, &cl_p->in[pos], cl_p->inLen - pos);
+	cl_p->inLen -= pos;
+}
+
+static void
+client_read (Client_t *cl_p)
+{
+	ssize_t ret;
+
+	ret = read(cl_p->fd, &cl_p->in[cl_p->inLen], sizeof(cl_p->in) - cl_p->inLen);
+	if (ret < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR))
+			cl_p->dead = true;
+		return;
+	}
+	if (ret == 0) {
+		cl_p->dead = true;
+		return;
+	}
+	cl_p->inLen += (size_t)ret;
+	client_parse(cl_p);
+}
+
+static void
+client_flush (Client_t *cl_p)
+{
+	ssize_t ret;
+
+	if (cl_p->dead || (cl_p->outLen == 0))
+		return;
+	ret = send(cl_p->fd, cl_p->out_p, cl_p->outLen, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR))
+			cl_p->dead = true;
+		return;
+	}
+	memmove(cl_p->out_p, cl_p->out_p + ret, cl_p->outLen - (size_t)ret);
+	cl_p->outLen -= (size_t)ret;
+}
+
+static void
+client_reply (Req_t *req_p)
+{
+	Client_t *cl_p = req_p->cl_p;
+	size_t len, max;
+	uint8_t *out_p;
+
+	if (cl_p->dead)
+		return;
+
+	len = sizeof(req_p->hdr) + req_p->hdr.cnt * sizeof(Mcp23017ProtoResult_t);
+	if (cl_p->outLen + len > cl_p->outMax) {
+		max = (cl_p->outMax == 0)? 4096 : cl_p->outMax;
+		while (max < cl_p->outLen + len)
+			max *= 2;
+		out_p = realloc(cl_p->out_p, max);
+		if (out_p == NULL) {
+			cl_p->dead = true;
+			return;
+		}
+		cl_p->out_p = out_p;
+		cl_p->outMax = max;
+	}
+
+	memcpy(&cl_p->out_p[cl_p->outLen], &req_p->hdr, sizeof(req_p->hdr));
+	cl_p->outLen += sizeof(req_p->hdr);
+	memcpy(&cl_p->out_p[cl_p->outLen], req_p->res, req_p->hdr.cnt * sizeof(Mcp23017ProtoResult_t));
+	cl_p->outLen += req_p->hdr.cnt * sizeof(Mcp23017ProtoResult_t);
+}
+
+// queue op 'i''s access number 'n' (0 or 1)
+static void
+queue_access (Req_t *req_p, unsigned i, unsigned n, Chip_t *chip_p, unsigned reg, unsigned port, bool read, uint8_t val)
+{
+	int idx;
+
+	if (read)
+		idx = mcp23017__batch_add_read(batch_pG, chip_p->dev_p, reg_addr(chip_p, reg, port), &req_p->val[i][n]);
+	else {
+		if ((reg == MCP23017_GPIO) || (reg == MCP23017_OLAT))
+			chip_p->olat[port] = val;
+		idx = mcp23017__batch_add_write(batch_pG, chip_p->dev_p, reg_addr(chip_p, reg, port), val);
+	}
+	if (idx < 0)
+		req_p->res[i].result = -ENOMEM;
+	req_p->idx[i][n] = idx;
+}
+
+/*
+ * queue a read-modify-write of both latches: new = (old & andMask) ^ xorMask
+ * only ports with bits to change are written
+ */
+static void
+queue_update (Req_t *req_p, unsigned i, Chip_t *chip_p, uint16_t andMask, uint16_t xorMask)
+{
+	unsigned port;
+	uint8_t and8, xor8;
+
+	if (chip_p->stale) {
+		req_p->res[i].result = -EIO;
+		return;
+	}
+
+	for (port = PORTA; port <= PORTB; ++port) {
+		and8 = (uint8_t)(andMask >> (8 * port));
+		xor8 = (uint8_t)(xorMask >> (8 * port));
+		if ((and8 == 0xff) && (xor8 == 0))
+			continue;
+		queue_access(req_p, i, port, chip_p, MCP23017_GPIO, port, false,
+				(uint8_t)((chip_p->olat[port] & and8) ^ xor8));
+	}
+}
+
+static void
+queue_op (Req_t *req_p, unsigned i)
+{
+	const Mcp23017ProtoOp_t *op_p = &req_p->ops[i];
+	Chip_t *chip_p;
+	unsigned port;
+
+	req_p->idx[i][0] = req_p->idx[i][1] = -1;
+	req_p->val[i][0] = req_p->val[i][1] = 0;
+	req_p->res[i].result = 0;
+	req_p->res[i].val = 0;
+
+	if (op_p->chip >= chipCnt_G) {
+		req_p->res[i].result = -ENODEV;
+		return;
+	}
+	chip_p = &chips_pG[op_p->chip];
+
+	switch (op_p->op) {
+		case MCP23017_PROTO_READ_REG:
+		case MCP23017_PROTO_WRITE_REG:
+			if ((op_p->reg >= MCP23017_REG_CNT) || (op_p->port > PORTB)) {
+				req_p->res[i].result = -EINVAL;
+				return;
+			}
+			if ((op_p->op == MCP23017_PROTO_WRITE_REG) && (op_p->reg == MCP23017_IOCON)) {
+				req_p->res[i].result = -EPERM;
+				return;
+			}
+			queue_access(req_p, i, 0, chip_p, op_p->reg, op_p->port,
+					op_p->op == MCP23017_PROTO_READ_REG, (uint8_t)op_p->val);
+			return;
+
+		case MCP23017_PROTO_READ_PORT16:
+		case MCP23017_PROTO_WRITE_PORT16:
+			for (port = PORTA; port <= PORTB; ++port)
+				queue_access(req_p, i, port, chip_p, MCP23017_GPIO, port,
+						op_p->op == MCP23017_PROTO_READ_PORT16, (uint8_t)(op_p->val >> (8 * port)));
+			return;
+
+		case MCP23017_PROTO_MODIFY:
+			queue_update(req_p, i, chip_p, (uint16_t)~(op_p->val | op_p->mask), op_p->val);
+			return;
+
+		case MCP23017_PROTO_TOGGLE:
+			queue_update(req_p, i, chip_p, 0xffff, op_p->mask);
+			return;
+
+		case MCP23017_PROTO_WRITE_MASKED:
+			queue_update(req_p, i, chip_p, (uint16_t)~op_p->mask, (uint16_t)(op_p->val & op_p->mask));
+			return;
+
+		default:
+			req_p->res[i].result = -EINVAL;
+			return;
+	}
+}
+
+// collect op 'i''s outcome from the submitted batch
+static void
+finish_op (Req_t *req_p, unsigned i)
+{
+	const Mcp23017ProtoOp_t *op_p = &req_p->ops[i];
+	Mcp23017ProtoResult_t *res_p = &req_p->res[i];
+	unsigned port;
+	int ret;
+
+	for (port = PORTA; port <= PORTB; ++port) {
+		if (req_p->idx[i][port] < 0)
+			continue;
+		ret = mcp23017__batch_result(batch_pG, (unsigned)req_p->idx[i][port]);
+		if (ret == 0)
+			continue;
+		if (res_p->result == 0)
+			res_p->result = (int16_t)ret;
+		// a write of unknown outcome: reread the latches next round
+		if ((op_p->op != MCP23017_PROTO_READ_REG) && (op_p->op != MCP23017_PROTO_READ_PORT16))
+			chips_pG[op_p->chip].stale = true;
+	}
+	if (res_p->result == 0)
+		res_p->val = (uint16_t)(req_p->val[i][0] | (req_p->val[i][1] << 8));
+}
+
+// one round: run every request taken from the clients as a single batch
+static void
+run_round (void)
+{
+	unsigned r, i;
+
+	for (i = 0; i < chipCnt_G; ++i)
+		chip_resync(&chips_pG[i]);
+
+	mcp23017__batch_reset(batch_pG);
+	for (r = 0; r < reqCnt_G; ++r)
+		for (i = 0; i < reqs_pG[r].hdr.cnt; ++i)
+			queue_op(&reqs_pG[r], i);
+
+	if (mcp23017__batch_count(batch_pG) > 0)
+		mcp23017__batch_submit(batch_pG);
+
+	for (r = 0; r < reqCnt_G; ++r) {
+		for (i = 0; i < reqs_pG[r].hdr.cnt; ++i)
+			finish_op(&reqs_pG[r], i);
+		client_reply(&reqs_pG[r]);
+	}
+	reqCnt_G = 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct pollfd *pfds_p = NULL, *tmp_p;
+	struct sigaction sa;
+	Mcp23017Sched_t *sched_p = NULL;
+	unsigned i, pfdMax = 0;
+	int lfd, ret = 1;
+
+	batch_pG = mcp23017__batch_new();
+	if (batch_pG == NULL)
+		return 1;
+
+	if (!process_cmdline_args(argc, argv)) {
+		printf("cmdline error\n");
+		goto done;
+	}
+	if ((chipCnt_G == 0) && !chip_add("/dev/i2c-1", 0x20, false))
+		goto done;
+	for (i = 0; i < chipCnt_G; ++i)
+		chip_resync(&chips_pG[i]);
+
+	if (mirror_pG != NULL) {
+		mirrorPub_pG = mcp23017__mirror_create(mirror_pG, chipCnt_G);
+		sched_p = mcp23017__sched_start();
+		if ((mirrorPub_pG == NULL) || (sched_p == NULL)) {
+			fprintf(stderr, "can't set up mirror %s\n", mirror_pG);
+			goto done;
+		}
+		for (i = 0; i < chipCnt_G; ++i)
+			if (mcp23017__sched_add(sched_p, chips_pG[i].dev_p, MCP23017_SAMPLE_PORTAB,
+						periodUs_G, 0, on_poll, (void *)(uintptr_t)i) < 0) {
+				fprintf(stderr, "can't poll chip %u\n", i);
+				goto done;
+			}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = listen_on(socket_pG);
+	if (lfd < 0)
+		goto done;
+
+	while (run_G) {
+		if (pfdMax < clientCnt_G + 1) {
+			tmp_p = realloc(pfds_p, (clientCnt_G + 1) * sizeof(*pfds_p));
+			if (tmp_p == NULL) {
+				perror("realloc(pollfds)");
+				break;
+			}
+			pfds_p = tmp_p;
+			pfdMax = clientCnt_G + 1;
+		}
+
+		pfds_p[0].fd = lfd;
+		pfds_p[0].events = POLLIN;
+		for (i = 0; i < clientCnt_G; ++i) {
+			pfds_p[i + 1].fd = clients_ppG[i]->fd;
+			pfds_p[i + 1].events = 0;
+			// a client that doesn't read its replies isn't read from
+			if (clients_ppG[i]->outLen < OUT_MAX)
+				pfds_p[i + 1].events |= POLLIN;
+			if (clients_ppG[i]->outLen > 0)
+				pfds_p[i + 1].events |= POLLOUT;
+		}
+		if (poll(pfds_p, clientCnt_G + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll()");
+			break;
+		}
+
+		// everything that has arrived, from every client, goes in one round
+		for (i = 0; i < clientCnt_G; ++i) {
+			if (pfds_p[i + 1].revents & (POLLERR | POLLHUP | POLLIN))
+				client_read(clients_ppG[i]);
+			if (pfds_p[i + 1].revents & POLLOUT)
+				client_flush(clients_ppG[i]);
+		}
+		if (reqCnt_G > 0)
+			run_round();
+		for (i = 0; i < clientCnt_G; ++i)
+			client_flush(clients_ppG[i]);
+		clients_reap();
+
+		if (pfds_p[0].revents & POLLIN)
+			client_accept(lfd);
+	}
+	ret = 0;
+
+	close(lfd);
+	unlink(socket_pG);
+	for (i = 0; i < clientCnt_G; ++i)
+		clients_ppG[i]->dead = true;
+	clients_reap();
+done:
+	mcp23017__sched_stop(sched_p);
+	mcp23017__mirror_close(mirrorPub_pG);
+	free(pfds_p);
+	free(clients_ppG);
+	free(reqs_pG);
+	for (i = 0; i < chipCnt_G; ++i)
+		mcp23017__close(chips_pG[i].dev_p);
+	free(chips_pG);
+	mcp23017__batch_free(batch_pG);
+	return ret;
+}
+
+static void
+usage (char *cmd_p)
+{
+	printf("%s\n\n", PACKAGE_STRING);
+	if (cmd_p != NULL)
+		printf("%s [options]\n", cmd_p);
+	printf("  options\n");
+	printf(" -h|--help          Print usage help and exit successfully\n");
+	printf(" -s|--socket <s>    Listen on Unix socket <s> (default:%s)\n", MCP23017_PROTO_SOCKET);
+	printf(" -d|--device <d>    Chips that follow are on device <d> (default:/dev/i2c-1)\n");
+	printf(" -1|--bank1         Chips that follow use IOCON.BANK=1 (default:IOCON.BANK=0)\n");
+	printf(" -a|--address <a>   Serve the chip at address <a>; repeat for more chips,\n");
+	printf("                    which clients address by index in the order given\n");
+	printf("                    (default: one chip, at 0x20)\n");
+	printf(" -m|--mirror <f>    Publish every chip's inputs to mirror file <f>\n");
+	printf(" -p|--period <us>   Poll for the mirror every <us> microseconds (default:1000)\n");
+	printf("  e.g. -d /dev/i2c-1 -a 0x20 -a 0x21 -d /dev/i2c-2 -a 0x20\n");
+}
+
+static bool
+process_cmdline_args (int argc, char *argv[])
+{
+	int c;
+	uint8_t tmp;
+	char *device_p = "/dev/i2c-1";
+	bool bank1 = false;
+	struct option longOpts[] = {
+		{"help",    no_argument,       NULL, 'h'},
+		{"socket",  required_argument, NULL, 's'},
+		{"device",  required_argument, NULL, 'd'},
+		{"bank1",   no_argument,       NULL, '1'},
+		{"address", required_argument, NULL, 'a'},
+		{"mirror",  required_argument, NULL, 'm'},
+		{"period",  required_argument, NULL, 'p'},
+		{NULL,      0,                 NULL,  0},
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "hs:d:1a:m:p:", longOpts, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+				break;
+
+			case 's':
+				socket_pG = optarg;
+				break;
+
+			case 'd':
+				device_p = optarg;
+				break;
+
+			case '1':
+				bank1 = true;
+				break;
+
+			case 'a':
+				if (sscanf(optarg, "%hhi", &tmp) != 1) {
+					fprintf(stderr, "conversion error\n");
+					return false;
+				}
+				if (!chip_add(device_p, tmp, bank1))
+					return false;
+				break;
+
+			case 'm':
+				mirror_pG = optarg;
+				break;
+
+			case 'p':
+				if ((sscanf(optarg, "%u", &periodUs_G) != 1) || (periodUs_G == 0)) {
+					fprintf(stderr, "conversion error\n");
+					return false;
+				}
+				break;
+
+			default:
+				printf("getopt error: %c (0x%x)\n", c, c);
+				return false;
+		}
+	}
+
+	return true;
+}
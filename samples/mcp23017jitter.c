@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * measure how late a periodic transfer completes (mcp23017__rt_measure()),
+ * with or without real-time mode, optionally while other threads load the
+ * machine with allocation, stdio and busy work
+ * compare a plain run with one under -r to see what real-time mode buys
+ * on a given system
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "mcp23017.h"
+#include "config.h"
+
+#define LOADERS_MAX 64
+
+static char *device_pG = MCP23017_SIM_PREFIX "jitter";
+static uint8_t i2cAddr_G = 0x20;
+static bool altRegAddr_G = false;
+static bool simSleep_G = false;
+static unsigned cycles_G = 10000;
+static uint32_t periodUs_G = 1000;
+static bool rt_G = false;
+static int priority_G = MCP23017_RT_DEFAULT_PRIO;
+static int cpu_G = -1;
+static unsigned loaders_G = 0;
+static atomic_bool stop_G = false;
+
+static void usage (char *cmd_p);
+static bool process_cmdline_args (int argc, char *argv[]);
+
+// what a busy application does to a control loop's cache and allocator
+static void *
+loader (void *arg_p)
+{
+	FILE *null_p;
+	uint8_t *p;
+	size_t len;
+	unsigned seed = (unsigned)(uintptr_t)arg_p;
+
+	null_p = fopen("/dev/null", "w");
+	while (!atomic_load_explicit(&stop_G, memory_order_relaxed)) {
+		len = (size_t)(rand_r(&seed) % (256 * 1024)) + 1;
+		p = malloc(len);
+		if (p != NULL) {
+			memset(p, (int)len, len);
+			free(p);
+		}
+		if (null_p != NULL)
+			fprintf(null_p, "load %zu\n", len);
+	}
+	if (null_p != NULL)
+		fclose(null_p);
+	return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+	Mcp23017_t *dev_p;
+	Mcp23017RtConfig_t cfg;
+	Mcp23017Jitter_t jit;
+	Mcp23017Error_t err;
+	pthread_t threads[LOADERS_MAX];
+	unsigned i, started = 0;
+	bool ok;
+	int ret = 1;
+
+	if (!process_cmdline_args(argc, argv)) {
+		printf("cmdline error\n");
+		return 1;
+	}
+
+	dev_p = mcp23017__open(device_pG, i2cAddr_G, altRegAddr_G);
+	if (dev_p == NULL) {
+		fprintf(stderr, "can't open %s @ 0x%02x\n", device_pG, i2cAddr_G);
+		return 1;
+	}
+	if (simSleep_G)
+		mcp23017__sim_set_latency(dev_p, 10000, 22500, true);
+
+	if (rt_G) {
+		cfg.priority = priority_G;
+		cfg.cpu = cpu_G;
+		cfg.stackBytes = 64 * 1024;
+		cfg.heapBytes = 1024 * 1024;
+		cfg.noDeepIdle = true;
+		if (!mcp23017__rt_enable(&cfg)) {
+			mcp23017__last_error(&err);
+			fprintf(stderr, "can't enter real-time mode: %s\n", strerror(err.err));
+			goto done;
+		}
+	}
+
+	// started before this thread goes SCHED_FIFO, which they'd inherit
+	for (i = 0; i < loaders_G; ++i) {
+		if (pthread_create(&threads[i], NULL, loader, (void *)(uintptr_t)(i + 1)) != 0) {
+			fprintf(stderr, "can't start load thread\n");
+			break;
+		}
+		++started;
+	}
+
+	if (rt_G && !mcp23017__rt_thread_setup()) {
+		mcp23017__last_error(&err);
+		fprintf(stderr, "can't make this thread real-time: %s\n", strerror(err.err));
+		atomic_store(&stop_G, true);
+		for (i = 0; i < started; ++i)
+			pthread_join(threads[i], NULL);
+		goto done;
+	}
+
+	ok = mcp23017__rt_measure(dev_p, cycles_G, periodUs_G, &jit);
+
+	atomic_store(&stop_G, true);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	printf("device:      %s @ 0x%02x\n", device_pG, i2cAddr_G);
+	printf("mode:        %s, %u load threads\n", rt_G? "real-time" : "normal", started);
+	printf("cycles:      %llu every %u us\n", (unsigned long long)jit.cycles, periodUs_G);
+	printf("overruns:    %llu\n", (unsigned long long)jit.overruns);
+	printf("errors:      %llu\n", (unsigned long long)jit.errors);
+	printf("wakeup max:  %.1f us\n", (double)jit.wakeMaxNs / 1e3);
+	printf("xfer max:    %.1f us\n", (double)jit.xferMaxNs / 1e3);
+	printf("latency:     mean %.1f us, max %.1f us\n", (double)jit.meanNs / 1e3, (double)jit.maxNs / 1e3);
+	for (i = 0; i < MCP23017_STATS_BUCKETS; ++i)
+		if (jit.latency[i] != 0)
+			printf("  >= %10.1f us: %llu\n", (double)(1ull << i) / 1e3, (unsigned long long)jit.latency[i]);
+	ret = ok? 0 : 1;
+
+done:
+	if (rt_G)
+		mcp23017__rt_disable();
+	mcp23017__close(dev_p);
+	return ret;
+}
+
+static void
+usage (char *cmd_p)
+{
+	printf("%s\n\n", PACKAGE_STRING);
+	if (cmd_p != NULL)
+		printf("%s [options]\n", cmd_p);
+	printf("  options\n");
+	printf(" -h|--help           Print usage help and exit successfully\n");
+	printf(" -d|--device <d>     Use device <d> (default:%s)\n", device_pG);
+	printf(" -a|--address <a>    Use i2c device address <a> (default:0x20)\n");
+	printf(" -1|--bank1          Use IOCON.BANK=1 (default:IOCON.BANK=0)\n");
+	printf(" -n|--cycles <n>     Measure <n> cycles (default:%u)\n", cycles_G);
+	printf(" -p|--period <us>    One transfer every <us> microseconds (default:%u)\n", periodUs_G);
+	printf(" -r|--rt             Run in real-time mode\n");
+	printf(" -P|--priority <p>   SCHED_FIFO priority with -r (default:%d)\n", priority_G);
+	printf(" -c|--cpu <c>        Pin to CPU <c> with -r (default:any)\n");
+	printf(" -l|--load <n>       Run <n> load threads meanwhile (default:0, max:%d)\n", LOADERS_MAX);
+	printf(" -s|--sim-sleep      Simulator: really wait for the modelled bus time\n");
+}
+
+static bool
+process_cmdline_args (int argc, char *argv[])
+{
+	int c;
+	uint8_t tmp;
+	struct option longOpts[] = {
+		{"help",      no_argument,       NULL, 'h'},
+		{"device",    required_argument, NULL, 'd'},
+		{"address",   required_argument, NULL, 'a'},
+		{"bank1",     no_argument,       NULL, '1'},
+		{"cycles",    required_argument, NULL, 'n'},
+		{"period",    required_argument, NULL, 'p'},
+		{"rt",        no_argument,       NULL, 'r'},
+		{"priority",  required_argument, NULL, 'P'},
+		{"cpu",       required_argument, NULL, 'c'},
+		{"load",      required_argument, NULL, 'l'},
+		{"sim-sleep", no_argument,       NULL, 's'},
+		{NULL,        0,                 NULL,  0},
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "hd:a:1n:p:rP:c:l:s", longOpts, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+				break;
+
+			case 'd':
+				device_pG = optarg;
+				break;
+
+			case 'a':
+				if (sscanf(optarg, "%hhi", &tmp) != 1) {
+					fprintf(stderr, "conversion error\n");
+					return false;
+				}
+				i2cAddr_G = (uint8_t)tmp;
+				break;
+
+			case '1':
+				altRegAddr_G = true;
+				break;
+
+			case 'n':
+				if ((sscanf(optarg, "%u", &cycles_G) != 1) || (cycles_G == 0)) {
+					fprintf(stderr, "invalid cycle count\n");
+					return false;
+				}
+				break;
+
+			case 'p':
+				if ((sscanf(optarg, "%u", &periodUs_G) != 1) || (periodUs_G == 0)) {
+					fprintf(stderr, "invalid period\n");
+					return false;
+				}
+				break;
+
+			case 'r':
+				rt_G = true;
+				break;
+
+			case 'P':
+				if ((sscanf(optarg, "%d", &priority_G) != 1) || (priority_G < 0)) {
+					fprintf(stderr, "invalid priority\n");
+					return false;
+				}
+				break;
+
+			case 'c':
+				if ((sscanf(optarg, "%d", &cpu_G) != 1) || (cpu_G < 0)) {
+					fprintf(stderr, "invalid cpu\n");
+					return false;
+				}
+				break;
+
+			case 'l':
+				if ((sscanf(optarg, "%u", &loaders_G) != 1) || (loaders_G > LOADERS_MAX)) {
+					fprintf(stderr, "invalid load thread count\n");
+					return false;
+				}
+				break;
+
+			case 's':
+				simSleep_G = true;
+				break;
+
+			default:
+				printf("getopt error: %c (0x%x)\n", c, c);
+				return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2021  Trevor Woerner <twoerner@gmail.com>
+ * SPDX-License-Identifier: OSL-3.0
+ */
+
+/*
+ * play back a trace saved with mcp23017__trace_save() against the
+ * simulator (the default) or real adapters, keeping the original spacing
+ * between transfers (unless -n), then compare: reads that returned other
+ * data, runs whose outcome differs, and bus time per transfer
+ * each traced transfer is replayed as one batch, so it is still a single
+ * bus transfer per adapter, and each of its register runs as one raw run
+ * with the traced register, length, byte mode and data; a trace whose
+ * ring cut a run's data short is refused rather than made up
+ * -o traces the replay itself, so two library versions can be compared on
+ * identical traffic
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "mcp23017.h"
+#include "config.h"
+
+#define DEVICES_MAX 8
+#define MISMATCH_PRINT_MAX 20
+
+typedef struct {
+	unsigned bus;
+	uint8_t addr;
+	Mcp23017_t *dev_p;
+} Chip_t;
+
+// one traced register run
+typedef struct {
+	unsigned rec;           // its first record
+	unsigned recCnt;        // its records, continuations included
+	size_t off;             // where its bytes are in the data buffers
+	int idx;                // its batch op, -1 if none
+} Run_t;
+
+static char *devices_pG[DEVICES_MAX] = { MCP23017_SIM_PREFIX "replay" };
+static unsigned deviceCnt_G = 0;
+static bool altRegAddr_G = false;
+static bool timing_G = true;
+static bool verbose_G = false;
+static char *trace_pG = NULL;
+static char *out_pG = NULL;
+
+static Chip_t *chips_pG = NULL;
+static unsigned chipCnt_G = 0;
+
+static void usage (char *cmd_p);
+static bool process_cmdline_args (int argc, char *argv[]);
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void
+sleep_until (uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(ns / 1000000000ull);
+	ts.tv_nsec = (long)(ns % 1000000000ull);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+// the chip at 'addr' on traced adapter 'bus', opened on first use
+static Mcp23017_t *
+chip_get (unsigned bus, uint8_t addr)
+{
+	Chip_t *chips_p;
+	const char *device_p;
+	unsigned i;
+
+	for (i = 0; i < chipCnt_G; ++i)
+		if ((chips_pG[i].bus == bus) && (chips_pG[i].addr == addr))
+			return chips_pG[i].dev_p;
+
+	// adapters beyond those given all go to the last one
+	device_p = devices_pG[(bus < deviceCnt_G)? bus : ((deviceCnt_G > 0)? deviceCnt_G - 1 : 0)];
+	chips_p = realloc(chips_pG, (chipCnt_G + 1) * sizeof(*chips_p));
+	if (chips_p == NULL)
+		return NULL;
+	chips_pG = chips_p;
+	chips_pG[chipCnt_G].bus = bus;
+	chips_pG[chipCnt_G].addr = addr;
+	chips_pG[chipCnt_G].dev_p = mcp23017__open(device_p, addr, altRegAddr_G);
+	if (chips_pG[chipCnt_G].dev_p == NULL) {
+		fprintf(stderr, "can't open chip 0x%02x on %s\n", addr, device_p);
+		return NULL;
+	}
+	return chips_pG[chipCnt_G++].dev_p;
+}
+
+// records a run with 'len' bytes of kept data should have
+static unsigned
+run_recs (const Mcp23017TraceRec_t *rec_p)
+{
+	// a failed read kept no data
+	if ((rec_p->flags & MCP23017_TRACE_READ) && (rec_p->result != 0))
+		return 1;
+	if (rec_p->len <= MCP23017_TRACE_DATA)
+		return 1;
+	return (rec_p->len + MCP23017_TRACE_DATA - 1u) / MCP23017_TRACE_DATA;
+}
+
+int
+main (int argc, char *argv[])
+{
+	Mcp23017TraceRec_t *recs_p = NULL;
+	Mcp23017Batch_t *batch_p = NULL;
+	Mcp23017TraceRec_t *rec_p;
+	Run_t *runs_p = NULL;
+	uint8_t *data_p = NULL;
+	uint8_t *rd_p = NULL;
+	unsigned recCnt, runCnt, i, j, end, k, n;
+	size_t dataLen;
+	int result;
+	uint64_t t0, start, t1, traceNs = 0, replayNs = 0, traceSpan;
+	unsigned xfers = 0, readDiffs = 0, resultDiffs = 0, printed = 0;
+	int ret = 1;
+
+	if (!process_cmdline_args(argc, argv)) {
+		printf("cmdline error\n");
+		return 1;
+	}
+	if (trace_pG == NULL) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	recs_p = mcp23017__trace_load(trace_pG, &recCnt);
+	if (recs_p == NULL) {
+		fprintf(stderr, "can't load trace %s: %s\n", trace_pG, strerror(errno));
+		return 1;
+	}
+
+	// gather each run's records; a run that didn't keep all of its data
+	// can't be replayed faithfully
+	runs_p = malloc((recCnt > 0? recCnt : 1) * sizeof(*runs_p));
+	if (runs_p == NULL) {
+		perror("malloc()");
+		goto done;
+	}
+	runCnt = 0;
+	dataLen = 0;
+	for (i = 0; i < recCnt; i = end) {
+		for (end = i + 1; (end < recCnt) && (recs_p[end].flags & MCP23017_TRACE_CONT); ++end)
+			;
+		rec_p = &recs_p[i];
+		if (rec_p->flags & MCP23017_TRACE_CONT)
+			continue;
+		if ((rec_p->flags & MCP23017_TRACE_TRUNC) || (end - i != run_recs(rec_p))) {
+			fprintf(stderr, "record %u (bus %u, 0x%02x, reg 0x%02x, %u bytes): data incomplete, "
+					"trace with a bigger ring\n", i, rec_p->bus, rec_p->addr, rec_p->reg, rec_p->len);
+			goto done;
+		}
+		runs_p[runCnt].rec = i;
+		runs_p[runCnt].recCnt = end - i;
+		runs_p[runCnt].off = dataLen;
+		runs_p[runCnt].idx = -1;
+		++runCnt;
+		dataLen += rec_p->len;
+	}
+	if (runCnt == 0) {
+		printf("empty trace\n");
+		ret = 0;
+		goto done;
+	}
+
+	// the traced bytes: what to write, or what a read returned
+	batch_p = mcp23017__batch_new();
+	data_p = calloc(dataLen + 1, 1);
+	rd_p = calloc(dataLen + 1, 1);
+	if ((batch_p == NULL) || (data_p == NULL) || (rd_p == NULL)) {
+		perror("malloc()");
+		goto done;
+	}
+	for (i = 0; i < runCnt; ++i) {
+		rec_p = &recs_p[runs_p[i].rec];
+		for (k = 0; k < runs_p[i].recCnt; ++k) {
+			n = rec_p->len - k * MCP23017_TRACE_DATA;
+			if (n > MCP23017_TRACE_DATA)
+				n = MCP23017_TRACE_DATA;
+			memcpy(&data_p[runs_p[i].off + k * MCP23017_TRACE_DATA], rec_p[k].data, n);
+		}
+	}
+
+	// open everything up front so it isn't part of the replay
+	for (i = 0; i < runCnt; ++i)
+		if (chip_get(recs_p[runs_p[i].rec].bus, recs_p[runs_p[i].rec].addr) == NULL)
+			goto done;
+	if ((out_pG != NULL) && !mcp23017__trace_start(recCnt * 2)) {
+		fprintf(stderr, "can't start tracing\n");
+		goto done;
+	}
+
+	traceSpan = recs_p[runs_p[runCnt - 1].rec].ts - recs_p[runs_p[0].rec].ts;
+	t0 = now_ns();
+	for (i = 0; i < runCnt; i = end) {
+		for (end = i + 1; (end < runCnt) && !(recs_p[runs_p[end].rec].flags & MCP23017_TRACE_FIRST); ++end)
+			;
+
+		// each traced run goes out as one run, as it was traced
+		mcp23017__batch_reset(batch_p);
+		for (j = i; j < end; ++j) {
+			rec_p = &recs_p[runs_p[j].rec];
+			if (rec_p->len == 0)
+				continue;
+			runs_p[j].idx = mcp23017__batch_add_raw(batch_p, chip_get(rec_p->bus, rec_p->addr), rec_p->reg,
+					(rec_p->flags & MCP23017_TRACE_READ) != 0, (rec_p->flags & MCP23017_TRACE_FIXED) != 0,
+					(rec_p->flags & MCP23017_TRACE_READ)? &rd_p[runs_p[j].off] : &data_p[runs_p[j].off],
+					rec_p->len);
+		}
+
+		if (timing_G)
+			sleep_until(t0 + (recs_p[runs_p[i].rec].ts - recs_p[runs_p[0].rec].ts));
+		start = now_ns();
+		mcp23017__batch_submit(batch_p);
+		replayNs += now_ns() - start;
+		traceNs += recs_p[runs_p[i].rec].durNs;
+		++xfers;
+
+		// compare each run's outcome and data with the trace
+		for (j = i; j < end; ++j) {
+			rec_p = &recs_p[runs_p[j].rec];
+			result = (runs_p[j].idx >= 0)? mcp23017__batch_result(batch_p, (unsigned)runs_p[j].idx) : 0;
+			if (result != rec_p->result) {
+				++resultDiffs;
+				if (verbose_G && (printed++ < MISMATCH_PRINT_MAX))
+					printf("run %u (bus %u, 0x%02x, reg 0x%02x): result %d, traced %d\n",
+							j, rec_p->bus, rec_p->addr, rec_p->reg, result, rec_p->result);
+				continue;
+			}
+			if (!(rec_p->flags & MCP23017_TRACE_READ) || (result != 0))
+				continue;
+			for (k = 0; k < rec_p->len; ++k)
+				if (rd_p[runs_p[j].off + k] != data_p[runs_p[j].off + k])
+					break;
+			if (k < rec_p->len) {
+				++readDiffs;
+				if (verbose_G && (printed++ < MISMATCH_PRINT_MAX))
+					printf("run %u (bus %u, 0x%02x, reg 0x%02x): byte %u read 0x%02x, traced 0x%02x\n",
+							j, rec_p->bus, rec_p->addr, rec_p->reg, k,
+							rd_p[runs_p[j].off + k], data_p[runs_p[j].off + k]);
+			}
+		}
+	}
+	t1 = now_ns();
+
+	if ((out_pG != NULL) && !mcp23017__trace_save(out_pG))
+		goto done;
+
+	printf("transfers:         %u (%u runs)\n", xfers, runCnt);
+	printf("wall time:         %.3f ms (traced %.3f ms)\n", (double)(t1 - t0) / 1e6, (double)traceSpan / 1e6);
+	printf("bus time:          %.3f ms (traced %.3f ms)\n", (double)replayNs / 1e6, (double)traceNs / 1e6);
+	printf("per transfer:      %.1f us (traced %.1f us)\n",
+			(double)replayNs / 1e3 / xfers, (double)traceNs / 1e3 / xfers);
+	printf("reads differing:   %u\n", readDiffs);
+	printf("results differing: %u\n", resultDiffs);
+	ret = ((readDiffs == 0) && (resultDiffs == 0))? 0 : 2;
+
+done:
+	mcp23017__trace_stop();
+	for (i = 0; i < chipCnt_G; ++i)
+		mcp23017__close(chips_pG[i].dev_p);
+	free(chips_pG);
+	mcp23017__batch_free(batch_p);
+	free(rd_p);
+	free(data_p);
+	free(runs_p);
+	free(recs_p);
+	return ret;
+}
+
+static void
+usage (char *cmd_p)
+{
+	printf("%s\n\n", PACKAGE_STRING);
+	if (cmd_p != NULL)
+		printf("%s [options] <trace>\n", cmd_p);
+	printf("  options\n");
+	printf(" -h|--help         Print usage help and exit successfully\n");
+	printf(" -d|--device <d>   Replay the trace's next adapter on device <d>; the last\n");
+	printf("                   one given also takes any further adapters\n");
+	printf("                   (default:%sreplay)\n", MCP23017_SIM_PREFIX);
+	printf(" -1|--bank1        Open chips with IOCON.BANK=1 (default:IOCON.BANK=0)\n");
+	printf(" -n|--no-timing    Replay back to back instead of at the traced times\n");
+	printf(" -o|--output <f>   Save a trace of the replay to <f>\n");
+	printf(" -v|--verbose      Print the first %d differences\n", MISMATCH_PRINT_MAX);
+	printf("  exit status: 0 same behaviour, 2 differences, 1 error\n");
+}
+
+static bool
+process_cmdline_args (int argc, char *argv[])
+{
+	int c;
+	struct option longOpts[] = {
+		{"help",      no_argument,       NULL, 'h'},
+		{"device",    required_argument, NULL, 'd'},
+		{"bank1",     no_argument,       NULL, '1'},
+		{"no-timing", no_argument,       NULL, 'n'},
+		{"output",    required_argument, NULL, 'o'},
+		{"verbose",   no_argument,       NULL, 'v'},
+		{NULL,        0,                 NULL,  0},
+	};
+
+	while (1) {
+		c = getopt_long(argc, argv, "hd:1no:v", longOpts, NULL);
+		if (c == -1)
+			break;
+		switch (c) {
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+				break;
+
+			case 'd':
+				if (deviceCnt_G == DEVICES_MAX) {
+					fprintf(stderr, "too many devices\n");
+					return false;
+				}
+				devices_pG[deviceCnt_G++] = optarg;
+				break;
+
+			case '1':
+				altRegAddr_G = true;
+				break;
+
+			case 'n':
+				timing_G = false;
+				break;
+
+			case 'o':
+				out_pG = optarg;
+				break;
+
+			case 'v':
+				verbose_G = true;
+				break;
+
+			default:
+				printf("getopt error: %c (0x%x)\n", c, c);
+				return false;
+		}
+	}
+
+	if (optind < argc)
+		trace_pG = argv[optind];
+	return true;
+}
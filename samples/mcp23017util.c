@@ -8,7 +8,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <getopt.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -26,6 +28,19 @@ static bool freeDeviceString_G = false;
 static uint8_t i2cAddr_G = 0x20;
 static bool altRegAddr_G = false;
 static bool run_G = true;
+static char *batchFile_pG = NULL;
+
+// batch mode: output changes and reads not yet sent to the chip
+typedef struct {
+	unsigned line;          // first command merged in
+	uint16_t andMask;       // new = (old & andMask) ^ xorMask
+	uint16_t xorMask;
+} PendingWrite_t;
+
+typedef struct {
+	unsigned line[2];       // commands reading port A/B, 0 if none
+	bool both;              // "r AB"
+} PendingRead_t;
 
 static void usage (char *cmd_p);
 static bool process_cmdline_args (int argc, char *argv[]);
@@ -33,17 +48,25 @@ static void print_menu (void);
 static void process_cmd (void);
 static bool reset (void);
 static void cleanup (void);
+static int run_batch (const char *file_p);
 
 int
 main (int argc, char *argv[])
 {
-	int fd;
+	int fd, ret;
 
 	if (!process_cmdline_args(argc, argv)) {
 		printf("cmdline error\n");
 		return 1;
 	}
 
+	if (batchFile_pG != NULL) {
+		ret = run_batch(batchFile_pG);
+		if (freeDeviceString_G)
+			free(i2cDevice_pG);
+		return ret;
+	}
+
 	// setup GPIO#4 (on RPi) as /RESET
 	fd = open("/sys/class/gpio/export", O_WRONLY);
 	if (fd == -1) {
@@ -121,6 +144,12 @@ reset (void)
 	} while ((val1 != 0xff) && (val2 != 0x00));
 	close(fd);
 
+	// the chip's registers went back to their POR values underneath the library
+	if (!mcp23017__cache_resync()) {
+		fprintf(stderr, "register cache resync error\n");
+		return false;
+	}
+
 	if (!mcp23017__set_output_pins(0xff, 0xff)) {
 		fprintf(stderr, "output pin setting error\n");
 		return false;
@@ -272,6 +301,250 @@ process_cmd (void)
 	}
 }
 
+/*
+ * batch mode
+ * one command per line, '#' starts a comment:
+ *	w A|B|AB <val>          write a port (AB: port A in the low byte)
+ *	r A|B|AB                read a port
+ *	set GPxN / clr GPxN     set/clear one output pin
+ *	out <maskA> <maskB>     make pins outputs
+ *	in <maskA> <maskB>      make pins inputs
+ *	reg <addr>              read a register
+ *	sleep <n>[us|ms|s]
+ * runs of output changes (w, set, clr) are merged into one masked write,
+ * and runs of port reads into one 16-bit read where they cover both ports
+ * each result is printed as "<line> <what> <value>"; the first error is
+ * printed as "<line> error <reason>" and stops the batch
+ */
+static bool
+flush_write (PendingWrite_t *wr_p)
+{
+	bool ok = true;
+
+	if (wr_p->andMask != 0xffff) {
+		ok = mcp23017__write_masked((uint16_t)~wr_p->andMask, wr_p->xorMask);
+		if (!ok)
+			printf("%u error %s\n", wr_p->line, strerror(errno));
+	}
+	wr_p->andMask = 0xffff;
+	wr_p->xorMask = 0;
+	return ok;
+}
+
+static bool
+flush_read (PendingRead_t *rd_p)
+{
+	uint16_t val16;
+	uint8_t val;
+	bool ok = true;
+
+	if (rd_p->both || (rd_p->line[0] && rd_p->line[1])) {
+		ok = mcp23017__read_port16(&val16);
+		if (!ok)
+			printf("%u error %s\n", rd_p->line[0]? rd_p->line[0] : rd_p->line[1], strerror(errno));
+		else if (rd_p->both)
+			printf("%u AB 0x%04x\n", rd_p->line[0], val16);
+		else {
+			printf("%u A 0x%02x\n", rd_p->line[0], val16 & 0xff);
+			printf("%u B 0x%02x\n", rd_p->line[1], val16 >> 8);
+		}
+	}
+	else if (rd_p->line[0]) {
+		ok = mcp23017__get_portA(&val);
+		if (!ok)
+			printf("%u error %s\n", rd_p->line[0], strerror(errno));
+		else
+			printf("%u A 0x%02x\n", rd_p->line[0], val);
+	}
+	else if (rd_p->line[1]) {
+		ok = mcp23017__get_portB(&val);
+		if (!ok)
+			printf("%u error %s\n", rd_p->line[1], strerror(errno));
+		else
+			printf("%u B 0x%02x\n", rd_p->line[1], val);
+	}
+
+	memset(rd_p, 0, sizeof(*rd_p));
+	return ok;
+}
+
+static bool
+parse_port (const char *str_p, uint16_t *mask_p)
+{
+	if (strcmp(str_p, "A") == 0)
+		*mask_p = 0x00ff;
+	else if (strcmp(str_p, "B") == 0)
+		*mask_p = 0xff00;
+	else if (strcmp(str_p, "AB") == 0)
+		*mask_p = 0xffff;
+	else
+		return false;
+	return true;
+}
+
+// one command; false stops the batch
+static bool
+batch_cmd (char *cmd_p, unsigned line, PendingWrite_t *wr_p, PendingRead_t *rd_p)
+{
+	char verb[8], arg[8], unit[4];
+	unsigned v1, v2;
+	uint16_t mask, bit;
+	uint8_t val;
+	char port;
+	int n;
+	struct timespec ts;
+	bool ok = true;
+
+	n = sscanf(cmd_p, "%7s %7s", verb, arg);
+	if (n < 1)
+		return true;
+
+	if (strcmp(verb, "w") == 0) {
+		if ((n != 2) || !parse_port(arg, &mask) || (sscanf(cmd_p, "%*s %*s %i", &v1) != 1)
+				|| (v1 > ((mask == 0xffff)? 0xffffu : 0xffu)))
+			goto syntax;
+		if (!flush_read(rd_p))
+			return false;
+		if (wr_p->andMask == 0xffff)
+			wr_p->line = line;
+		if (mask == 0xff00)
+			v1 <<= 8;
+		wr_p->andMask &= (uint16_t)~mask;
+		wr_p->xorMask = (uint16_t)((wr_p->xorMask & ~mask) | v1);
+		return true;
+	}
+
+	if ((strcmp(verb, "set") == 0) || (strcmp(verb, "clr") == 0)) {
+		if ((n != 2) || (sscanf(arg, "GP%c%u", &port, &v1) != 2) || ((port != 'A') && (port != 'B')) || (v1 > 7))
+			goto syntax;
+		if (!flush_read(rd_p))
+			return false;
+		if (wr_p->andMask == 0xffff)
+			wr_p->line = line;
+		bit = (uint16_t)(1u << (v1 + ((port == 'B')? 8 : 0)));
+		wr_p->andMask &= (uint16_t)~bit;
+		if (verb[0] == 's')
+			wr_p->xorMask |= bit;
+		else
+			wr_p->xorMask &= (uint16_t)~bit;
+		return true;
+	}
+
+	if (strcmp(verb, "r") == 0) {
+		if ((n != 2) || !parse_port(arg, &mask))
+			goto syntax;
+		if (!flush_write(wr_p))
+			return false;
+		// a port already waiting to be read is read first
+		if (rd_p->both || ((mask & 0x00ff) && rd_p->line[0]) || ((mask & 0xff00) && rd_p->line[1]))
+			if (!flush_read(rd_p))
+				return false;
+		if (mask == 0xffff) {
+			if (rd_p->line[0] || rd_p->line[1])
+				if (!flush_read(rd_p))
+					return false;
+			rd_p->both = true;
+			rd_p->line[0] = line;
+		}
+		else
+			rd_p->line[(mask == 0x00ff)? 0 : 1] = line;
+		return true;
+	}
+
+	// everything else runs on its own
+	if (!flush_write(wr_p) || !flush_read(rd_p))
+		return false;
+
+	if ((strcmp(verb, "out") == 0) || (strcmp(verb, "in") == 0)) {
+		if ((sscanf(cmd_p, "%*s %i %i", &v1, &v2) != 2) || (v1 > 0xff) || (v2 > 0xff))
+			goto syntax;
+		if (verb[0] == 'o')
+			ok = mcp23017__set_output_pins((uint8_t)v1, (uint8_t)v2);
+		else
+			ok = mcp23017__set_input_pins((uint8_t)v1, (uint8_t)v2);
+	}
+	else if (strcmp(verb, "reg") == 0) {
+		if ((sscanf(cmd_p, "%*s %i", &v1) != 1) || (v1 > 0xff))
+			goto syntax;
+		ok = mcp23017__get_reg((uint8_t)v1, &val);
+		if (ok)
+			printf("%u reg 0x%02x 0x%02x\n", line, v1, val);
+	}
+	else if (strcmp(verb, "sleep") == 0) {
+		unit[0] = '\0';
+		if (sscanf(cmd_p, "%*s %u%3s", &v1, unit) < 1)
+			goto syntax;
+		if ((unit[0] == '\0') || (strcmp(unit, "s") == 0))
+			v1 *= 1000000;
+		else if (strcmp(unit, "ms") == 0)
+			v1 *= 1000;
+		else if (strcmp(unit, "us") != 0)
+			goto syntax;
+		ts.tv_sec = (time_t)(v1 / 1000000);
+		ts.tv_nsec = (long)(v1 % 1000000) * 1000;
+		while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+			;
+	}
+	else
+		goto syntax;
+
+	if (!ok)
+		printf("%u error %s\n", line, strerror(errno));
+	return ok;
+
+syntax:
+	printf("%u error syntax\n", line);
+	return false;
+}
+
+/*
+ * run the commands in 'file_p' ("-": stdin)
+ * returns the exit status
+ */
+static int
+run_batch (const char *file_p)
+{
+	FILE *file;
+	char *buf_p = NULL;
+	size_t bufLen = 0;
+	unsigned line = 0;
+	PendingWrite_t wr = { 0, 0xffff, 0 };
+	PendingRead_t rd;
+	bool ok = true;
+
+	if (strcmp(file_p, "-") == 0)
+		file = stdin;
+	else {
+		file = fopen(file_p, "r");
+		if (file == NULL) {
+			perror(file_p);
+			return 1;
+		}
+	}
+
+	if (!mcp23017__init(i2cDevice_pG, &i2cAddr_G, altRegAddr_G)) {
+		fprintf(stderr, "mcp23017 library init error\n");
+		ok = false;
+		goto done;
+	}
+
+	memset(&rd, 0, sizeof(rd));
+	while (ok && (getline(&buf_p, &bufLen, file) >= 0)) {
+		++line;
+		buf_p[strcspn(buf_p, "#\n")] = '\0';
+		ok = batch_cmd(buf_p, line, &wr, &rd);
+	}
+	if (ok)
+		ok = flush_write(&wr) && flush_read(&rd);
+	mcp23017__cleanup();
+
+done:
+	free(buf_p);
+	if (file != stdin)
+		fclose(file);
+	return ok? 0 : 1;
+}
+
 static void
 usage (char *cmd_p)
 {
@@ -283,6 +556,7 @@ usage (char *cmd_p)
 	printf(" -d|--device <d>   Use i2c device <d> (default:/dev/i2c-1)\n");
 	printf(" -a|--address <a>  Use i2c device address <a> (default:0x20)\n");
 	printf(" -1|--bank1        Use IOCON.BANK=1 (default:IOCON.BANK=0)\n");
+	printf(" -b|--batch <f>    Run the commands in file <f> ('-' for stdin) and exit\n");
 }
 
 static bool
@@ -295,11 +569,12 @@ process_cmdline_args (int argc, char *argv[])
 		{"device",  required_argument, NULL, 'd'},
 		{"address", required_argument, NULL, 'a'},
 		{"bank1",   no_argument,       NULL, '1'},
+		{"batch",   required_argument, NULL, 'b'},
 		{NULL,      0,                 NULL,  0},
 	};
 
 	while (1) {
-		c = getopt_long(argc, argv, "hd:a:1", longOpts, NULL);
+		c = getopt_long(argc, argv, "hd:a:1b:", longOpts, NULL);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -329,6 +604,10 @@ process_cmdline_args (int argc, char *argv[])
 				altRegAddr_G = true;
 				break;
 
+			case 'b':
+				batchFile_pG = optarg;
+				break;
+
 			default:
 				printf("getopt error: %c (0x%x)\n", c, c);
 				break;